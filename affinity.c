@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef HAVEOMP
+#include <omp.h>
+#endif
+
+#include "affinity.h"
+#include "pool.h"
+
+#define NODEDIR "/sys/devices/system/node"
+
+/* CPUs of each node, in node order */
+static struct {
+	int nodes;
+	int ncpus;
+	int *cpus;
+	int *cpu_node;
+} topo;
+
+static enum affinity_policy policy = AFFINITY_NONE;
+
+/* node of each thread, set by affinity_apply */
+static int *thread_node;
+static int nthreads;
+
+/* traffic of the last run, per node */
+static struct {
+	int threads;
+	size_t bytes;
+	double seconds;
+} *traffic;
+/* accounted from OpenMP threads and pool threads alike */
+static pthread_mutex_t traffic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *policy_names[] = { "none", "compact", "scatter" };
+
+static int thread_num(void)
+{
+	return pool_thread_num();
+}
+
+static void add_cpu(int cpu, int node)
+{
+	topo.cpus = realloc(topo.cpus, (topo.ncpus + 1) * sizeof(int));
+	topo.cpu_node = realloc(topo.cpu_node,
+			(topo.ncpus + 1) * sizeof(int));
+	topo.cpus[topo.ncpus] = cpu;
+	topo.cpu_node[topo.ncpus] = node;
+	topo.ncpus++;
+}
+
+/**
+ * Reads a cpulist ("0-3,8-11") of node from sysfs. Returns -1 if the node
+ * doesn't exist.
+ */
+static int read_node(int node)
+{
+	char fname[64];
+	int a, b, c;
+	FILE *f;
+
+	snprintf(fname, sizeof(fname), NODEDIR "/node%d/cpulist", node);
+	f = fopen(fname, "r");
+	if (!f)
+		return -1;
+
+	while (fscanf(f, "%d", &a) == 1) {
+		b = a;
+		c = getc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &b) != 1)
+				break;
+			c = getc(f);
+		}
+		for (; a <= b; a++)
+			add_cpu(a, node);
+		if (c != ',')
+			break;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void read_topology(void)
+{
+	long i, n;
+
+	if (topo.nodes)
+		return;
+
+	while (read_node(topo.nodes) == 0)
+		topo.nodes++;
+
+	/* no NUMA information: one node with all CPUs */
+	if (!topo.nodes || !topo.ncpus) {
+		topo.nodes = 1;
+		topo.ncpus = 0;
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		for (i = 0; i < (n > 0 ? n : 1); i++)
+			add_cpu(i, 0);
+	}
+
+	traffic = calloc(topo.nodes, sizeof(traffic[0]));
+}
+
+int affinity_parse(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+		if (!strcmp(name, policy_names[i]))
+			return i;
+	return -1;
+}
+
+void affinity_set(enum affinity_policy p)
+{
+	policy = p;
+}
+
+int affinity_pinned(void)
+{
+	return policy != AFFINITY_NONE;
+}
+
+int affinity_nodes(void)
+{
+	read_topology();
+	return topo.nodes;
+}
+
+/**
+ * Returns the index in topo.cpus of the CPU for thread t.
+ */
+static int cpu_index(int t)
+{
+	int node, per_node, i, seen;
+
+	if (policy == AFFINITY_COMPACT)
+		return t % topo.ncpus;
+
+	/* scatter: (t / nodes)-th CPU of node t % nodes */
+	node = t % topo.nodes;
+	per_node = 0;
+	for (i = 0; i < topo.ncpus; i++)
+		per_node += topo.cpu_node[i] == node;
+	if (!per_node)
+		return t % topo.ncpus;
+
+	seen = (t / topo.nodes) % per_node;
+	for (i = 0; i < topo.ncpus; i++)
+		if (topo.cpu_node[i] == node && !seen--)
+			break;
+	return i;
+}
+
+void affinity_apply(void)
+{
+	int n = 1;
+
+	read_topology();
+	memset(traffic, 0, topo.nodes * sizeof(traffic[0]));
+
+#ifdef HAVEOMP
+	n = omp_get_max_threads();
+#endif
+	if (n > nthreads) {
+		thread_node = realloc(thread_node, n * sizeof(int));
+		nthreads = n;
+	}
+	memset(thread_node, 0, nthreads * sizeof(int));
+
+	if (policy == AFFINITY_NONE)
+		return;
+
+#ifdef HAVEOMP
+#pragma omp parallel
+#endif
+	affinity_pin(thread_num());
+}
+
+void affinity_pin(int t)
+{
+	int i = cpu_index(t);
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(topo.cpus[i], &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		perror("sched_setaffinity");
+	if (t < nthreads)
+		thread_node[t] = topo.cpu_node[i];
+}
+
+int affinity_node(void)
+{
+	int t = thread_num();
+
+	return t < nthreads ? thread_node[t] : 0;
+}
+
+int affinity_node_leader(void)
+{
+	int t = thread_num(), i, node = affinity_node();
+
+	for (i = 0; i < t && i < nthreads; i++)
+		if (thread_node[i] == node)
+			return 0;
+	return 1;
+}
+
+void *node_alloc(size_t bytes)
+{
+	void *p;
+
+	/* fresh anonymous pages are placed on first touch */
+	p = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+void node_free(void *p, size_t bytes)
+{
+	munmap(p, bytes ? bytes : 1);
+}
+
+void affinity_account(size_t bytes, double seconds)
+{
+	int node = affinity_node();
+
+	pthread_mutex_lock(&traffic_lock);
+	traffic[node].threads++;
+	traffic[node].bytes += bytes;
+	if (seconds > traffic[node].seconds)
+		traffic[node].seconds = seconds;
+	pthread_mutex_unlock(&traffic_lock);
+}
+
+void affinity_report(void)
+{
+	int i;
+
+	read_topology();
+	printf("Affinity: %s\n", policy_names[policy]);
+	for (i = 0; i < topo.nodes; i++) {
+		if (!traffic[i].threads)
+			continue;
+		printf("Node %d: %3d threads %9.3f GB/s\n", i,
+				traffic[i].threads,
+				traffic[i].seconds ? traffic[i].bytes /
+				traffic[i].seconds / 1e9 : 0);
+	}
+}
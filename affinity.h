@@ -0,0 +1,83 @@
+#ifndef AFFINITY_H__
+#define AFFINITY_H__
+
+#include <stddef.h>
+
+/**
+ * Thread placement policies:
+ * 	- none: threads are not pinned, data is not replicated
+ * 	- compact: fill the CPUs of node 0 first, then node 1, ...
+ * 	- scatter: spread threads round-robin over the nodes
+ * With compact and scatter on more than one node, the IR engine replicates
+ * the query and the prime on each node; the other engines only pin.
+ */
+enum affinity_policy {
+	AFFINITY_NONE,
+	AFFINITY_COMPACT,
+	AFFINITY_SCATTER
+};
+
+/**
+ * Returns the policy called name, or -1 if unknown.
+ */
+int affinity_parse(const char *name);
+
+/**
+ * Sets the policy used by affinity_apply.
+ */
+void affinity_set(enum affinity_policy policy);
+
+/**
+ * Pins the threads of the next parallel regions according to the policy and
+ * remembers the node of each thread. Also clears the per-node traffic
+ * counts. Called before each server run.
+ */
+void affinity_apply(void);
+
+/**
+ * Pins the calling thread as thread t of the policy (after affinity_apply),
+ * for threads that are not OpenMP ones.
+ */
+void affinity_pin(int t);
+
+/**
+ * Returns 1 if threads are pinned (policy other than none).
+ */
+int affinity_pinned(void);
+
+/**
+ * Returns the number of NUMA nodes (read from sysfs, 1 if unknown).
+ */
+int affinity_nodes(void);
+
+/**
+ * Returns the node the calling thread is pinned to, 0 if threads are not
+ * pinned.
+ */
+int affinity_node(void);
+
+/**
+ * Returns 1 if the calling thread is the lowest numbered thread pinned to its
+ * node, i.e. the one that should first-touch data replicated per node.
+ */
+int affinity_node_leader(void);
+
+/**
+ * Allocates bytes of memory whose pages are placed on the node of the thread
+ * touching them first. Free with node_free.
+ */
+void *node_alloc(size_t bytes);
+
+void node_free(void *p, size_t bytes);
+
+/**
+ * Records that the calling thread moved bytes of data in seconds.
+ */
+void affinity_account(size_t bytes, double seconds);
+
+/**
+ * Prints the threads and the bandwidth of each node during the last run.
+ */
+void affinity_report(void);
+
+#endif
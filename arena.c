@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <gmp.h>
+
+#ifdef HAVEOMP
+#include <omp.h>
+#endif
+
+#include "arena.h"
+
+/* bytes of each thread's arena, blocks start at multiples of ARENAALIGN */
+#define ARENASIZE	(1 << 20)
+#define ARENAALIGN	16
+/* threads with an arena, the others use the previous functions */
+#define MAXARENAS	256
+
+struct arena {
+	size_t used;
+	int entered;
+	/* since arena_reset */
+	size_t peak;
+	size_t allocs;
+	size_t mallocs;
+	size_t reallocs;
+};
+
+static struct arena arenas[MAXARENAS];
+static int narenas;
+
+/**
+ * The arenas one after the other, ARENASIZE bytes each: reserved at once, so
+ * that the owner of a block is found from its address. Pages are placed on
+ * the node of the thread touching them first.
+ */
+static char *region;
+
+/* arena of the calling thread between arena_enter and arena_leave */
+static __thread struct arena *current;
+
+static void *(*prev_alloc)(size_t);
+static void *(*prev_realloc)(void *, size_t, size_t);
+static void (*prev_free)(void *, size_t);
+
+static int thread_num(void)
+{
+#ifdef HAVEOMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+static size_t block_size(size_t n)
+{
+	return (n + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+}
+
+static char *base(const struct arena *a)
+{
+	return region + (size_t)(a - arenas) * ARENASIZE;
+}
+
+/**
+ * Returns the arena holding p, NULL if p comes from the previous functions.
+ */
+static struct arena *owner(const void *p)
+{
+	const char *c = p;
+
+	if (c < region || c >= region + (size_t)narenas * ARENASIZE)
+		return NULL;
+	return &arenas[(c - region) / ARENASIZE];
+}
+
+/**
+ * Gives back the block p of n bytes if it is the last one of a. Others are
+ * only reclaimed when the arena is entered again.
+ */
+static void pop(struct arena *a, void *p, size_t n)
+{
+	if ((char *)p + block_size(n) == base(a) + a->used)
+		a->used -= block_size(n);
+}
+
+static void *arena_alloc(size_t n)
+{
+	struct arena *a = current;
+	void *p;
+
+	if (!a)
+		return prev_alloc(n);
+
+	if (block_size(n) > ARENASIZE - a->used) {
+		a->mallocs++;
+		return prev_alloc(n);
+	}
+
+	p = base(a) + a->used;
+	a->used += block_size(n);
+	if (a->used > a->peak)
+		a->peak = a->used;
+	a->allocs++;
+	return p;
+}
+
+static void *arena_realloc(void *p, size_t old, size_t n)
+{
+	struct arena *a = owner(p);
+	void *q;
+
+	if (current)
+		current->reallocs++;
+	if (!a)
+		return prev_realloc(p, old, n);
+
+	/* a growing mpz may outlive the arena: move it out */
+	q = prev_alloc(n);
+	memcpy(q, p, old < n ? old : n);
+	if (a == current)
+		pop(a, p, old);
+	return q;
+}
+
+static void arena_free(void *p, size_t n)
+{
+	struct arena *a = owner(p);
+
+	if (!a)
+		prev_free(p, n);
+	else if (a == current)
+		pop(a, p, n);
+}
+
+void arena_install(void)
+{
+	void *p;
+
+	if (prev_alloc)
+		return;
+
+	/* address space only, until the threads touch their arena */
+	p = mmap(NULL, (size_t)MAXARENAS * ARENASIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	region = p;
+	narenas = MAXARENAS;
+
+	mp_get_memory_functions(&prev_alloc, &prev_realloc, &prev_free);
+	mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+void arena_enter(void)
+{
+	int t = thread_num();
+	struct arena *a;
+
+	if (t >= narenas)
+		return;
+
+	a = &arenas[t];
+	a->used = 0;
+	a->entered = 1;
+	current = a;
+}
+
+void arena_leave(void)
+{
+	current = NULL;
+}
+
+void arena_reset(void)
+{
+	int i;
+
+	for (i = 0; i < narenas; i++) {
+		arenas[i].entered = 0;
+		arenas[i].peak = 0;
+		arenas[i].allocs = 0;
+		arenas[i].mallocs = 0;
+		arenas[i].reallocs = 0;
+	}
+}
+
+void arena_report(void)
+{
+	size_t allocs = 0, mallocs = 0, reallocs = 0, peak = 0;
+	int i, threads = 0;
+
+	for (i = 0; i < narenas; i++) {
+		if (!arenas[i].entered)
+			continue;
+		threads++;
+		allocs += arenas[i].allocs;
+		mallocs += arenas[i].mallocs;
+		reallocs += arenas[i].reallocs;
+		if (arenas[i].peak > peak)
+			peak = arenas[i].peak;
+	}
+	if (!threads)
+		return;
+
+	printf("GMP allocations (%d threads): %lu arena, %lu malloc, "
+			"%lu realloc, arena peak %lu bytes\n", threads,
+			allocs, mallocs, reallocs, peak);
+}
@@ -0,0 +1,50 @@
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <stddef.h>
+
+/**
+ * Per-thread bump allocators for GMP, so that the temporaries of mpz
+ * functions called from many threads don't contend in the global malloc.
+ *
+ * arena_install replaces the GMP memory functions once. Between arena_enter
+ * and arena_leave, blocks the calling thread allocates come from its arena
+ * and are released in LIFO order, as GMP does with its temporaries. Blocks
+ * that are reallocated (mpz growing) or don't fit are moved to, or taken
+ * from, the previous functions, so that they may outlive the arena. Outside
+ * arenas, the previous functions are used unchanged.
+ *
+ * GMP gives a number without space (mpz_init) its first block with the
+ * allocate function: numbers used past arena_leave must get their space
+ * before arena_enter, with mpz_init2.
+ */
+
+/**
+ * Installs the arena memory functions for GMP and reserves the arenas of up
+ * to 256 threads. Only the first call does something.
+ */
+void arena_install(void);
+
+/**
+ * Makes the calling thread allocate from its arena, which is empty again.
+ * Called in parallel regions, after arena_install.
+ */
+void arena_enter(void);
+
+/**
+ * Stops using the arena of the calling thread.
+ */
+void arena_leave(void);
+
+/**
+ * Clears the allocation counts of all threads. Called before each server run.
+ */
+void arena_reset(void);
+
+/**
+ * Prints the GMP allocations of each kind counted since arena_reset, and the
+ * peak size of the arenas. Prints nothing if no thread entered its arena.
+ */
+void arena_report(void);
+
+#endif
@@ -0,0 +1,128 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Returns the p-th quantile of n sorted samples, interpolating linearly
+ * between the closest ranks.
+ */
+static double quantile(const double *sorted, size_t n, double p)
+{
+	double pos = p * (n - 1);
+	size_t i = (size_t)pos;
+
+	if (i + 1 >= n)
+		return sorted[n - 1];
+	return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+void bench_stats(double *samples, size_t n, struct bench_stats *st)
+{
+	double sum = 0, sq = 0;
+	size_t i;
+
+	memset(st, 0, sizeof(*st));
+	if (!n)
+		return;
+
+	qsort(samples, n, sizeof(samples[0]), cmp_double);
+	st->median = quantile(samples, n, 0.5);
+	st->p5 = quantile(samples, n, 0.05);
+	st->p95 = quantile(samples, n, 0.95);
+
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+	st->mean = sum / n;
+
+	for (i = 0; i < n; i++)
+		sq += (samples[i] - st->mean) * (samples[i] - st->mean);
+	st->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+}
+
+int bench_open(struct bench_output *o, const char *csv, const char *json)
+{
+	memset(o, 0, sizeof(*o));
+
+	if (csv) {
+		o->csv = fopen(csv, "w");
+		if (!o->csv) {
+			perror(csv);
+			return -1;
+		}
+		fprintf(o->csv, "engine,keysize,n,k,threads,reps,"
+				"round_median,round_p5,round_p95,round_stddev,"
+				"mmps_median,mmps_p5,mmps_p95,mmps_stddev\n");
+	}
+
+	if (json) {
+		o->json = fopen(json, "w");
+		if (!o->json) {
+			perror(json);
+			if (o->csv)
+				fclose(o->csv);
+			return -1;
+		}
+		fprintf(o->json, "[");
+	}
+
+	return 0;
+}
+
+static void json_stats(FILE *f, const char *name,
+		const struct bench_stats *st)
+{
+	fprintf(f, "\"%s\": {\"median\": %.6f, \"p5\": %.6f, \"p95\": %.6f, "
+			"\"mean\": %.6f, \"stddev\": %.6f}",
+			name, st->median, st->p5, st->p95, st->mean,
+			st->stddev);
+}
+
+void bench_write(struct bench_output *o, const struct bench_row *row)
+{
+	if (o->csv) {
+		fprintf(o->csv, "%s,%lu,%lu,%lu,%d,%lu,"
+				"%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+				row->engine, row->keysize, row->n, row->k,
+				row->threads, row->reps,
+				row->round.median, row->round.p5,
+				row->round.p95, row->round.stddev,
+				row->mmps.median, row->mmps.p5,
+				row->mmps.p95, row->mmps.stddev);
+		fflush(o->csv);
+	}
+
+	if (o->json) {
+		fprintf(o->json, "%s\n  {\"engine\": \"%s\", \"keysize\": %lu, "
+				"\"n\": %lu, \"k\": %lu, \"threads\": %d, "
+				"\"reps\": %lu, ",
+				o->rows ? "," : "", row->engine, row->keysize,
+				row->n, row->k, row->threads, row->reps);
+		json_stats(o->json, "round_ms", &row->round);
+		fprintf(o->json, ", ");
+		json_stats(o->json, "mmps", &row->mmps);
+		fprintf(o->json, "}");
+		fflush(o->json);
+	}
+
+	o->rows++;
+}
+
+void bench_close(struct bench_output *o)
+{
+	if (o->csv)
+		fclose(o->csv);
+	if (o->json) {
+		fprintf(o->json, "\n]\n");
+		fclose(o->json);
+	}
+	memset(o, 0, sizeof(*o));
+}
@@ -0,0 +1,68 @@
+#ifndef BENCH_H__
+#define BENCH_H__
+
+#include <stdio.h>
+
+/**
+ * Summary of the samples of one measured quantity.
+ */
+struct bench_stats {
+	double median;
+	/* 5th and 95th percentile */
+	double p5;
+	double p95;
+	double mean;
+	/* sample standard deviation */
+	double stddev;
+};
+
+/**
+ * One point of a benchmark sweep.
+ */
+struct bench_row {
+	const char *engine;
+	size_t keysize;
+	/* database size (in bits) */
+	size_t n;
+	/* query length */
+	size_t k;
+	int threads;
+	/* measured runs, warm-up runs are not included */
+	size_t reps;
+	/* time per round (ms) */
+	struct bench_stats round;
+	/* millions of modular multiplications per second */
+	struct bench_stats mmps;
+};
+
+/**
+ * Machine readable output of a sweep, either file may be NULL.
+ */
+struct bench_output {
+	FILE *csv;
+	FILE *json;
+	size_t rows;
+};
+
+/**
+ * Computes the statistics of n samples. Sorts samples.
+ */
+void bench_stats(double *samples, size_t n, struct bench_stats *st);
+
+/**
+ * Opens the CSV and JSON output files, NULL names are skipped. Returns -1 if a
+ * file cannot be created.
+ */
+int bench_open(struct bench_output *o, const char *csv, const char *json);
+
+/**
+ * Appends row to the output files.
+ */
+void bench_write(struct bench_output *o, const struct bench_row *row);
+
+/**
+ * Finishes and closes the output files.
+ */
+void bench_close(struct bench_output *o);
+
+#endif
@@ -1,15 +1,43 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <gmp.h>
 
 #include "client.h"
+#include "globals.h"
+#include "numfile.h"
 
 #ifndef BASE
 #define BASE 10
 #endif
 
+static enum prime_form form = PRIME_FULL;
+
+static const char *form_names[] = { "full", "lazy", "mersenne" };
+
+int prime_form_parse(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(form_names) / sizeof(form_names[0]); i++)
+		if (!strcmp(name, form_names[i]))
+			return i;
+	return -1;
+}
+
+void prime_form_set(enum prime_form f)
+{
+	form = f;
+}
+
+enum prime_form prime_form_get(void)
+{
+	return form;
+}
+
 static char* get_query_numbers_filename(size_t keysize)
 {
 	char *fname = NULL;
@@ -17,13 +45,52 @@ static char* get_query_numbers_filename(size_t keysize)
 	return fname;
 }
 
+static char* get_binary_numbers_filename(size_t keysize)
+{
+	char *fname = NULL;
+	asprintf(&fname, "numberfiles/numbers_%lu_bits.bin", keysize);
+	return fname;
+}
+
+/**
+ * Returns -prime^-1 modulo 2^GMP_NUMB_BITS. The lower bits of it are the
+ * minvp needed by kernels using smaller limbs.
+ */
+static size_t compute_minvp(const mpz_t prime)
+{
+	mpz_t number, aux;
+	size_t minvp;
+
+	mpz_init(number);
+	mpz_init(aux);
+	mpz_ui_pow_ui(aux, 2, GMP_NUMB_BITS);
+	mpz_cdiv_r(number, prime, aux); /* number = prime mod 2^64 */
+	mpz_sub(number, aux, number); /* number = 2^64 - last_limb_of_prime */
+	mpz_invert(number, number, aux); /* number * number_old = 1 mod aux */
+	minvp = mpz_get_ui(number);
+
+	mpz_clear(number);
+	mpz_clear(aux);
+	return minvp;
+}
+
 /**
- * Tries to read query_length numbers from fname, including the prime.
+ * Computes r2 = R^2 `mod` prime, where R = 2^keysize is the Montgomery base.
+ */
+static void compute_r2(const mpz_t prime, size_t keysize, mpz_t r2)
+{
+	mpz_ui_pow_ui(r2, 2, 2 * keysize);
+	mpz_mod(r2, r2, prime);
+}
+
+/**
+ * Tries to read query_length numbers from fname, including the prime, minvp
+ * and R^2 `mod` prime (computed if the file is older and doesn't have it).
  * Returns -1 if file doesn't exist or is invalid. Returns the number of
  * numbers read, otherwise.
  */
 static int try_read(const char* fname, size_t keysize, size_t query_length,
-		mpz_t prime, size_t *minvp, mpz_t *numbers)
+		mpz_t prime, size_t *minvp, mpz_t r2, mpz_t *numbers)
 {
 	int read = -1;
 	size_t ks, i;
@@ -41,9 +108,20 @@ static int try_read(const char* fname, size_t keysize, size_t query_length,
 
 	read++;
 	mpz_init(prime);
+	mpz_init(r2);
 	if (!mpz_inp_str(prime, f, BASE))
 		goto end;
-	fscanf(f, "%lu", minvp);
+	/*
+	 * kept if it is -p^-1 `mod` 2^64, older files only store it modulo
+	 * 2^32 and are recomputed
+	 */
+	if (fscanf(f, "%lu", minvp) != 1 ||
+			mpz_getlimbn(prime, 0) * *minvp != (mp_limb_t)-1)
+		*minvp = compute_minvp(prime);
+
+	/* R^2 follows minvp on the same line, older files don't have it */
+	if (getc(f) != ' ' || !mpz_inp_str(r2, f, BASE))
+		compute_r2(prime, keysize, r2);
 
 	for (i = 0; i < query_length; i++, read++) {
 		if (!mpz_inp_str(numbers[i], f, BASE))
@@ -56,7 +134,7 @@ end:
 }
 
 static void write_back(const char* fname, size_t keysize, size_t query_length,
-		mpz_t prime, size_t minvp, const mpz_t *numbers)
+		mpz_t prime, size_t minvp, const mpz_t r2, const mpz_t *numbers)
 {
 	size_t i;
 	FILE *f;
@@ -68,7 +146,9 @@ static void write_back(const char* fname, size_t keysize, size_t query_length,
 	fprintf(f, "%lu\n", keysize);
 	mpz_out_str(f, BASE, prime);
 	fprintf(f, "\n");
-	fprintf(f, "%lu\n", minvp);
+	fprintf(f, "%lu ", minvp);
+	mpz_out_str(f, BASE, r2);
+	fprintf(f, "\n");
 
 	for (i = 0; i < query_length; i++) {
 		mpz_out_str(f, BASE, numbers[i]);
@@ -78,45 +158,265 @@ static void write_back(const char* fname, size_t keysize, size_t query_length,
 	fclose(f);
 }
 
-static void generate_prime(size_t keysize, mpz_t prime, size_t *minvp)
+static void generate_prime(size_t keysize, mpz_t prime, size_t *minvp,
+		mpz_t r2)
 {
-	mpz_t number, aux;
-
 	mpz_init(prime);
 	mpz_ui_pow_ui(prime, 2, keysize - 1);
 	mpz_nextprime(prime, prime);
+	*minvp = compute_minvp(prime);
+	mpz_init(r2);
+	compute_r2(prime, keysize, r2);
+}
 
-	mpz_init(number);
-	mpz_init(aux);
-	mpz_ui_pow_ui(aux, 2, 32);
-	mpz_cdiv_r(number, prime, aux); /* number = prime mod 2^32 */
-	mpz_sub(number, aux, number); /* number = 2^32 - last_limb_of_prime */
-	mpz_invert(number, number, aux); /* number * number_old = 1 mod aux */
-	*minvp = mpz_get_ui(number);
+/**
+ * Sets num to a uniformly random number below prime, drawn from r.
+ */
+static void random_number(mpz_t num, struct rng *r, const mpz_t prime)
+{
+	size_t bits = mpz_sizeinbase(prime, 2);
+	size_t n = (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS, i;
+	mp_limb_t *l;
 
-	mpz_clear(number);
-	mpz_clear(aux);
+	/* rejection sampling, less than 2 tries on average */
+	do {
+		l = mpz_limbs_write(num, n);
+		for (i = 0; i < n; i++)
+			l[i] = (mp_limb_t)rng_next(r);
+		if (bits % GMP_NUMB_BITS)
+			l[n - 1] &= ((mp_limb_t)1 << (bits % GMP_NUMB_BITS)) - 1;
+		mpz_limbs_finish(num, n);
+	} while (mpz_cmp(num, prime) >= 0);
 }
 
+/**
+ * Generates numbers num..query_length-1 in parallel. Number i is drawn from
+ * stream i of seed, so the result only depends on the seed.
+ */
 static void generate_numbers(size_t num, size_t query_length,
-		gmp_randstate_t state, mpz_t prime, mpz_t *numbers)
+		const struct seed *seed, const mpz_t prime, mpz_t *numbers)
+{
+	struct rng r;
+	size_t i;
+
+#ifdef HAVEOMP
+#pragma omp parallel for schedule(OMPSCHED) private(r)
+#endif
+	for (i = num; i < query_length; i++) {
+		rng_stream(&r, seed, i);
+		random_number(numbers[i], &r, prime);
+	}
+}
+
+/**
+ * Fills prime, minvp, r2 and the first query_length numbers from a mapped
+ * binary numberfile. Numbers stored in Montgomery representation are
+ * converted back.
+ */
+static void read_binary(const struct numfile *nf, size_t query_length,
+		mpz_t prime, size_t *minvp, mpz_t r2, mpz_t *numbers)
+{
+	mpz_t rinv;
+	size_t i;
+
+	mpz_init(prime);
+	mpz_init(r2);
+	numfile_get(prime, nf->prime, nf->stride);
+	numfile_get(r2, nf->r2, nf->stride);
+	*minvp = nf->minvp;
+	/* files written before minvp was kept on 64 bits */
+	if (mpz_getlimbn(prime, 0) * *minvp != (mp_limb_t)-1)
+		*minvp = compute_minvp(prime);
+
+	for (i = 0; i < query_length; i++)
+		numfile_get(numbers[i], &nf->numbers[i * nf->stride],
+				nf->stride);
+
+	if (!(nf->flags & NUMFILE_MONT))
+		return;
+
+	/* x = (x * R) * R^-1 `mod` prime */
+	mpz_init(rinv);
+	mpz_ui_pow_ui(rinv, 2, nf->keysize);
+	mpz_invert(rinv, rinv, prime);
+	for (i = 0; i < query_length; i++) {
+		mpz_mul(numbers[i], numbers[i], rinv);
+		mpz_mod(numbers[i], numbers[i], prime);
+	}
+	mpz_clear(rinv);
+}
+
+/**
+ * Returns the number of query numbers in the text numberfile fname (all lines
+ * after the keysize, prime and minvp ones), or -1 if it cannot be read.
+ */
+static int count_numbers(const char *fname)
+{
+	int lines = 0, c;
+	FILE *f;
+
+	f = fopen(fname, "r");
+	if (!f)
+		return -1;
+
+	while ((c = getc(f)) != EOF)
+		if (c == '\n')
+			lines++;
+
+	fclose(f);
+	return lines < 3 ? -1 : lines - 3;
+}
+
+int convert_numberfile(size_t keysize, int mont)
 {
-	while (num < query_length)
-		mpz_urandomm(numbers[num++], state, prime);
+	char *fname = get_query_numbers_filename(keysize);
+	char *bname = get_binary_numbers_filename(keysize);
+	int count, num, i, ret = -1;
+	mpz_t prime, r2, *numbers;
+	size_t minvp;
+
+	count = count_numbers(fname);
+	if (count < 0)
+		goto end;
+
+	numbers = calloc(count, sizeof(numbers[0]));
+	for (i = 0; i < count; i++)
+		mpz_init(numbers[i]);
+
+	num = try_read(fname, keysize, count, prime, &minvp, r2, numbers);
+	if (num == count && !numfile_write(bname, keysize, prime, minvp, r2,
+				count, (const mpz_t *)numbers,
+				mont ? NUMFILE_MONT : 0))
+		ret = count;
+
+	if (num >= 0) {
+		mpz_clear(prime);
+		mpz_clear(r2);
+	}
+	for (i = 0; i < count; i++)
+		mpz_clear(numbers[i]);
+	free(numbers);
+
+end:
+	free(fname);
+	free(bname);
+	return ret;
+}
+
+void make_client_query(size_t keysize, size_t query_length,
+		const struct seed *seed, uint64_t id, mpz_t prime,
+		size_t *minvp, mpz_t r2, mpz_t *numbers)
+{
+	size_t n = keysize / GMP_NUMB_BITS, i;
+	struct seed qseed = *seed;
+	struct rng r;
+	mp_limb_t *l;
+
+	/* streams of this query, apart from the numberfile ones */
+	for (i = 0; i < SEED_WORDS; i++)
+		qseed.w[i] ^= rng_mix(id + i + 1);
+
+	/*
+	 * like the numberfile prime, stay just above 2^(keysize - 1): IR
+	 * accumulators hold values below 2p in keysize bits, so the search
+	 * starts from a random offset of keysize / 2 bits. Lazy primes stay
+	 * just above 2^(keysize - 3) for 4p < R.
+	 */
+	mpz_init(prime);
+	rng_stream(&r, &qseed, query_length);
+	if (form == PRIME_MERSENNE) {
+		/* 2^keysize - c, the first prime is found after about
+		 * keysize ln(2) / 2 odd candidates, c stays far below 2^32 */
+		mpz_ui_pow_ui(prime, 2, keysize);
+		mpz_sub_ui(prime, prime, 1);
+		while (!mpz_probab_prime_p(prime, 25))
+			mpz_sub_ui(prime, prime, 2);
+		goto found;
+	}
+	l = mpz_limbs_write(prime, n);
+	for (i = 0; i < n; i++)
+		l[i] = i < n / 2 ? (mp_limb_t)rng_next(&r) : 0;
+	l[n - 1] |= (mp_limb_t)1 << (GMP_NUMB_BITS -
+			(form == PRIME_LAZY ? 3 : 1));
+	mpz_limbs_finish(prime, n);
+	mpz_nextprime(prime, prime);
+
+found:
+	*minvp = compute_minvp(prime);
+	mpz_init(r2);
+	compute_r2(prime, keysize, r2);
+
+	for (i = 0; i < query_length; i++)
+		mpz_init2(numbers[i], keysize);
+	generate_numbers(0, query_length, &qseed, prime, numbers);
+}
+
+void make_ko_query(size_t keysize, size_t query_length, size_t target,
+		const struct seed *seed, uint64_t id, mpz_t prime,
+		size_t *minvp, mpz_t r2, mpz_t *numbers)
+{
+	mpz_t qnr;
+	size_t i;
+
+	make_client_query(keysize, query_length, seed, id, prime, minvp, r2,
+			numbers);
+
+	/* squares of random numbers are random residues */
+#ifdef HAVEOMP
+#pragma omp parallel for schedule(OMPSCHED)
+#endif
+	for (i = 0; i < query_length; i++) {
+		mpz_mul(numbers[i], numbers[i], numbers[i]);
+		mpz_mod(numbers[i], numbers[i], prime);
+	}
+
+	/* the smallest non-residue is small */
+	mpz_init_set_ui(qnr, 2);
+	while (mpz_legendre(qnr, prime) != -1)
+		mpz_add_ui(qnr, qnr, 1);
+	mpz_mul(numbers[target], numbers[target], qnr);
+	mpz_mod(numbers[target], numbers[target], prime);
+	mpz_clear(qnr);
+}
+
+int ko_decode_bit(const mpz_t x, const mpz_t prime)
+{
+	return mpz_legendre(x, prime) == -1;
+}
+
+void ko_decode_number(const mpz_t *answers, size_t bits, const mpz_t prime,
+		mpz_t x)
+{
+	size_t i;
+
+	mpz_set_ui(x, 0);
+	for (i = 0; i < bits; i++)
+		if (ko_decode_bit(answers[i], prime))
+			mpz_setbit(x, i);
 }
 
 void get_client_query(size_t keysize, size_t query_length,
-		gmp_randstate_t state, mpz_t prime, size_t *minvp,
-		mpz_t *numbers)
+		const struct seed *seed, mpz_t prime, size_t *minvp,
+		mpz_t r2, mpz_t *numbers, struct numfile *nf)
 {
 	char *fname = get_query_numbers_filename(keysize);
+	char *bname = get_binary_numbers_filename(keysize);
 	int num, need_write=0;
 
-	num = try_read(fname, keysize, query_length, prime, minvp, numbers);
+	if (!numfile_map(bname, keysize, nf)) {
+		if (nf->count >= query_length) {
+			read_binary(nf, query_length, prime, minvp, r2,
+					numbers);
+			goto end;
+		}
+		numfile_unmap(nf);
+	}
+
+	num = try_read(fname, keysize, query_length, prime, minvp, r2, numbers);
 	if (num < 0) {
 		fprintf(stderr, "File invalid/missing\n");
 		fprintf(stderr, "Generating new prime..");
-		generate_prime(keysize, prime, minvp);
+		generate_prime(keysize, prime, minvp, r2);
 		fprintf(stderr, "OK\n");
 		num = 0; /* force regeneration of numbers */
 		need_write = 1; /* save everything back to file */
@@ -125,14 +425,22 @@ void get_client_query(size_t keysize, size_t query_length,
 	if ((size_t)num < query_length) {
 		fprintf(stderr, "Have %d / %lu numbers\n", num, query_length);
 		fprintf(stderr, "Generating missing numbers..");
-		generate_numbers(num, query_length, state, prime, numbers);
+		generate_numbers(num, query_length, seed, prime, numbers);
 		fprintf(stderr, "OK\n");
 		need_write = 1; /* save everything back to file */
 	}
 
 	if (need_write)
 		write_back(fname, keysize, query_length,
-				prime, *minvp, (const mpz_t *)numbers);
+				prime, *minvp, r2, (const mpz_t *)numbers);
+
+	/* next runs load the binary file */
+	if (numfile_write(bname, keysize, prime, *minvp, r2, query_length,
+				(const mpz_t *)numbers, 0) ||
+			numfile_map(bname, keysize, nf))
+		fprintf(stderr, "Cannot save binary numberfile %s\n", bname);
 
+end:
 	free(fname);
+	free(bname);
 }
@@ -1,10 +1,98 @@
 #ifndef CLIENT_H__
 #define CLIENT_H__
 
+#include <stdint.h>
+
 struct mpz_t;
+struct numfile;
+struct seed;
+
+/**
+ * Form of the primes of queries generated in memory (the numberfile prime is
+ * always a full one):
+ * 	- full: keysize bits, just above 2^(keysize - 1)
+ * 	- lazy: keysize - 2 bits, so that 4p < R and the ir engine leaves the
+ * 	  results of multiplications in [0, 2p)
+ * 	- mersenne: the largest prime below 2^keysize, 2^keysize - c with a
+ * 	  small c, which the ir engine reduces by folding instead of Montgomery
+ */
+enum prime_form {
+	PRIME_FULL,
+	PRIME_LAZY,
+	PRIME_MERSENNE
+};
+
+/**
+ * Returns the prime form called name, or -1 if unknown.
+ */
+int prime_form_parse(const char *name);
+
+/**
+ * Sets the form of the primes generated by make_client_query.
+ */
+void prime_form_set(enum prime_form form);
+
+/**
+ * Returns the form of the primes generated by make_client_query.
+ */
+enum prime_form prime_form_get(void);
 
+/**
+ * Reads (or generates) the prime, minvp = -prime^-1 `mod` 2^64, r2 = R^2 `mod`
+ * prime with R = 2^keysize and query_length query numbers. Missing numbers
+ * are generated in parallel from seed.
+ *
+ * The binary numberfile is preferred over the text one and is created from it
+ * when missing or too short. nf is left mapped so the numbers can be used in
+ * place (nf->map is NULL if that failed).
+ */
 void get_client_query(size_t keysize, size_t query_length,
-		gmp_randstate_t state, mpz_t prime, size_t *minvp,
-		mpz_t *numbers);
+		const struct seed *seed, mpz_t prime, size_t *minvp,
+		mpz_t r2, mpz_t *numbers, struct numfile *nf);
+
+/**
+ * Generates query id of a batch in memory, without numberfiles: a random
+ * prime between 2^(keysize - 1) and 2^(keysize - 1) + 2^(keysize / 2)
+ * (keysize a multiple of 128, keysize - 3 instead of keysize - 1 for lazy
+ * primes, the fixed largest prime below 2^keysize for mersenne ones) and
+ * query_length numbers below it, all drawn from seed and id. Initializes
+ * prime, r2 and numbers.
+ */
+void make_client_query(size_t keysize, size_t query_length,
+		const struct seed *seed, uint64_t id, mpz_t prime,
+		size_t *minvp, mpz_t r2, mpz_t *numbers);
+
+/**
+ * Like make_client_query, but for retrieving element target: all numbers are
+ * quadratic residues modulo prime except numbers[target]. An output is then a
+ * non-residue exactly when its database row selects target.
+ *
+ * Residuosity modulo a prime is public, so this only shows the client side
+ * of the protocol over the arithmetic the server benchmarks; a deployment
+ * would use a modulus whose factors only the client knows.
+ */
+void make_ko_query(size_t keysize, size_t query_length, size_t target,
+		const struct seed *seed, uint64_t id, mpz_t prime,
+		size_t *minvp, mpz_t r2, mpz_t *numbers);
+
+/**
+ * Returns 1 if x is a quadratic non-residue modulo prime (a selected bit of a
+ * make_ko_query answer), 0 otherwise.
+ */
+int ko_decode_bit(const mpz_t x, const mpz_t prime);
+
+/**
+ * Rebuilds in x the first level output selected by a second level query from
+ * its bits answers: bit i of x is the decoded answer of row i.
+ */
+void ko_decode_number(const mpz_t *answers, size_t bits, const mpz_t prime,
+		mpz_t x);
+
+/**
+ * Converts the whole text numberfile for keysize to a binary numberfile,
+ * storing the query numbers in Montgomery representation if mont is set.
+ * Returns the number of query numbers converted or -1 on error.
+ */
+int convert_numberfile(size_t keysize, int mont);
 
 #endif
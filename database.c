@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gmp.h>
+
+#include "database.h"
+#include "globals.h"
+
+#define DBDIR "dbfiles"
+#define MAGIC "PIRDB\0\0\1"
+#define MAGICLEN 8
+
+/* header of the database file, rows start right after it */
+struct db_header {
+	char magic[MAGICLEN];
+	uint64_t n;
+	uint64_t k;
+	uint64_t stride;
+	/* keep rows 64-byte aligned in the file (and in the mapping) */
+	uint64_t pad[4];
+};
+
+static char* get_database_filename(size_t n, size_t k)
+{
+	char *fname = NULL;
+	asprintf(&fname, DBDIR "/db_%lu_%lu", n, k);
+	return fname;
+}
+
+static size_t row_stride(size_t k)
+{
+	return (k + DB_WORD_BITS - 1) / DB_WORD_BITS;
+}
+
+/**
+ * Tries to map fname as a database of n bits with rows of k bits.
+ * Returns 0 on success, -1 if file doesn't exist or is invalid.
+ */
+static int try_map(const char *fname, size_t n, size_t k, struct database *db)
+{
+	const struct db_header *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	h = map;
+	if (memcmp(h->magic, MAGIC, MAGICLEN) || h->n != n || h->k != k ||
+			h->stride != row_stride(k) ||
+			(size_t)st.st_size != sizeof(*h) +
+			n / k * h->stride * sizeof(uint64_t)) {
+		fprintf(stderr, "Invalid database shape in %s\n", fname);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	/* rows are scanned in order by each thread */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	db->n = n;
+	db->k = k;
+	db->rows = n / k;
+	db->stride = h->stride;
+	db->bits = (const uint64_t *)(h + 1);
+	db->map = map;
+	db->maplen = st.st_size;
+	return 0;
+}
+
+/**
+ * Writes a random database of n bits with rows of k bits to fname. Each bit
+ * is set with probability 1/2. Bits past k in the last word of a row are 0.
+ * The file is written as fname.tmp and renamed, so that an interrupted run
+ * never leaves a partial database behind. Returns 0 on success, -1 on
+ * failure (with errno set).
+ */
+static int generate_database(const char *fname, size_t n, size_t k,
+		gmp_randstate_t state)
+{
+	size_t stride = row_stride(k), rows = n / k, i, j;
+	size_t len = strlen(fname) + 5;
+	uint64_t *row, last;
+	struct db_header h;
+	char *tmp;
+	FILE *f;
+	int ret = -1, err;
+
+	if (mkdir(DBDIR, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	tmp = malloc(len);
+	row = calloc(stride, sizeof(row[0]));
+	if (!tmp || !row) {
+		free(tmp);
+		free(row);
+		errno = ENOMEM;
+		return -1;
+	}
+	snprintf(tmp, len, "%s.tmp", fname);
+
+	f = fopen(tmp, "w");
+	if (!f)
+		goto out;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, MAGICLEN);
+	h.n = n;
+	h.k = k;
+	h.stride = stride;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		goto fail;
+
+	last = k % DB_WORD_BITS ? (1UL << (k % DB_WORD_BITS)) - 1 : ~0UL;
+	for (i = 0; i < rows; i++) {
+		for (j = 0; j < stride; j++)
+			row[j] = gmp_urandomb_ui(state, 32) << 32 |
+				gmp_urandomb_ui(state, 32);
+		row[stride - 1] &= last;
+		if (fwrite(row, sizeof(row[0]), stride, f) != stride)
+			goto fail;
+	}
+
+	if (fclose(f) == 0 && rename(tmp, fname) == 0) {
+		ret = 0;
+		goto out;
+	}
+	f = NULL;
+
+fail:
+	/* errno of the failed call for the caller */
+	err = errno;
+	if (f)
+		fclose(f);
+	unlink(tmp);
+	errno = err;
+out:
+	free(row);
+	free(tmp);
+	return ret;
+}
+
+void get_database(const char *fname, size_t n, size_t k,
+		gmp_randstate_t state, struct database *db)
+{
+	char *defname = NULL;
+
+	if (!fname)
+		fname = defname = get_database_filename(n, k);
+
+	if (try_map(fname, n, k, db) < 0) {
+		fprintf(stderr, "Database invalid/missing\n");
+		fprintf(stderr, "Generating new database..");
+		if (generate_database(fname, n, k, state) < 0 ||
+				try_map(fname, n, k, db) < 0) {
+			fprintf(stderr, "failed\n");
+			perror(fname);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "OK\n");
+	}
+
+	free(defname);
+}
+
+void database_from_numbers(const mpz_t *nums, size_t count, size_t bits,
+		struct database *db)
+{
+	size_t stride = row_stride(count), i, j;
+	uint64_t *w;
+
+	w = calloc(bits * stride, sizeof(w[0]));
+	if (!w) {
+		fprintf(stderr, "Cannot allocate memory for database!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (j = 0; j < count; j++)
+		for (i = 0; i < bits; i++)
+			if (mpz_tstbit(nums[j], i))
+				w[i * stride + j / DB_WORD_BITS] |=
+					1UL << (j % DB_WORD_BITS);
+
+	db->n = bits * count;
+	db->k = count;
+	db->rows = bits;
+	db->stride = stride;
+	db->bits = w;
+	db->map = NULL;
+	db->maplen = 0;
+}
+
+void release_database(struct database *db)
+{
+	if (db->map)
+		munmap(db->map, db->maplen);
+	else
+		free((void *)db->bits);
+	memset(db, 0, sizeof(*db));
+}
+
+/* O_DIRECT transfers must be aligned to this (offset, length and buffer) */
+#define IOALIGN 4096
+
+/* a chunk buffer of the stream */
+struct stream_buffer {
+	/* IOALIGN-aligned, the chunk's rows start at skip bytes */
+	char *data;
+	/* chunk held, or being read if !full */
+	size_t chunk;
+	int full;
+};
+
+struct db_stream {
+	int fd;
+	size_t k, stride, rows;
+	/* rows of a chunk (except the last), number of chunks */
+	size_t chunk_rows, chunks;
+	/* bytes of the header before the first row */
+	size_t skip;
+	size_t buflen;
+	struct stream_buffer buf[DB_STREAM_BUFFERS];
+	int nbuf;
+
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* next chunk handed out, buffer held by the consumer (-1 if none) */
+	size_t next;
+	int held;
+	int error, stop;
+	struct timespec start;
+	struct stream_stats stats;
+};
+
+static size_t gcd(size_t a, size_t b)
+{
+	size_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * Reads len bytes at off into buf. Falls back to buffered reads if the file
+ * system refuses O_DIRECT. Returns the bytes read (less at the end of the
+ * file) or -1.
+ */
+static ssize_t read_at(struct db_stream *s, char *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = pread(s->fd, buf + done, len - done, off + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EINVAL && s->stats.direct) {
+			fcntl(s->fd, F_SETFL,
+					fcntl(s->fd, F_GETFL) & ~O_DIRECT);
+			s->stats.direct = 0;
+			continue;
+		}
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static size_t chunk_rows(const struct db_stream *s, size_t c)
+{
+	size_t first = c * s->chunk_rows;
+
+	return first + s->chunk_rows < s->rows ? s->chunk_rows :
+		s->rows - first;
+}
+
+/**
+ * Reads the chunks in order into the free buffers, until all are read or
+ * the stream is closed.
+ */
+static void *reader(void *arg)
+{
+	struct db_stream *s = arg;
+	struct timespec st, en;
+	size_t c, bytes, len;
+	ssize_t got;
+	int b;
+
+	for (c = 0; c < s->chunks; c++) {
+		b = c % s->nbuf;
+
+		pthread_mutex_lock(&s->lock);
+		while (s->buf[b].full && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->stop) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		/* chunks are a multiple of IOALIGN, the header is smaller */
+		bytes = chunk_rows(s, c) * s->stride * sizeof(uint64_t);
+		len = (s->skip + bytes + IOALIGN - 1) / IOALIGN * IOALIGN;
+		clock_gettime(CLOCK_MONOTONIC, &st);
+		got = read_at(s, s->buf[b].data, len,
+				(off_t)(c * s->chunk_rows * s->stride *
+					sizeof(uint64_t)));
+		clock_gettime(CLOCK_MONOTONIC, &en);
+
+		pthread_mutex_lock(&s->lock);
+		if (got < 0 || (size_t)got < s->skip + bytes)
+			s->error = 1;
+		s->stats.read += time_diff(&st, &en);
+		s->stats.bytes += bytes;
+		s->buf[b].chunk = c;
+		s->buf[b].full = 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+
+		if (s->error)
+			break;
+	}
+
+	return NULL;
+}
+
+struct db_stream *db_stream_open(const char *fname, size_t n, size_t k,
+		size_t chunk_bytes, int buffers, struct database *shape)
+{
+	struct db_stream *s;
+	struct db_header h;
+	char *defname = NULL;
+	size_t row_bytes, unit;
+	int i;
+
+	if (!fname)
+		fname = defname = get_database_filename(n, k);
+
+	s = calloc(1, sizeof(*s));
+	s->stats.direct = 1;
+	s->fd = open(fname, O_RDONLY | O_DIRECT);
+	if (s->fd < 0 && errno == EINVAL) {
+		s->stats.direct = 0;
+		s->fd = open(fname, O_RDONLY);
+	}
+	if (s->fd < 0) {
+		perror(fname);
+		goto fail;
+	}
+
+	/* the header through an aligned buffer, as for the chunks */
+	s->buf[0].data = aligned_alloc(IOALIGN, IOALIGN);
+	if (read_at(s, s->buf[0].data, IOALIGN, 0) < (ssize_t)sizeof(h)) {
+		fprintf(stderr, "Cannot read the header of %s\n", fname);
+		goto fail;
+	}
+	memcpy(&h, s->buf[0].data, sizeof(h));
+	free(s->buf[0].data);
+	s->buf[0].data = NULL;
+
+	if (memcmp(h.magic, MAGIC, MAGICLEN) || h.n != n || h.k != k ||
+			h.stride != row_stride(k)) {
+		fprintf(stderr, "Invalid database shape in %s\n", fname);
+		goto fail;
+	}
+
+	s->k = k;
+	s->stride = h.stride;
+	s->rows = n / k;
+	s->skip = sizeof(h);
+
+	/* whole rows, and a multiple of IOALIGN bytes per chunk */
+	row_bytes = s->stride * sizeof(uint64_t);
+	unit = IOALIGN / gcd(IOALIGN, row_bytes);
+	s->chunk_rows = chunk_bytes / row_bytes / unit * unit;
+	if (!s->chunk_rows)
+		s->chunk_rows = unit;
+	if (s->chunk_rows > s->rows)
+		s->chunk_rows = s->rows;
+	s->chunks = s->rows ? (s->rows + s->chunk_rows - 1) / s->chunk_rows :
+		0;
+
+	s->nbuf = buffers < 2 ? 2 : buffers > DB_STREAM_BUFFERS ?
+		DB_STREAM_BUFFERS : buffers;
+	s->buflen = (s->skip + s->chunk_rows * row_bytes + IOALIGN - 1) /
+		IOALIGN * IOALIGN;
+	for (i = 0; i < s->nbuf; i++) {
+		s->buf[i].data = aligned_alloc(IOALIGN, s->buflen);
+		if (!s->buf[i].data) {
+			fprintf(stderr, "Cannot allocate stream buffers!\n");
+			goto fail;
+		}
+	}
+
+	s->held = -1;
+	s->stats.chunks = s->chunks;
+	s->stats.chunk_bytes = s->chunk_rows * row_bytes;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	if (pthread_create(&s->reader, NULL, reader, s)) {
+		fprintf(stderr, "Cannot start the reader thread!\n");
+		goto fail;
+	}
+
+	memset(shape, 0, sizeof(*shape));
+	shape->n = n;
+	shape->k = k;
+	shape->rows = s->rows;
+	shape->stride = s->stride;
+
+	free(defname);
+	return s;
+
+fail:
+	if (s->fd >= 0)
+		close(s->fd);
+	for (i = 0; i < DB_STREAM_BUFFERS; i++)
+		free(s->buf[i].data);
+	free(s);
+	free(defname);
+	return NULL;
+}
+
+int db_stream_next(struct db_stream *s, struct database *chunk, size_t *first)
+{
+	struct timespec st, en;
+	int b;
+
+	pthread_mutex_lock(&s->lock);
+
+	/* the previous chunk is done with */
+	if (s->held >= 0) {
+		s->buf[s->held].full = 0;
+		s->held = -1;
+		pthread_cond_broadcast(&s->cond);
+	}
+
+	if (s->next == s->chunks) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	b = s->next % s->nbuf;
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	while (!s->error && !(s->buf[b].full && s->buf[b].chunk == s->next))
+		pthread_cond_wait(&s->cond, &s->lock);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+	s->stats.stall += time_diff(&st, &en);
+
+	if (s->error) {
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+
+	s->held = b;
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->k = s->k;
+	chunk->rows = chunk_rows(s, s->next);
+	chunk->n = chunk->rows * s->k;
+	chunk->stride = s->stride;
+	chunk->bits = (const uint64_t *)(s->buf[b].data + s->skip);
+	*first = s->next * s->chunk_rows;
+	s->next++;
+
+	pthread_mutex_unlock(&s->lock);
+	return 1;
+}
+
+void db_stream_close(struct db_stream *s, struct stream_stats *stats)
+{
+	struct timespec en;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->reader, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &en);
+	s->stats.total = time_diff(&s->start, &en);
+	if (stats)
+		*stats = s->stats;
+
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	close(s->fd);
+	for (i = 0; i < s->nbuf; i++)
+		free(s->buf[i].data);
+	free(s);
+}
+
+void db_stream_report(const struct stream_stats *st)
+{
+	double hidden = st->read > 0 ? 1 - st->stall / st->read : 1;
+
+	if (hidden < 0)
+		hidden = 0;
+	printf("Streamed: %.3f GB in %lu chunks of %.1f MiB (%s)\n",
+			st->bytes / 1e9, st->chunks,
+			st->chunk_bytes / 1048576.0,
+			st->direct ? "O_DIRECT" : "buffered");
+	printf("Reading:  %7.3f s (%.3f GB/s)\n", st->read,
+			st->read > 0 ? st->bytes / st->read / 1e9 : 0);
+	printf("Stalled:  %7.3f s of %.3f s, %.1f%% of I/O hidden\n",
+			st->stall, st->total, 100 * hidden);
+}
@@ -0,0 +1,135 @@
+#ifndef DATABASE_H__
+#define DATABASE_H__
+
+#include <stdint.h>
+
+struct gmp_randstate_t;
+
+/* number of bits in one database word */
+#define DB_WORD_BITS 64
+
+/**
+ * Bit-packed database of `n` bits, stored as `rows = n / k` rows of `k` bits.
+ * Bit j of row i tells whether query element j is multiplied into output i.
+ *
+ * The bits live in a read-only memory mapping of the database file, each row
+ * padded to a whole number of 64-bit words.
+ */
+struct database {
+	/* size of the database (in bits) */
+	size_t n;
+	/* number of bits in a row (query length) */
+	size_t k;
+	/* number of rows (outputs) */
+	size_t rows;
+	/* number of 64-bit words in a row */
+	size_t stride;
+	/* first word of first row */
+	const uint64_t *bits;
+	/* whole mapping, including header */
+	void *map;
+	size_t maplen;
+};
+
+/**
+ * Maps the database of n bits with rows of k bits from `fname`. If fname is
+ * NULL a default name based on n and k is used. If the file is missing or has
+ * another shape, a new random database is generated and saved there first.
+ *
+ * Exits on failure.
+ */
+void get_database(const char *fname, size_t n, size_t k,
+		gmp_randstate_t state, struct database *db);
+
+/**
+ * Builds an in-memory database of bits rows of count bits from count numbers
+ * of at most bits bits: bit j of row i is bit i of nums[j]. This is the
+ * database of the second level of a recursive query.
+ */
+void database_from_numbers(const mpz_t *nums, size_t count, size_t bits,
+		struct database *db);
+
+/**
+ * Unmaps (or frees) the database.
+ */
+void release_database(struct database *db);
+
+/* most chunk buffers of a stream (triple buffering) */
+#define DB_STREAM_BUFFERS 3
+
+/**
+ * Database file read chunk by chunk (whole rows) by a reader thread, for
+ * databases larger than memory. While the caller works on one chunk, the
+ * next ones are read into the other buffers with O_DIRECT (plain reads if the
+ * file system doesn't support it).
+ */
+struct db_stream;
+
+/* I/O of a stream */
+struct stream_stats {
+	size_t bytes, chunks, chunk_bytes;
+	/* O_DIRECT was used */
+	int direct;
+	/* seconds spent reading, waiting for chunks and in total */
+	double read, stall, total;
+};
+
+/**
+ * Opens the database of n bits with rows of k bits for streaming (fname NULL
+ * for the default name), in chunks of about chunk_bytes with buffers
+ * buffers (2 or 3). Fills shape with the size of the whole database (bits is
+ * NULL). Returns NULL if the file is missing or has another shape.
+ */
+struct db_stream *db_stream_open(const char *fname, size_t n, size_t k,
+		size_t chunk_bytes, int buffers, struct database *shape);
+
+/**
+ * Releases the previous chunk and waits for the next one. chunk then holds
+ * its rows, which are rows first.. of the database. Returns 1, 0 after the
+ * last chunk or -1 on read errors.
+ */
+int db_stream_next(struct db_stream *s, struct database *chunk, size_t *first);
+
+/**
+ * Stops the reader and frees the stream, storing its I/O in stats (if not
+ * NULL).
+ */
+void db_stream_close(struct db_stream *s, struct stream_stats *stats);
+
+/**
+ * Prints the I/O of a stream and how much of it was hidden behind compute.
+ */
+void db_stream_report(const struct stream_stats *stats);
+
+/**
+ * Returns the words of row i.
+ */
+static inline const uint64_t *db_row(const struct database *db, size_t i)
+{
+	return db->bits + i * db->stride;
+}
+
+/**
+ * Returns 1 if query element j is selected by row i, 0 otherwise.
+ */
+static inline int db_bit(const struct database *db, size_t i, size_t j)
+{
+	return (db_row(db, i)[j / DB_WORD_BITS] >> (j % DB_WORD_BITS)) & 1;
+}
+
+/**
+ * Returns w (at most 64) bits of row i, starting with bit j as lowest bit.
+ */
+static inline uint64_t db_bits(const struct database *db, size_t i, size_t j,
+		unsigned int w)
+{
+	const uint64_t *row = db_row(db, i) + j / DB_WORD_BITS;
+	unsigned int o = j % DB_WORD_BITS;
+	uint64_t v = row[0] >> o;
+
+	if (o + w > DB_WORD_BITS)
+		v |= row[1] << (DB_WORD_BITS - o);
+	return w < DB_WORD_BITS ? v & ((1UL << w) - 1) : v;
+}
+
+#endif
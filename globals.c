@@ -2,42 +2,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "globals.h"
 
 /**
- * Reads `bytes` bytes from /dev/urandom to initialize random number generator
- * state.
+ * Reads `bytes` bytes from /dev/urandom into buff.
  */
-static char *read_from_devurandom(int bytes)
+static void read_from_devurandom(void *buff, size_t bytes)
 {
-	char *buff = malloc(bytes);
-
 	FILE *f = fopen("/dev/urandom", "r");
 	char *p = buff;
 	size_t read;
 
+	if (!f) {
+		perror("/dev/urandom");
+		exit(EXIT_FAILURE);
+	}
+
 	while (bytes) {
 		read = fread(p, 1, bytes, f);
 		p += read;
 		bytes -= read;
 	}
 	fclose(f);
+}
+
+int make_seed(struct seed *seed, const char *str)
+{
+	unsigned long v;
+	char extra;
+	int i;
+
+	if (!str) {
+		read_from_devurandom(seed->w, sizeof(seed->w));
+		return 0;
+	}
 
-	return buff;
+	if (sscanf(str, "%lu%c", &v, &extra) != 1)
+		return -1;
+
+	/* spread the 64 bits over the whole seed */
+	for (i = 0; i < SEED_WORDS; i++)
+		seed->w[i] = rng_mix(v += RNG_GAMMA);
+	return 0;
 }
 
-void initialize_random(gmp_randstate_t state, int bytes)
+void initialize_random(gmp_randstate_t state, const struct seed *seed)
 {
-	void *buff = read_from_devurandom(bytes);
 	mpz_t s;
 
 	gmp_randinit_default(state);
 	mpz_init(s);
-	mpz_import(s, bytes, 1, 1, 0, 0, buff);
+	mpz_import(s, SEED_WORDS, -1, sizeof(seed->w[0]), 0, 0, seed->w);
 	gmp_randseed(state, s);
 	mpz_clear(s);
-	free(buff);
+}
+
+void rng_stream(struct rng *r, const struct seed *seed, uint64_t id)
+{
+	uint64_t k = id;
+	int i;
+
+	for (i = 0; i < SEED_WORDS; i++)
+		k = rng_mix(k ^ seed->w[i]) + RNG_GAMMA;
+	r->key = k;
+	r->ctr = 0;
 }
 
 #define  NANOSECONDS 1000000000.0
@@ -48,3 +78,25 @@ double time_diff(const struct timespec *st, const struct timespec *en)
 	return t2 - t1;
 }
 #undef MICROSECONDS
+
+/* used when sysconf doesn't know the cache sizes */
+#define L1DEFAULT (32 * 1024)
+#define L2DEFAULT (256 * 1024)
+#define L3DEFAULT (8 * 1024 * 1024)
+
+size_t cache_size(int level)
+{
+	long sz;
+
+	switch (level) {
+	case 1:
+		sz = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+		return sz > 0 ? (size_t)sz : L1DEFAULT;
+	case 2:
+		sz = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		return sz > 0 ? (size_t)sz : L2DEFAULT;
+	default:
+		sz = sysconf(_SC_LEVEL3_CACHE_SIZE);
+		return sz > 0 ? (size_t)sz : L3DEFAULT;
+	}
+}
@@ -1,15 +1,72 @@
 #ifndef GLOBALS_H__
 #define GLOBALS_H__
 
+#include <stdint.h>
+
 struct gmp_randstate_t;
 struct timespec;
 
+/* number of 64-bit words in a seed */
+#define SEED_WORDS 4
+
+/**
+ * Seed of all random number generators (256 bits).
+ */
+struct seed {
+	uint64_t w[SEED_WORDS];
+};
+
+/**
+ * Counter-based random stream: the i-th output only depends on the key and
+ * i, so independent streams can be used by different threads and the
+ * results don't depend on the number of threads.
+ */
+struct rng {
+	uint64_t key;
+	uint64_t ctr;
+};
+
+/**
+ * Fills seed from str (a 64-bit number) if not NULL, from 32 bytes of
+ * /dev/urandom otherwise. Returns -1 if str is not a valid number.
+ */
+int make_seed(struct seed *seed, const char *str);
+
 /**
- * Initializes the random number generator of GMP library. To be called in
- * every `main` function.
+ * Initializes the random number generator of GMP library from seed. To be
+ * called in every `main` function.
  */
-void initialize_random(gmp_randstate_t state, int bytes);
+void initialize_random(gmp_randstate_t state, const struct seed *seed);
+
+/**
+ * Initializes r as stream `id` of seed.
+ */
+void rng_stream(struct rng *r, const struct seed *seed, uint64_t id);
+
+/* SplitMix64 */
+#define RNG_GAMMA 0x9e3779b97f4a7c15UL
+
+static inline uint64_t rng_mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * Returns the next 64 random bits of stream r.
+ */
+static inline uint64_t rng_next(struct rng *r)
+{
+	return rng_mix(r->key + ++r->ctr * RNG_GAMMA);
+}
 
 double time_diff(const struct timespec *st, const struct timespec *en);
 
+/**
+ * Returns the size (in bytes) of the data cache at level 1, 2 or 3. Falls
+ * back to common sizes if the system doesn't report it.
+ */
+size_t cache_size(int level);
+
 #endif
@@ -0,0 +1,488 @@
+/**
+ * Montgomery kernels, instantiated once per supported key size.
+ *
+ * Before including, define IR_KEYSIZE to the key size (in bits) to get
+ * kernels where the number of limbs N is a compile time constant, or to 0 to
+ * get generic kernels reading N from their first argument. All functions get
+ * the key size (or `any`) appended to their name.
+ *
+ * With IR_LAZY set, the kernels are for primes with 4p < R: results of
+ * multiplications stay in [0, 2p) without the final compare and subtract,
+ * only convert_from_mont reduces fully. Their names end in `_lazy`.
+ * Otherwise, the kernels for pseudo-Mersenne primes are instantiated too.
+ */
+
+#define IR_CAT_(a, b) a ## _ ## b
+#define IR_CAT(a, b) IR_CAT_(a, b)
+
+#if IR_LAZY
+#define IR_NAME(name, ks) IR_CAT(IR_CAT(name, ks), lazy)
+#else
+#define IR_NAME(name, ks) IR_CAT(name, ks)
+#endif
+
+#if IR_KEYSIZE
+#define N (IR_KEYSIZE / LIMB_SIZE)
+#define N_PARAM uint n __attribute__((unused))
+#define FN(name) IR_NAME(name, IR_KEYSIZE)
+#else
+#define N n
+#define N_PARAM uint n
+#define FN(name) IR_NAME(name, any)
+#endif
+
+/**
+ * Returns (2^LOGBASE)^N - p == Montgomery representation of 1.
+ * Assumes p has full bits (lazy kernels compute R `mod` p instead).
+ */
+static limb* FN(one_to_mont)(N_PARAM, const limb p[])
+{
+#ifdef ALIGN
+	limb *ret = (limb*)_mm_malloc(N * sizeof(ret[0]), ALIGNBOUNDARY);
+#else
+	limb *ret = calloc(N, sizeof(ret[0]));
+#endif
+#if IR_LAZY
+	r_mod_p(N, ret, p);
+#else
+	uint i;
+
+#ifdef ALIGN
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		ret[i] = ~p[i];
+	ret[0]++;
+#endif
+
+	return ret;
+}
+
+/**
+ * Montgomery multiply op1 and op2 modulo p, keeping result in op2.
+ * minvp is used to keep result in Montgomery representation.
+ */
+static void FN(mul_full)(N_PARAM, limb *IR_RESTRICT op2,
+		const limb *IR_RESTRICT op1, const limb *IR_RESTRICT p, limb minvp)
+{
+
+	/* set by the loop below, which gcc cannot see run when N is n */
+	limb carryl = 0, carryh, ui, uiml, uimh, xiyl, xiyh, xiyil, xiyih;
+	uint i, j;
+#ifdef ALIGN
+	limb v[N] __attribute__((aligned(ALIGNBOUNDARY)));
+	__assume_aligned(&v[0], ALIGNBOUNDARY);
+#else
+	limb v[N];
+#endif
+#ifdef STRRED
+	limb a, b;
+#endif
+
+#ifdef ALIGN
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		v[i] = 0;
+
+	/* TODO: v prevents vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+	for (i = 0; i < N; i++) {
+		/** Step 1:
+		 *    ui <- (v[0] + op1[i] * op2[0]) * minvp `mod` (2^LOGBASE)
+		 */
+		fullmul(op1[i], op2[0], &xiyl, &xiyh);
+		ui = v[0] + xiyl;
+		ui *= minvp;
+
+		/** Step 2:
+		 *    v <- (v + op1[i] * op2 + ui * p) / b
+		 *
+		 * Compute the sum, digit by digit in op2 and p
+		 */
+		fullmul(ui, p[0], &uiml, &uimh);
+		carryh = add(&carryl, xiyl, uiml);
+		carryh += addin(&carryl, v[0]);
+		carryl = addin(&carryh, xiyh);
+		carryl += addin(&carryh, uimh);
+		/* TODO: v, carryl prevent vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+		for (j = 0; j < N - 1; j++) {
+			carryh = carryl + add(&v[j], carryh, v[j + 1]);
+			fullmul(op1[i], op2[j + 1], &xiyil, &xiyih);
+			fullmul(ui, p[j + 1], &uiml, &uimh);
+			carryh += addin(&v[j], xiyil);
+			carryh += addin(&v[j], uiml);
+			carryl = addin(&carryh, xiyih);
+			carryl += addin(&carryh, uimh);
+		}
+		v[N-1] = carryh;
+	}
+
+#if !IR_LAZY
+	/* compare v with p */
+#ifdef VECTSEARCH
+#ifdef ALIGN
+	limb above[N] __attribute__((aligned(ALIGNBOUNDARY)));
+	limb below[N] __attribute__((aligned(ALIGNBOUNDARY)));
+	__assume_aligned(&above[0], ALIGNBOUNDARY);
+	__assume_aligned(&below[0], ALIGNBOUNDARY);
+	__assume_aligned(&p[0], ALIGNBOUNDARY);
+#else
+	limb above[N], below[N];
+#endif
+	limb ai = 0, bi = 0;
+
+#pragma simd reduction (max:ai,bi)
+	for (i = 0; i < N; i++) {
+		above[i] = i * (v[i] > p[i]);
+		below[i] = i * (v[i] < p[i]);
+		if (ai < above[i]) ai = above[i];
+		if (bi < below[i]) bi = below[i];
+	}
+	carryl = carryl | (ai > bi);
+#else
+	for (i = N - 1; i > 0 && !carryl; i--)
+		if (v[i] < p[i])
+			break;
+		else if (v[i] > p[i])
+			carryl = 1;
+#endif
+
+	/* if v > p then set v to v - p */
+	if (carryl) {
+		carryl = 0;
+		/* TODO: carryl prevents vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+		for (i = 0; i < N; i++) {
+			carryh = v[i] - p[i] - carryl;
+			carryl = v[i] < carryh;
+			v[i] = carryh;
+		}
+	}
+#endif
+
+	/* result in v, copy to op2 */
+#ifdef ALIGN
+	__assume_aligned(&op2[0], ALIGNBOUNDARY);
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		op2[i] = v[i];
+}
+
+/* the full products of mul_sos and mul_pm, kara_mul_0 on N limbs */
+#define IR_KARA_LEVEL 4
+#include "integer-reg-kara.h"
+#undef IR_KARA_LEVEL
+
+#define IR_KARA_NEXT 4
+#define IR_KARA_LEVEL 3
+#include "integer-reg-kara.h"
+#undef IR_KARA_LEVEL
+#undef IR_KARA_NEXT
+
+#define IR_KARA_NEXT 3
+#define IR_KARA_LEVEL 2
+#include "integer-reg-kara.h"
+#undef IR_KARA_LEVEL
+#undef IR_KARA_NEXT
+
+#define IR_KARA_NEXT 2
+#define IR_KARA_LEVEL 1
+#include "integer-reg-kara.h"
+#undef IR_KARA_LEVEL
+#undef IR_KARA_NEXT
+
+#define IR_KARA_NEXT 1
+#define IR_KARA_LEVEL 0
+#include "integer-reg-kara.h"
+#undef IR_KARA_LEVEL
+#undef IR_KARA_NEXT
+
+/* scratch of kara_mul_0: 3 (N + N/2 + N/4 + N/8) limbs */
+#define IR_KARA_SCRATCH (6 * N)
+
+/**
+ * Same result as mul_full, with separated operand scanning: the full 2N limb
+ * product (Karatsuba down to cutoff limbs, Comba below) followed by a
+ * Montgomery reduction of it.
+ */
+static void FN(mul_sos)(N_PARAM, uint cutoff, limb *IR_RESTRICT op2,
+		const limb *IR_RESTRICT op1, const limb *IR_RESTRICT p, limb minvp)
+{
+	limb t[2 * N + 1], s[IR_KARA_SCRATCH];
+	limb carryl, ui, uiml, uimh;
+	uint i, j;
+
+	FN(kara_mul_0)(n, cutoff, t, op1, op2, s);
+	t[2 * N] = 0;
+
+	/**
+	 * t <- (t + (t * minvp `mod` R) * p) / R, one limb at a time:
+	 * t[i] becomes 0 at step i
+	 */
+#ifdef UNROLL
+#pragma unroll
+#endif
+	for (i = 0; i < N; i++) {
+		ui = t[i] * minvp;
+		carryl = 0;
+#ifdef UNROLL
+#pragma unroll
+#endif
+		for (j = 0; j < N; j++) {
+			fullmul(ui, p[j], &uiml, &uimh);
+			uimh += addin(&t[i + j], uiml);
+			uimh += addin(&t[i + j], carryl);
+			carryl = uimh;
+		}
+		for (j = i + N; carryl && j <= 2 * N; j++)
+			carryl = addin(&t[j], carryl);
+	}
+
+#if !IR_LAZY
+	/* result in t[N..2N], below 2p: compare with p */
+	carryl = t[2 * N];
+	for (i = N - 1; i > 0 && !carryl; i--)
+		if (t[N + i] < p[i])
+			break;
+		else if (t[N + i] > p[i])
+			carryl = 1;
+	if (!carryl && t[N] >= p[0] && i == 0)
+		carryl = 1;
+
+	/* if t >= p then set t to t - p */
+	if (carryl) {
+		carryl = 0;
+#ifdef UNROLL
+#pragma unroll
+#endif
+		for (i = 0; i < N; i++) {
+			ui = t[N + i] - p[i] - carryl;
+			carryl = t[N + i] < ui || (carryl && ui == t[N + i]);
+			t[N + i] = ui;
+		}
+	}
+#endif
+
+#ifdef ALIGN
+	__assume_aligned(&op2[0], ALIGNBOUNDARY);
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		op2[i] = t[N + i];
+}
+
+/**
+ * Convert from Montgomery.
+ * Should be faster than calling mul_full(op2, 1, prime, minvp).
+ */
+static void FN(convert_from_mont)(N_PARAM, limb *IR_RESTRICT op2,
+		const limb *IR_RESTRICT p, limb minvp)
+{
+
+	limb carryl, carryh, ui, uiml, uimh;
+	uint i, j;
+#ifdef ALIGN
+	limb v[N] __attribute__((aligned(ALIGNBOUNDARY)));
+	__assume_aligned(&v[0], ALIGNBOUNDARY);
+#else
+	limb v[N];
+#endif
+
+#ifdef ALIGN
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		v[i] = 0;
+
+	/**
+	 * LSBpart: op1[i] would be 1
+	 */
+	ui = op2[0] * minvp;
+	fullmul(ui, p[0], &uiml, &uimh);
+	carryh = add(&carryl, op2[0], uiml);
+	carryl = addin(&carryh, uimh);
+	/* TODO: v, carryl prevent vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+	for (j = 0; j < N - 1; j++) {
+		carryh = carryl + add(&v[j], carryh, v[j + 1]);
+		fullmul(ui, p[j + 1], &uiml, &uimh);
+		carryh += addin(&v[j], op2[j + 1]);
+		carryh += addin(&v[j], uiml);
+		carryl = addin(&carryh, uimh);
+	}
+	v[N-1] = carryh;
+
+	/**
+	 * Remaining part: op1[i] is 0
+	 */
+	/* TODO: v prevents vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+	for (i = 1; i < N; i++) {
+		ui = v[0] * minvp;
+		fullmul(ui, p[0], &uiml, &uimh);
+		carryh = addin(&uiml, v[0]);
+		carryl = addin(&carryh, uimh);
+		/* TODO: v, carryl prevent vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+		for (j = 0; j < N - 1; j++) {
+			carryh = carryl + add(&v[j], carryh, v[j + 1]);
+			fullmul(ui, p[j + 1], &uiml, &uimh);
+			carryh += addin(&v[j], uiml);
+			carryl = addin(&carryh, uimh);
+		}
+		v[N-1] = carryh;
+	}
+
+	/* compare v with p */
+#ifdef VECTSEARCH
+#ifdef ALIGN
+	limb above[N] __attribute__((aligned(ALIGNBOUNDARY)));
+	limb below[N] __attribute__((aligned(ALIGNBOUNDARY)));
+	__assume_aligned(&above[0], ALIGNBOUNDARY);
+	__assume_aligned(&below[0], ALIGNBOUNDARY);
+	__assume_aligned(&p[0], ALIGNBOUNDARY);
+#else
+	limb above[N], below[N];
+#endif
+	limb ai = 0, bi = 0;
+
+#pragma simd reduction (max:ai,bi)
+	for (i = 0; i < N; i++) {
+		above[i] = i * (v[i] > p[i]);
+		below[i] = i * (v[i] < p[i]);
+		if (ai < above[i]) ai = above[i];
+		if (bi < below[i]) bi = below[i];
+	}
+	carryl = carryl | (ai > bi);
+#else
+	for (i = N - 1; i > 0 && !carryl; i--)
+		if (v[i] < p[i])
+			break;
+		else if (v[i] > p[i])
+			carryl = 1;
+#endif
+
+	/* if v > p then set v to v - p */
+	if (carryl) {
+		carryl = 0;
+		/* TODO: carryl prevents vectorization */
+#ifdef UNROLL
+#pragma unroll
+#endif
+		for (i = 0; i < N; i++) {
+			carryh = v[i] - p[i] - carryl;
+			carryl = v[i] < carryh;
+			v[i] = carryh;
+		}
+	}
+
+	/* result in v, copy to op2 */
+#ifdef ALIGN
+	__assume_aligned(&op2[0], ALIGNBOUNDARY);
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		op2[i] = v[i];
+}
+
+#if !IR_LAZY
+/**
+ * Kernels for pseudo-Mersenne primes p = 2^keysize - c with c below
+ * 2^LIMB_SIZE (all limbs but the lowest are full). Numbers are kept as they
+ * are instead of in Montgomery representation: 1 is 1 and converting back
+ * does nothing, as results are always below p.
+ */
+static limb* FN(one_pm)(N_PARAM, const limb p[] __attribute__((unused)))
+{
+	limb *ret = calloc(N, sizeof(ret[0]));
+
+	ret[0] = 1;
+	return ret;
+}
+
+static void FN(from_pm)(uint n __attribute__((unused)),
+		limb op2[] __attribute__((unused)),
+		const limb p[] __attribute__((unused)),
+		limb minvp __attribute__((unused)))
+{
+}
+
+/**
+ * Multiplies op1 and op2 modulo p, keeping result in op2: the full product
+ * (as in mul_sos), then its high half H folded into the low one twice, as
+ * H 2^keysize = H c `mod` p, instead of a Montgomery reduction.
+ */
+static void FN(mul_pm)(N_PARAM, uint cutoff, limb *IR_RESTRICT op2,
+		const limb *IR_RESTRICT op1, const limb *IR_RESTRICT p,
+		limb minvp __attribute__((unused)))
+{
+	const limb c = -p[0];
+	limb t[2 * N], s[IR_KARA_SCRATCH];
+	limb carry, hi, lo;
+	uint i;
+
+	FN(kara_mul_0)(n, cutoff, t, op1, op2, s);
+
+	/* t = H c + L, the limb above L in carry (at most c) */
+	carry = 0;
+#ifdef UNROLL
+#pragma unroll
+#endif
+	for (i = 0; i < N; i++) {
+		fullmul(t[N + i], c, &lo, &hi);
+		hi += addin(&lo, carry);
+		hi += addin(&t[i], lo);
+		carry = hi;
+	}
+
+	/* again: t = carry c + L, below 2^keysize + c^2 */
+	fullmul(carry, c, &lo, &hi);
+	carry = addin(&t[0], lo);
+	carry = addin(&t[1], hi + carry);
+	for (i = 2; carry && i < N; i++)
+		carry = addin(&t[i], carry);
+
+	/* past 2^keysize: t - p = t - 2^keysize + c, far below p */
+	if (carry) {
+		carry = addin(&t[0], c);
+		for (i = 1; carry && i < N; i++)
+			carry = addin(&t[i], carry);
+	}
+
+	/* below 2^keysize: subtract p once if t >= p */
+	for (i = N; i > 0 && t[i - 1] == p[i - 1]; i--)
+		;
+	if (i == 0 || t[i - 1] > p[i - 1])
+		sub_n(t, t, p, N);
+
+#ifdef ALIGN
+	__assume_aligned(&op2[0], ALIGNBOUNDARY);
+#pragma vector aligned
+#endif
+	for (i = 0; i < N; i++)
+		op2[i] = t[i];
+}
+#endif
+
+#undef IR_KARA_SCRATCH
+#undef FN
+#undef N_PARAM
+#undef N
+#undef IR_NAME
+#undef IR_CAT
+#undef IR_CAT_
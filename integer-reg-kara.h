@@ -0,0 +1,76 @@
+/**
+ * One level of the full product used by mul_sos and mul_pm, included by
+ * integer-reg-impl.h once per level from the deepest one up, so that the
+ * operand size is a compile time constant at every level of a specialized
+ * kernel.
+ *
+ * Before including, define IR_KARA_LEVEL to the level (0 for N limbs, 1 for
+ * N/2, ...) and IR_KARA_NEXT to the level below, or leave it undefined for the
+ * deepest level, which always uses Comba.
+ */
+
+#define IR_KARA_N	(N >> IR_KARA_LEVEL)
+#define IR_KARA_FN(level)	FN(IR_CAT(kara_mul, level))
+
+/**
+ * r = a * b, 2 IR_KARA_N limbs, with (subtractive) Karatsuba while the size is
+ * even and above cutoff limbs:
+ * 	a0 b0 + (a0 b0 + a1 b1 - (a0 - a1)(b0 - b1)) B^h + a1 b1 B^2h
+ * computed column by column (Comba) below, with a three limb accumulator so
+ * that each limb of r is written once. s is the scratch of this level (3
+ * IR_KARA_N limbs) followed by the one of the levels below.
+ */
+static void IR_KARA_FN(IR_KARA_LEVEL)(N_PARAM, uint cutoff,
+		limb *IR_RESTRICT r, const limb *a, const limb *b, limb *s)
+{
+	const uint nl = IR_KARA_N;
+	limb c0 = 0, c1 = 0, c2 = 0, l, h;
+	uint i, k, lo, hi;
+#ifdef IR_KARA_NEXT
+	const uint hl = nl / 2;
+	limb *da = s, *db = s + hl, *m = s + nl, *mid = s + 2 * nl;
+	limb carry;
+	int neg;
+
+	if (nl > cutoff && nl % 2 == 0) {
+		IR_KARA_FN(IR_KARA_NEXT)(n, cutoff, r, a, b, s + 3 * nl);
+		IR_KARA_FN(IR_KARA_NEXT)(n, cutoff, r + nl, a + hl, b + hl,
+				s + 3 * nl);
+		neg = absdiff_n(da, a, a + hl, hl) ^ absdiff_n(db, b, b + hl, hl);
+		IR_KARA_FN(IR_KARA_NEXT)(n, cutoff, m, da, db, s + 3 * nl);
+
+		/* mid = a0 b1 + a1 b0 (nl + 1 limbs, the top one in carry) */
+		carry = add_n(mid, r, r + nl, nl);
+		if (neg)
+			carry += add_n(mid, mid, m, nl);
+		else
+			carry -= sub_n(mid, mid, m, nl);
+
+		carry += add_n(r + hl, r + hl, mid, nl);
+		for (i = hl + nl; carry && i < 2 * nl; i++)
+			carry = addin(&r[i], carry);
+		return;
+	}
+#else
+	(void) cutoff;
+	(void) s;
+#endif
+
+	for (k = 0; k < 2 * nl - 1; k++) {
+		lo = k < nl ? 0 : k - nl + 1;
+		hi = k < nl ? k : nl - 1;
+		for (i = lo; i <= hi; i++) {
+			fullmul(a[i], b[k - i], &l, &h);
+			h += addin(&c0, l);
+			c2 += addin(&c1, h);
+		}
+		r[k] = c0;
+		c0 = c1;
+		c1 = c2;
+		c2 = 0;
+	}
+	r[2 * nl - 1] = c0;
+}
+
+#undef IR_KARA_FN
+#undef IR_KARA_N
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <gmp.h>
 
@@ -10,36 +12,33 @@
 #include <malloc.h>
 #endif
 
-#define CONVERSION_FACTOR 2
-#define MASK 0xffffffff
+/* number of limbs in one mpz limb */
+#define CONVERSION_FACTOR (GMP_NUMB_BITS / LIMB_SIZE)
+#define MASK ((limb)~(limb)0)
 #define LOGBASE LIMB_SIZE
-#define HMASK 0xffff
-#define HLGBASE (LIMB_SIZE/2)
 
 /* assumes mpz uses 64-bit limbs */
 typedef unsigned long uint64;
 
-/* number of limbs in one uint* number */
-static uint N;
-
-/* allow setting N only once */
-static int set = 0;
-
-inline void setN(uint newN)
-{
-	assert(!set);
-	N = newN;
-}
+/* conversions to/from mpz */
 
-inline uint getN()
+#if LIMB_SIZE == GMP_NUMB_BITS
+/**
+ * Limbs have the same size as mpz ones, copy them directly.
+ */
+static size_t convert_from_mpz_loop(const mp_limb_t *limbs, size_t nsz,
+		limb *repr, size_t ix, size_t sz)
 {
-	return N;
-}
+	size_t i;
 
-/* conversions to/from mpz */
+	for (i = 0; i < sz; i++)
+		repr[ix++] = i < nsz ? limbs[i] : 0;
 
+	return ix;
+}
+#else
 static size_t convert_from_mpz_loop(const mp_limb_t *limbs, size_t nsz,
-		uint *repr, size_t ix, size_t sz)
+		limb *repr, size_t ix, size_t sz)
 {
 	size_t i;
 	uint64 elm;
@@ -53,15 +52,16 @@ static size_t convert_from_mpz_loop(const mp_limb_t *limbs, size_t nsz,
 
 	return ix;
 }
+#endif
 
-void convert_from_mpz_1(mpz_t num, uint* repr, size_t sz)
+void convert_from_mpz_1(mpz_t num, limb* repr, size_t sz)
 {
 	size_t nsz = mpz_size(num);
 	assert(nsz * CONVERSION_FACTOR <= sz);
 	nsz = convert_from_mpz_loop(mpz_limbs_read(num), nsz, repr, 0, sz);
 }
 
-void convert_from_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz)
+void convert_from_mpz(mpz_t *nums, size_t count, limb *repr, size_t sz)
 {
 	size_t nsz = mpz_size(nums[0]), i, ix = 0;
 	assert(nsz * CONVERSION_FACTOR * count <= sz);
@@ -71,7 +71,7 @@ void convert_from_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz)
 				repr, ix, sz);
 }
 
-void convert_to_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz)
+void convert_to_mpz(mpz_t *nums, size_t count, limb *repr, size_t sz)
 {
 	size_t nsz, i, j, k = 0;
 
@@ -81,10 +81,14 @@ void convert_to_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz)
 	for (i = 0; i < count; i++) {
 		mp_limb_t *p = mpz_limbs_write(nums[i], nsz);
 		for (j = 0; j < nsz; j++) {
+#if LIMB_SIZE == GMP_NUMB_BITS
+			p[j] = repr[k++];
+#else
 			size_t a, b;
 			a = repr[k++];
 			b = repr[k++];
 			p[j] = b << LOGBASE | a;
+#endif
 		}
 		mpz_limbs_finish(nums[i], nsz);
 	}
@@ -96,7 +100,7 @@ void convert_to_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz)
  * a = a + b
  * return carry
  */
-static inline uint addin(uint *a, uint b)
+static inline limb addin(limb *a, limb b)
 {
 	*a += b;
 	return *a < b;
@@ -106,7 +110,7 @@ static inline uint addin(uint *a, uint b)
  * a = b + d
  * return carry
  */
-static inline uint add(uint *a, uint b, uint d)
+static inline limb add(limb *a, limb b, limb d)
 {
 	*a = b + d;
 	return *a < b;
@@ -114,385 +118,494 @@ static inline uint add(uint *a, uint b, uint d)
 
 /**
  * {h_ab, l_ab} = a * b
- * Uses 64bits to store result then decomposes it to the two terms.
+ * Uses a double limb to store result then decomposes it to the two terms.
+ * For 64-bit limbs this is a single mulx (with BMI2) or mul.
  */
 #ifdef RESTRICT
-static inline void fullmul(uint a, uint b, uint *restrict l_ab, uint *restrict h_ab)
+static inline void fullmul(limb a, limb b, limb *restrict l_ab, limb *restrict h_ab)
 #else
-static inline void fullmul(uint a, uint b, uint *l_ab, uint *h_ab)
+static inline void fullmul(limb a, limb b, limb *l_ab, limb *h_ab)
 #endif
 {
-	uint64 p = (uint64)a * (uint64)b;
+	dlimb p = (dlimb)a * (dlimb)b;
 	*l_ab = p & MASK;
 	*h_ab = (p >> LOGBASE) & MASK;
 }
 
+#ifdef RESTRICT
+#define IR_RESTRICT restrict
+#else
+#define IR_RESTRICT
+#endif
+
 /**
- * return {ah, al} `div` p
- * Uses 64bits to store operand then truncates result to proper size.
+ * r = a + b on n limbs
+ * return carry
  */
-static inline uint onediv(uint al, uint ah, uint p)
+static limb add_n(limb *r, const limb *a, const limb *b, uint n)
 {
-	uint64 t = al | ((uint64)ah << LOGBASE);
-	return ((uint)(t / ((uint64)p)));
+	limb carry = 0, s;
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		carry = add(&s, a[i], carry);
+		carry += addin(&s, b[i]);
+		r[i] = s;
+	}
+	return carry;
 }
 
 /**
- * return {carryh, msb_var} `div` msb_p
- * Both inputs should have N full limbs.
+ * r = a - b on n limbs
+ * return borrow
  */
-#ifdef RESTRICT
-static inline uint divq(const uint *restrict var, uint carryh, const uint *restrict p)
-#else
-static inline uint divq(const uint var[N], uint carryh, const uint p[N])
-#endif
+static limb sub_n(limb *r, const limb *a, const limb *b, uint n)
 {
-	uint q, xt, xt1, yt, yt1, cl, ch, cl1, ch1;
-
-	xt = var[N-1];
-	xt1 = var[N-2];
-	yt = p[N-1];
-	yt1 = p[N-2];
-
-	q = onediv(carryh, 0, yt);
-	carryh -= q * yt;
-	xt -= q * yt1;
-	q = onediv(xt, carryh, yt);
+	limb borrow = 0, d;
+	uint i;
 
-	/* {ch1,ch,cl} = q*{yt,yt1} */
-	fullmul(q, yt1, &cl, &ch);
-	fullmul(q, yt, &cl1, &ch1);
-	ch1 = addin(&ch, cl1);
+	for (i = 0; i < n; i++) {
+		d = a[i] - b[i] - borrow;
+		borrow = a[i] < b[i] || (borrow && a[i] == b[i]);
+		r[i] = d;
+	}
+	return borrow;
+}
 
-	q -= (ch1 > carryh) || (ch > xt) || (cl > xt1);
+/**
+ * r = |a - b| on n limbs
+ * return 1 if a < b
+ */
+static int absdiff_n(limb *r, const limb *a, const limb *b, uint n)
+{
+	uint i = n;
 
-	return q;
+	while (i > 0 && a[i - 1] == b[i - 1])
+		i--;
+	if (i > 0 && a[i - 1] < b[i - 1]) {
+		sub_n(r, b, a, n);
+		return 1;
+	}
+	sub_n(r, a, b, n);
+	return 0;
 }
 
 /**
- * Returns a - q * p where q = floor((a<<16)/p)
- * One step in converting to Montgomery representation (a*base^N `mod` p).
- * To achieve full representation, must call this function 2N times.
+ * r = R `mod` p for R = 2^(n * LIMB_SIZE) and 4p < R: the top bit of p,
+ * doubled up to R.
  */
-#ifdef RESTRICT
-void convert_to_mont(uint *restrict a, const uint *restrict p)
-#else
-void convert_to_mont(uint a[N], const uint p[N])
-#endif
+static void r_mod_p(uint n, limb *r, const limb *p)
 {
-	uint mulh, mull, q, sub, carryh, i;
-
-	carryh = 0;
-	/**
-	 * Description of the loop (in case there's a vectorization
-	 * algorithm):
-	 *
-	 *  - carryh and vector a of N elements, all 32 bits
-	 *  - represented as 16 bits halves
-	 *  - 'a', '1-9' = contents that is getting shifted
-	 *  - '0' = those bits are 0
-	 *
-	 *      car.. <--------a---------->
-	 *  in: [0.0] [a.1|2.3|4.5|6.7|8.9] (carryh and then a, a has N elements, each 32 bits, represented here in 16bits halves)
-	 * out: [0.a] [1.2|3.4|5.6|7.8|9.0] (carryh and then a, a has N elements, each 32 bits, represented here in 16bits halves)
-	 */
-	/* TODO: carryh prevents vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-	for (i = 0; i < N; i++) {
-		mull = (a[i] & HMASK) << HLGBASE;
-		mulh = a[i] >> HLGBASE;
-		carryh = mulh + add(&a[i], mull, carryh);
+	uint i, t, b, d;
+	limb c, top;
+
+	for (t = n - 1; t > 0 && !p[t]; t--)
+		;
+	for (b = LIMB_SIZE - 1; b > 0 && !(p[t] >> b); b--)
+		;
+	for (i = 0; i < n; i++)
+		r[i] = 0;
+	r[t] = (limb)1 << b;
+
+	for (d = t * LIMB_SIZE + b; d < n * LIMB_SIZE; d++) {
+		/* r = 2r, below 2p < R */
+		top = 0;
+		for (i = 0; i < n; i++) {
+			c = r[i] >> (LIMB_SIZE - 1);
+			r[i] = r[i] << 1 | top;
+			top = c;
+		}
+
+		/* subtract p if r >= p */
+		for (i = n; i > 0 && r[i - 1] == p[i - 1]; i--)
+			;
+		if (i == 0 || r[i - 1] > p[i - 1])
+			sub_n(r, r, p, n);
 	}
+}
+
+/* kernels with the number of limbs known at compile time */
+#define IR_LAZY 0
+#define IR_KEYSIZE 1024
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 2048
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 3072
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 4096
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+/* generic kernels, for all other key sizes */
+#define IR_KEYSIZE 0
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+#undef IR_LAZY
+
+/* the same without final subtractions, for primes below R / 4 */
+#define IR_LAZY 1
+#define IR_KEYSIZE 1024
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 2048
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 3072
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 4096
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+
+#define IR_KEYSIZE 0
+#include "integer-reg-impl.h"
+#undef IR_KEYSIZE
+#undef IR_LAZY
+
+#define IR_KERNEL(ks) {\
+	ks, ks / LIMB_SIZE,\
+	one_to_mont_ ## ks,\
+	mul_full_ ## ks, convert_from_mont_ ## ks,\
+	NULL, 0, IR_FORM_FULL,\
+}
 
-	q = divq(a, carryh, p);
+#define IR_KERNEL_LAZY(ks) {\
+	ks, ks / LIMB_SIZE,\
+	one_to_mont_ ## ks ## _lazy,\
+	mul_full_ ## ks ## _lazy, convert_from_mont_ ## ks ## _lazy,\
+	NULL, 0, IR_FORM_LAZY,\
+}
 
-	carryh = 0;
-	/**
-	 * a = a - qp
-	 */
-	/* TODO: carryh prevents vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-	for (i = 0; i < N; i++) {
-		fullmul(q, p[i], &mull, &mulh);
-		sub = a[i] - mull - carryh;
-		carryh = mulh + (a[i] < sub);
-		a[i] = sub;
-	}
+#define IR_KERNEL_PM(ks) {\
+	ks, ks / LIMB_SIZE,\
+	one_pm_ ## ks,\
+	NULL, from_pm_ ## ks,\
+	mul_pm_ ## ks, 0, IR_FORM_MERSENNE,\
 }
 
+static const struct ir_kernel kernels[] = {
+	IR_KERNEL(1024),
+	IR_KERNEL(2048),
+	IR_KERNEL(3072),
+	IR_KERNEL(4096),
+};
+
+static const struct ir_kernel lazy_kernels[] = {
+	IR_KERNEL_LAZY(1024),
+	IR_KERNEL_LAZY(2048),
+	IR_KERNEL_LAZY(3072),
+	IR_KERNEL_LAZY(4096),
+};
+
+static const struct ir_kernel pm_kernels[] = {
+	IR_KERNEL_PM(1024),
+	IR_KERNEL_PM(2048),
+	IR_KERNEL_PM(3072),
+	IR_KERNEL_PM(4096),
+};
+
+#define IR_SOS(ks) { ks, mul_sos_ ## ks, mul_sos_ ## ks ## _lazy }
+
+static const struct {
+	uint keysize;
+	void (*mul_sos)(uint n, uint cutoff, limb op2[], const limb op1[],
+			const limb p[], limb minvp);
+	void (*mul_sos_lazy)(uint n, uint cutoff, limb op2[],
+			const limb op1[], const limb p[], limb minvp);
+} sos_kernels[] = {
+	IR_SOS(1024),
+	IR_SOS(2048),
+	IR_SOS(3072),
+	IR_SOS(4096),
+};
+
 /**
- * Returns (2^LOGBASE)^N - p == Montgomery representation of 1.
- * Assumes p has full bits.
+ * Returns the separated kernel for keysize.
  */
-uint* one_to_mont(const uint p[])
+static void (*sos_mul_of(uint keysize, int lazy))(uint, uint, limb[],
+		const limb[], const limb[], limb)
 {
-#ifdef ALIGN
-	uint *ret = (uint*)_mm_malloc(N * sizeof(ret[0]), ALIGNBOUNDARY);
-#else
-	uint *ret = calloc(N, sizeof(ret[0]));
-#endif
-	uint i;
+	size_t i;
 
-#ifdef ALIGN
-#pragma vector aligned
-#endif
-	for (i = 0; i < N; i++)
-		ret[i] = ~p[i];
-	ret[0]++;
+	for (i = 0; i < sizeof(sos_kernels) / sizeof(sos_kernels[0]); i++)
+		if (sos_kernels[i].keysize == keysize)
+			return lazy ? sos_kernels[i].mul_sos_lazy :
+				sos_kernels[i].mul_sos;
+	return lazy ? mul_sos_any_lazy : mul_sos_any;
+}
 
-	return ret;
+static enum ir_mul mul_choice = IR_MUL_AUTO;
+
+static const char *mul_names[] = { "auto", "cios", "karatsuba" };
+
+/* kernel chosen for each key size already calibrated */
+static struct {
+	uint keysize;
+	enum ir_mul mul;
+	uint cutoff;
+} *calibrated;
+static size_t ncalibrated;
+
+int ir_mul_parse(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(mul_names) / sizeof(mul_names[0]); i++)
+		if (!strcmp(name, mul_names[i]))
+			return i;
+	return -1;
+}
+
+void ir_mul_set(enum ir_mul mul)
+{
+	mul_choice = mul;
+	ncalibrated = 0;
 }
 
+/* multiplications timed per candidate, best of CALIBRATION_RUNS */
+#define CALIBRATION_MULS 2000
+#define CALIBRATION_RUNS 3
+
 /**
- * Montgomery multiply op1 and op2 modulo p, keeping result in op2.
- * minvp is used to keep result in Montgomery representation.
+ * Returns the time (in s) of a chain of multiplications with k, using the
+ * separated kernel with cutoff (unless k->mul_sos is NULL).
  */
-#ifdef RESTRICT
-void mul_full(uint *restrict op2, const uint *restrict op1, const uint *restrict p, uint minvp)
-#else
-void mul_full(uint op2[N], const uint op1[N], const uint p[N], uint minvp)
-#endif
+static double time_kernel(const struct ir_kernel *k, const limb *x, limb *y,
+		const limb *p, limb minvp)
 {
+	struct timespec st, en;
+	double best = 0, t;
+	uint r, i;
+
+	for (r = 0; r < CALIBRATION_RUNS; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &st);
+		for (i = 0; i < CALIBRATION_MULS; i++)
+			mul_full(k, y, x, p, minvp);
+		clock_gettime(CLOCK_MONOTONIC, &en);
+		t = (en.tv_sec - st.tv_sec) + (en.tv_nsec - st.tv_nsec) / 1e9;
+		if (!r || t < best)
+			best = t;
+	}
+	return best;
+}
 
-	uint carryl, carryh, ui, uiml, uimh, xiyl, xiyh, i, j, xiyil, xiyih;
-#ifdef ALIGN
-	uint v[N] __attribute__((aligned(ALIGNBOUNDARY)));
-	__assume_aligned(&v[0], ALIGNBOUNDARY);
-#else
-	uint v[N];
-#endif
-#ifdef STRRED
-	uint a, b;
-#endif
-
-#ifdef ALIGN
-#pragma vector aligned
-#endif
-	for (i = 0; i < N; i++)
-		v[i] = 0;
+/**
+ * Times the interleaved kernel against the separated one with Karatsuba
+ * cutoffs of 8, 16, ... limbs (and Comba only) on operands of k's size, and
+ * sets k to the fastest allowed by choice. k->cutoff is the best cutoff even
+ * if the interleaved kernel wins, for the pseudo-Mersenne kernels.
+ */
+static void calibrate(struct ir_kernel *k, enum ir_mul choice)
+{
+	const uint n = k->n;
+	limb p[n], x[n], y[n], inv, minvp;
+	double t, sos = -1, cios = 0;
+	uint cutoff, best_cutoff = 0;
+	uint64 state = 0x9e3779b97f4a7c15UL;
+	uint i;
 
-	/* TODO: v prevents vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-	for (i = 0; i < N; i++) {
-		/** Step 1:
-		 *    ui <- (v[0] + op1[i] * op2[0]) * minvp `mod` (2^LOGBASE)
-		 */
-		fullmul(op1[i], op2[0], &xiyl, &xiyh);
-		ui = v[0] + xiyl;
-		ui *= minvp;
-
-		/** Step 2:
-		 *    v <- (v + op1[i] * op2 + ui * p) / b
-		 *
-		 * Compute the sum, digit by digit in op2 and p
-		 */
-		fullmul(ui, p[0], &uiml, &uimh);
-		carryh = add(&carryl, xiyl, uiml);
-		carryh += addin(&carryl, v[0]);
-		carryl = addin(&carryh, xiyh);
-		carryl += addin(&carryh, uimh);
-		/* TODO: v, carryl prevent vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-		for (j = 0; j < N - 1; j++) {
-			carryh = carryl + add(&v[j], carryh, v[j + 1]);
-			fullmul(op1[i], op2[j + 1], &xiyil, &xiyih);
-			fullmul(ui, p[j + 1], &uiml, &uimh);
-			carryh += addin(&v[j], xiyil);
-			carryh += addin(&v[j], uiml);
-			carryl = addin(&carryh, xiyih);
-			carryl += addin(&carryh, uimh);
-		}
-		v[N-1] = carryh;
+	/* odd modulus with the top bit set, operands below it */
+	for (i = 0; i < n; i++) {
+		state = state * 6364136223846793005UL + 1442695040888963407UL;
+		p[i] = (limb)(state >> 11);
+		x[i] = (limb)(state >> 7);
+		y[i] = (limb)(state >> 3);
 	}
-
-	/* compare v with p */
-#ifdef VECTSEARCH
-#ifdef ALIGN
-	uint above[N] __attribute__((aligned(ALIGNBOUNDARY)));
-	uint below[N] __attribute__((aligned(ALIGNBOUNDARY)));
-	__assume_aligned(&above[0], ALIGNBOUNDARY);
-	__assume_aligned(&below[0], ALIGNBOUNDARY);
-	__assume_aligned(&p[0], ALIGNBOUNDARY);
-#else
-	uint above[N], below[N];
-#endif
-	uint ai = 0, bi = 0;
-
-#pragma simd reduction (max:ai,bi)
-	for (i = 0; i < N; i++) {
-		above[i] = i * (v[i] > p[i]);
-		below[i] = i * (v[i] < p[i]);
-		if (ai < above[i]) ai = above[i];
-		if (bi < below[i]) bi = below[i];
+	p[0] |= 1;
+	p[n - 1] |= (limb)1 << (LIMB_SIZE - 1);
+	x[n - 1] &= MASK >> 1;
+	y[n - 1] &= MASK >> 1;
+
+	/* p^-1 `mod` 2^LIMB_SIZE by Newton iteration */
+	inv = p[0];
+	for (i = 0; i < 6; i++)
+		inv *= 2 - p[0] * inv;
+	minvp = -inv;
+
+	if (choice != IR_MUL_KARATSUBA) {
+		k->mul_sos = NULL;
+		cios = time_kernel(k, x, y, p, minvp);
 	}
-	carryl = carryl | (ai > bi);
-#else
-	for (i = N - 1; i > 0 && !carryl; i--)
-		if (v[i] < p[i])
-			break;
-		else if (v[i] > p[i])
-			carryl = 1;
-#endif
 
-	/* if v > p then set v to v - p */
-	if (carryl) {
-		carryl = 0;
-		/* TODO: carryl prevents vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-		for (i = 0; i < N; i++) {
-			carryh = v[i] - p[i] - carryl;
-			carryl = v[i] < carryh;
-			v[i] = carryh;
+	for (cutoff = 8; ; cutoff *= 2) {
+		k->cutoff = cutoff < n ? cutoff : n;
+		k->mul_sos = sos_mul_of(k->keysize, 0);
+		t = time_kernel(k, x, y, p, minvp);
+		if (sos < 0 || t < sos) {
+			sos = t;
+			best_cutoff = k->cutoff;
 		}
+		if (cutoff >= n)
+			break;
 	}
 
-	/* result in v, copy to op2 */
-#ifdef ALIGN
-	__assume_aligned(&op2[0], ALIGNBOUNDARY);
-#pragma vector aligned
-#endif
-	for (i = 0; i < N; i++)
-		op2[i] = v[i];
+	k->cutoff = best_cutoff;
+	k->mul_sos = choice == IR_MUL_KARATSUBA ||
+		(choice == IR_MUL_AUTO && sos < cios) ?
+		sos_mul_of(k->keysize, 0) : NULL;
+
+	printf("IR multiply for %u bits: ", k->keysize);
+	if (!k->mul_sos)
+		printf("cios\n");
+	else if (cios > 0)
+		printf("karatsuba (cutoff %u limbs), %.2fx cios\n", k->cutoff,
+				cios / sos);
+	else
+		printf("karatsuba (cutoff %u limbs)\n", k->cutoff);
 }
 
 /**
- * Convert from Montgomery.
- * Should be faster than calling mul_full(op2, 1, prime, minvp).
+ * Sets k to the kernels of form for keysize, interleaved ones for Montgomery
+ * multiplication.
  */
-#ifdef RESTRICT
-void convert_from_mont(uint *restrict op2, const uint *restrict p, uint minvp)
-#else
-void convert_from_mont(uint op2[N], const uint p[N], uint minvp)
-#endif
+static void select_form(uint keysize, enum ir_form form, struct ir_kernel *k)
 {
+	const struct ir_kernel *table = form == IR_FORM_LAZY ? lazy_kernels :
+		form == IR_FORM_MERSENNE ? pm_kernels : kernels;
+	size_t i;
 
-	uint carryl, carryh, ui, uiml, uimh, i, j;
-#ifdef ALIGN
-	uint v[N] __attribute__((aligned(ALIGNBOUNDARY)));
-	__assume_aligned(&v[0], ALIGNBOUNDARY);
-#else
-	uint v[N];
-#endif
-
-#ifdef ALIGN
-#pragma vector aligned
-#endif
-	for (i = 0; i < N; i++)
-		v[i] = 0;
-
-	/**
-	 * LSBpart: op1[i] would be 1
-	 */
-	ui = op2[0] * minvp;
-	fullmul(ui, p[0], &uiml, &uimh);
-	carryh = add(&carryl, op2[0], uiml);
-	carryl = addin(&carryh, uimh);
-	/* TODO: v, carryl prevent vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-	for (j = 0; j < N - 1; j++) {
-		carryh = carryl + add(&v[j], carryh, v[j + 1]);
-		fullmul(ui, p[j + 1], &uiml, &uimh);
-		carryh += addin(&v[j], op2[j + 1]);
-		carryh += addin(&v[j], uiml);
-		carryl = addin(&carryh, uimh);
-	}
-	v[N-1] = carryh;
-
-	/**
-	 * Remaining part: op1[i] is 0
-	 */
-	/* TODO: v prevents vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-	for (i = 1; i < N; i++) {
-		ui = v[0] * minvp;
-		fullmul(ui, p[0], &uiml, &uimh);
-		carryh = addin(&uiml, v[0]);
-		carryl = addin(&carryh, uimh);
-		/* TODO: v, carryl prevent vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-		for (j = 0; j < N - 1; j++) {
-			carryh = carryl + add(&v[j], carryh, v[j + 1]);
-			fullmul(ui, p[j + 1], &uiml, &uimh);
-			carryh += addin(&v[j], uiml);
-			carryl = addin(&carryh, uimh);
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+		if (table[i].keysize == keysize) {
+			*k = table[i];
+			return;
 		}
-		v[N-1] = carryh;
-	}
 
-	/* compare v with p */
-#ifdef VECTSEARCH
-#ifdef ALIGN
-	uint above[N] __attribute__((aligned(ALIGNBOUNDARY)));
-	uint below[N] __attribute__((aligned(ALIGNBOUNDARY)));
-	__assume_aligned(&above[0], ALIGNBOUNDARY);
-	__assume_aligned(&below[0], ALIGNBOUNDARY);
-	__assume_aligned(&p[0], ALIGNBOUNDARY);
-#else
-	uint above[N], below[N];
-#endif
-	uint ai = 0, bi = 0;
-
-#pragma simd reduction (max:ai,bi)
-	for (i = 0; i < N; i++) {
-		above[i] = i * (v[i] > p[i]);
-		below[i] = i * (v[i] < p[i]);
-		if (ai < above[i]) ai = above[i];
-		if (bi < below[i]) bi = below[i];
+	k->keysize = keysize;
+	k->n = keysize / LIMB_SIZE;
+	k->mul_sos = NULL;
+	k->cutoff = 0;
+	k->form = form;
+	switch (form) {
+	case IR_FORM_FULL:
+		k->one_to_mont = one_to_mont_any;
+		k->mul_full = mul_full_any;
+		k->convert_from_mont = convert_from_mont_any;
+		break;
+	case IR_FORM_LAZY:
+		k->one_to_mont = one_to_mont_any_lazy;
+		k->mul_full = mul_full_any_lazy;
+		k->convert_from_mont = convert_from_mont_any_lazy;
+		break;
+	case IR_FORM_MERSENNE:
+		k->one_to_mont = one_pm_any;
+		k->mul_full = NULL;
+		k->convert_from_mont = from_pm_any;
+		k->mul_sos = mul_pm_any;
+		break;
 	}
-	carryl = carryl | (ai > bi);
-#else
-	for (i = N - 1; i > 0 && !carryl; i--)
-		if (v[i] < p[i])
+}
+
+void ir_kernel_select(uint keysize, enum ir_form form, struct ir_kernel *k)
+{
+	size_t i;
+
+	/* pseudo-Mersenne kernels always need the cutoff of their product */
+	select_form(keysize, form, k);
+	if (mul_choice == IR_MUL_CIOS && form != IR_FORM_MERSENNE)
+		return;
+
+	for (i = 0; i < ncalibrated; i++)
+		if (calibrated[i].keysize == keysize)
 			break;
-		else if (v[i] > p[i])
-			carryl = 1;
-#endif
 
-	/* if v > p then set v to v - p */
-	if (carryl) {
-		carryl = 0;
-		/* TODO: carryl prevents vectorization */
-#ifdef UNROLL
-#pragma unroll
-#endif
-		for (i = 0; i < N; i++) {
-			carryh = v[i] - p[i] - carryl;
-			carryl = v[i] < carryh;
-			v[i] = carryh;
-		}
+	/* timed with full reductions, the choice holds for all forms */
+	if (i == ncalibrated) {
+		select_form(keysize, IR_FORM_FULL, k);
+		calibrate(k, mul_choice);
+		calibrated = realloc(calibrated,
+				(ncalibrated + 1) * sizeof(calibrated[0]));
+		calibrated[i].keysize = keysize;
+		calibrated[i].mul = k->mul_sos ? IR_MUL_KARATSUBA :
+			IR_MUL_CIOS;
+		calibrated[i].cutoff = k->cutoff;
+		ncalibrated++;
+		select_form(keysize, form, k);
 	}
 
-	/* result in v, copy to op2 */
+	k->cutoff = calibrated[i].cutoff;
+	if (form != IR_FORM_MERSENNE)
+		k->mul_sos = calibrated[i].mul == IR_MUL_KARATSUBA ?
+			sos_mul_of(keysize, form == IR_FORM_LAZY) : NULL;
+}
+
+enum ir_form ir_prime_form(uint n, const limb p[])
+{
+	uint i;
+
+	if (!(p[n - 1] >> (LIMB_SIZE - 2)))
+		return IR_FORM_LAZY;
+
+	for (i = 1; i < n && p[i] == MASK; i++)
+		;
+	return n > 1 && i == n ? IR_FORM_MERSENNE : IR_FORM_FULL;
+}
+
+int ir_kernel_check(const struct ir_kernel *k, const mpz_t prime,
+		limb minvp, size_t chain)
+{
+	const uint n = k->n;
+	limb p[n], r[n], y[n], *acc;
+	gmp_randstate_t state;
+	mpz_t expect, num;
+	size_t i;
+	int ret;
+
+	gmp_randinit_default(state);
+	mpz_init_set_ui(expect, 1);
+	mpz_init(num);
+	convert_from_mpz_1((mpz_ptr)prime, p, n);
+
+	/* R^2 `mod` p converts to the kernel's representation, R is 1 for PM */
+	if (k->form == IR_FORM_MERSENNE) {
+		mpz_set_ui(num, 1);
+	} else {
+		mpz_ui_pow_ui(num, 2, 2 * k->keysize);
+		mpz_mod(num, num, prime);
+	}
+	convert_from_mpz_1(num, r, n);
+
+	/* acc = y_0 * y_1 * ... in the kernel's representation */
+	acc = one_to_mont(k, p);
+	for (i = 0; i < chain; i++) {
+		mpz_urandomm(num, state, prime);
+		mpz_mul(expect, expect, num);
+		mpz_mod(expect, expect, prime);
+
+		convert_from_mpz_1(num, y, n);
+		mul_full(k, y, r, p, minvp);
+		mul_full(k, acc, y, p, minvp);
+	}
+	convert_from_mont(k, acc, p, minvp);
+
+	convert_to_mpz(&num, 1, acc, n);
+	ret = mpz_cmp(num, expect) ? -1 : 0;
+
 #ifdef ALIGN
-	__assume_aligned(&op2[0], ALIGNBOUNDARY);
-#pragma vector aligned
+	_mm_free(acc);
+#else
+	free(acc);
 #endif
-	for (i = 0; i < N; i++)
-		op2[i] = v[i];
+	mpz_clear(expect);
+	mpz_clear(num);
+	gmp_randclear(state);
+	return ret;
 }
 
-void display_num(const uint n[])
+void display_num(uint len, const limb n[])
 {
 	uint i;
 
-	printf("[%u", n[0]);
-	for (i = 1; i < N; i++)
-		printf(", %u", n[i]);
+	printf("[%lu", (unsigned long)n[0]);
+	for (i = 1; i < len; i++)
+		printf(", %lu", (unsigned long)n[i]);
 	printf("]\n");
 }
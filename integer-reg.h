@@ -1,73 +1,186 @@
 #ifndef INTEGERREG_H__
 #define INTEGERREG_H__
 
+/*
+ * size of a limb in bits: 32 or 64, by default the width of GMP's limbs on
+ * 64-bit hosts (numbers are used without splitting them) and 32 elsewhere
+ */
+#ifndef LIMB_SIZE
+#if defined(__SIZEOF_INT128__) && __SIZEOF_LONG__ == 8
+#define LIMB_SIZE 64
+#else
 #define LIMB_SIZE 32
+#endif
+#endif
+
+#if LIMB_SIZE == 64
+typedef unsigned long limb;
+typedef unsigned __int128 dlimb;
+#elif LIMB_SIZE == 32
+typedef unsigned int limb;
+typedef unsigned long dlimb;
+#else
+#error "LIMB_SIZE must be 32 or 64"
+#endif
 
 #ifdef DEBUG_IREG
-#define debug_IR(msg, n)\
+#define debug_IR(k, msg, num)\
 	do{\
 		printf(msg);\
-		display_num(n);\
+		display_num((k)->n, num);\
 	}while(0)
 #else
-#define debug_IR(msg, n)
+#define debug_IR(k, msg, num)
 #endif
 
 struct mpz_t;
 
 /**
- * call setN only once!
+ * Converts one single mpz_t number to limb* representation.
+ * With 64-bit limbs the mpz limbs are copied as they are.
  */
-void setN(uint newN);
-uint getN();
+void convert_from_mpz_1(mpz_t num, limb* repr, size_t sz);
 
 /**
- * Converts one single mpz_t number to uint* representation.
+ * Convert an array of mpz_t numbers into an array of limb*
+ *
+ * 	count:		number of mpz_t numbers
+ * 	sz:		total size of repr array
  */
-void convert_from_mpz_1(mpz_t num, uint* repr, size_t sz);
+void convert_from_mpz(mpz_t *nums, size_t count, limb *repr, size_t sz);
 
 /**
- * Convert an array of mpz_t numbers into an array of uint*
+ * Convert to an array of mpz_t numbers from an array of limb*
  *
  * 	count:		number of mpz_t numbers
  * 	sz:		total size of repr array
  */
-void convert_from_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz);
+void convert_to_mpz(mpz_t *nums, size_t count, limb *repr, size_t sz);
 
 /**
- * Convert to an array of mpz_t numbers from an array of uint*
+ * Montgomery kernels for one key size. Kernels for 1024, 2048, 3072 and 4096
+ * bits are compiled with the number of limbs known in advance, so that loops
+ * can be fully unrolled and temporaries have fixed size. Other key sizes use
+ * generic kernels. Call through the wrappers below.
  *
- * 	count:		number of mpz_t numbers
- * 	sz:		total size of repr array
+ * Multiplication is either interleaved (CIOS, mul_full) or separated
+ * (mul_sos): a full product with Karatsuba down to cutoff limbs and Comba
+ * below, then a Montgomery reduction. The latter does fewer limb
+ * multiplications and wins for large keys.
+ *
+ * Lazy kernels leave the results of multiplications in [0, 2p) instead of
+ * [0, p), which saves a compare and a conditional subtraction per
+ * multiplication. They need 4p < R; convert_from_mont still reduces fully.
+ *
+ * Pseudo-Mersenne kernels are for primes 2^keysize - c with c below
+ * 2^LIMB_SIZE. They reduce the separated product by folding its high half
+ * (2^keysize = c `mod` p) and keep numbers as they are: one_to_mont returns 1
+ * and convert_from_mont does nothing. mul_full is NULL for them.
+ */
+enum ir_form {
+	IR_FORM_FULL,
+	IR_FORM_LAZY,
+	IR_FORM_MERSENNE
+};
+
+struct ir_kernel {
+	/* key size, in bits */
+	uint keysize;
+	/* number of limbs in one number */
+	uint n;
+	limb* (*one_to_mont)(uint n, const limb p[]);
+	void (*mul_full)(uint n, limb op2[], const limb op1[], const limb p[],
+			limb minvp);
+	void (*convert_from_mont)(uint n, limb op2[], const limb p[],
+			limb minvp);
+	/* separated multiplication if not NULL, used instead of mul_full */
+	void (*mul_sos)(uint n, uint cutoff, limb op2[], const limb op1[],
+			const limb p[], limb minvp);
+	uint cutoff;
+	/* primes the kernels are for, see ir_prime_form */
+	enum ir_form form;
+};
+
+/**
+ * Multiplication kernels:
+ * 	- auto: the fastest for the key size, timed on first use
+ * 	- cios: interleaved
+ * 	- karatsuba: separated, with the fastest cutoff
+ */
+enum ir_mul {
+	IR_MUL_AUTO,
+	IR_MUL_CIOS,
+	IR_MUL_KARATSUBA
+};
+
+/**
+ * Returns the multiplication called name, or -1 if unknown.
+ */
+int ir_mul_parse(const char *name);
+
+/**
+ * Sets the multiplication used by the next ir_kernel_select calls.
+ */
+void ir_mul_set(enum ir_mul mul);
+
+/**
+ * Selects the kernels of form for keysize. To be called once at startup,
+ * kernels for different key sizes can be used at the same time. The first
+ * selection of a key size times the multiplications (unless cios is set) and
+ * prints the choice. Pseudo-Mersenne kernels are timed even with cios, for
+ * the cutoff of their product.
+ */
+void ir_kernel_select(uint keysize, enum ir_form form, struct ir_kernel *k);
+
+/**
+ * Returns the form of the prime p of n limbs: lazy if it is below R / 4,
+ * pseudo-Mersenne if all its limbs but the lowest are full, full otherwise.
  */
-void convert_to_mpz(mpz_t *nums, size_t count, uint *repr, size_t sz);
+enum ir_form ir_prime_form(uint n, const limb p[]);
 
 /**
- * One step in the conversion to Montgomery representation (a*base^N `mod` p).
- * Must call this function 2N times to achieve full representation.
+ * Multiplies chain random numbers below prime with the kernels of k, without
+ * reducing in between, and compares the result with GMP's. Numbers are
+ * converted to the kernels' representation and back. Returns 0 if they
+ * match, -1 otherwise.
  */
-void convert_to_mont(uint a[], const uint p[]);
+int ir_kernel_check(const struct ir_kernel *k, const mpz_t prime,
+		limb minvp, size_t chain);
 
 /**
  * Returns number 1 in Montgomery representation.
  * Should be faster than calling mul_mon(1, p).
  */
-uint* one_to_mont(const uint p[]);
+static inline limb* one_to_mont(const struct ir_kernel *k, const limb p[])
+{
+	return k->one_to_mont(k->n, p);
+}
 
 /**
  * Montgomery multiply op1 and op2 modulo p, keeping result in op2.
  * minvp is used to keep result in Montgomery representation.
  */
-void mul_full(uint op2[], const uint op1[], const uint p[], uint minvp);
+static inline void mul_full(const struct ir_kernel *k, limb op2[],
+		const limb op1[], const limb p[], limb minvp)
+{
+	if (k->mul_sos)
+		k->mul_sos(k->n, k->cutoff, op2, op1, p, minvp);
+	else
+		k->mul_full(k->n, op2, op1, p, minvp);
+}
 
 /**
  * Convert from Montgomery.
  * Should be faster than calling mul_full(op2, 1, prime, minvp).
  */
-void convert_from_mont(uint op2[], const uint p[], uint minvp);
+static inline void convert_from_mont(const struct ir_kernel *k, limb op2[],
+		const limb p[], limb minvp)
+{
+	k->convert_from_mont(k->n, op2, p, minvp);
+}
 
 /**
  * Debug purposes only.
  */
-void display_num(const uint n[]);
+void display_num(uint len, const limb n[]);
 #endif
@@ -1,20 +1,31 @@
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <gmp.h>
 
-#ifdef ALIGN
-#include <malloc.h>
+#ifdef HAVEOMP
+#include <omp.h>
 #endif
 
+#include "affinity.h"
+#include "arena.h"
+#include "bench.h"
 #include "client.h"
+#include "database.h"
 #include "globals.h"
-#include "server.h"
-
-#ifdef IR_CODE
 #include "integer-reg.h"
-#endif
+#include "latency.h"
+#include "numfile.h"
+#include "perf.h"
+#include "pool.h"
+#include "server.h"
+#include "service.h"
+#include "simd.h"
+#include "tune.h"
 
 #ifndef DEBUG_RESULTS
 #define DEBUG_RESULTS 0
@@ -23,17 +34,155 @@
 /* default key size: 1024 bits */
 #define KEYDEFAULT 1024
 
+/* default engine, set by the Makefile */
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE "auto"
+#endif
+
 /* options as string */
-#define OPTSTR "n:k:m:"
+#define OPTSTR "n:k:m:d:T:s:e:"
+
+/* long-only options */
+enum {
+	OPT_BENCH = 256,
+	OPT_KEYSIZES,
+	OPT_SIZES,
+	OPT_LENGTHS,
+	OPT_THREADS,
+	OPT_WARMUP,
+	OPT_REPS,
+	OPT_CSV,
+	OPT_JSON,
+	OPT_AFFINITY,
+	OPT_LISTEN,
+	OPT_CONNECT,
+	OPT_STOP,
+	OPT_BATCH,
+	OPT_WINDOW,
+	OPT_STREAM,
+	OPT_RECURSIVE,
+	OPT_IRMUL,
+	OPT_PRIME,
+	OPT_SCHED,
+	OPT_AUTOTUNE,
+	OPT_PROFILE,
+	OPT_LATENCY,
+	OPT_METRICS,
+	OPT_METRICS_INTERVAL,
+	OPT_STATS,
+};
+
+/* long options, same letters as the short ones */
+static const struct option longopts[] = {
+	{"seed", required_argument, NULL, 's'},
+	{"engine", required_argument, NULL, 'e'},
+	{"bench", no_argument, NULL, OPT_BENCH},
+	{"keysizes", required_argument, NULL, OPT_KEYSIZES},
+	{"sizes", required_argument, NULL, OPT_SIZES},
+	{"lengths", required_argument, NULL, OPT_LENGTHS},
+	{"threads", required_argument, NULL, OPT_THREADS},
+	{"warmup", required_argument, NULL, OPT_WARMUP},
+	{"reps", required_argument, NULL, OPT_REPS},
+	{"csv", required_argument, NULL, OPT_CSV},
+	{"json", required_argument, NULL, OPT_JSON},
+	{"affinity", required_argument, NULL, OPT_AFFINITY},
+	{"listen", required_argument, NULL, OPT_LISTEN},
+	{"connect", required_argument, NULL, OPT_CONNECT},
+	{"stop", no_argument, NULL, OPT_STOP},
+	{"batch", required_argument, NULL, OPT_BATCH},
+	{"window", required_argument, NULL, OPT_WINDOW},
+	{"stream", optional_argument, NULL, OPT_STREAM},
+	{"recursive", no_argument, NULL, OPT_RECURSIVE},
+	{"irmul", required_argument, NULL, OPT_IRMUL},
+	{"prime", required_argument, NULL, OPT_PRIME},
+	{"sched", required_argument, NULL, OPT_SCHED},
+	{"autotune", no_argument, NULL, OPT_AUTOTUNE},
+	{"profile", required_argument, NULL, OPT_PROFILE},
+	{"latency", no_argument, NULL, OPT_LATENCY},
+	{"metrics", required_argument, NULL, OPT_METRICS},
+	{"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+	{"stats", no_argument, NULL, OPT_STATS},
+	{NULL, 0, NULL, 0}
+};
+
+/* default wait of --listen for more queries to batch (in ms) */
+#define WINDOWDEFAULT 5
+
+/* default chunk size of --stream (in MiB) */
+#define CHUNKDEFAULT 64
+
+/* defaults of the benchmark mode */
+#define WARMUPDEFAULT 1
+#define REPSDEFAULT 10
+
+/* tuning profile written by --autotune and read by the other runs */
+#define PROFILEDEFAULT "ko.profile"
+
+/* largest IR tile and Four-Russians width tried by --autotune */
+#define TUNEMAXTILE 64
+#define TUNEMAXWIDTH 8
+
+/* comma separated list of values from the command line */
+struct list {
+	size_t *v;
+	size_t len;
+};
 
 /* Command line arguments */
 static struct {
 	/* database size (n) */
-	int db_size;
+	long db_size;
 	/* number of operands in query (k) */
-	int query_length;
+	long query_length;
 	/* keysize, defaut KEYDEFAULT */
 	int keysize;
+	/* database file, default chosen from db_size and query_length */
+	const char *db_file;
+	/* memory for Four-Russians tables (in MiB), 0 to disable */
+	int table_budget;
+	/* seed of all random generators, random if not given */
+	struct seed seed;
+	/* server engine */
+	const struct engine *engine;
+	/* set if given on the command line, the profile doesn't change them */
+	int engine_given, sched_given;
+	/* benchmark sweep instead of a single run */
+	int bench;
+	/* sweep over these, default to the single values above */
+	struct list keysizes, sizes, lengths, threads;
+	/* runs before the measured ones */
+	int warmup;
+	/* measured runs per point */
+	int reps;
+	/* machine readable results of the sweep, may be NULL */
+	const char *csv;
+	const char *json;
+	/* serve queries on this address instead of running once */
+	const char *listen;
+	/* send the query to the server on this address */
+	const char *connect;
+	/* stop the server on args.connect */
+	int stop;
+	/* print the latencies of the server on args.connect */
+	int stats;
+	/* queries answered in one pass over the database */
+	int batch;
+	/* longest wait of the server for batch queries (in ms) */
+	int window;
+	/* read the database in chunks of this many MiB, 0 to map it */
+	int stream;
+	/* retrieve one bit with a two-level query */
+	int recursive;
+	/* search the fastest configuration of each of args.keysizes */
+	int autotune;
+	/* tuning profile */
+	const char *profile;
+	/* print the latency histograms after the run */
+	int latency;
+	/* write them as JSON to this file, may be NULL */
+	const char *metrics;
+	/* and every this many seconds during the run, 0 for never */
+	double metrics_interval;
 } args;
 
 static void usage(const char *prg)
@@ -44,16 +193,123 @@ static void usage(const char *prg)
 	fprintf(stderr, "\t-n sz\tsize of the database (in bits)\n");
 	fprintf(stderr, "\t-k ops\tnumber of operands in query from user\n");
 	fprintf(stderr, "\t-m keysize (default %d\n", KEYDEFAULT);
+	fprintf(stderr, "\t-d file\tdatabase file (generated if missing)\n");
+	fprintf(stderr, "\t-T mb\tuse Four-Russians tables of at most mb MiB (ir only)\n");
+	fprintf(stderr, "\t-s, --seed=seed\tseed for generated numbers and database\n");
+	fprintf(stderr, "\t-e, --engine=e\tnaive, mpn, ir, simd or auto (default %s)\n", DEFAULT_ENGINE);
+	fprintf(stderr, "\t--affinity=p\tpin threads: none, compact or scatter (default none); the ir\n");
+	fprintf(stderr, "\t\t\tengine also replicates the query and prime on each node\n");
+	fprintf(stderr, "\t--irmul=m\tIR multiplication: cios, karatsuba or auto (default auto,\n");
+	fprintf(stderr, "\t\t\tthe fastest for the key size)\n");
+	fprintf(stderr, "\t--prime=f\tfull, lazy (below 2^(keysize-2), results of ir multiplications\n");
+	fprintf(stderr, "\t\t\tare not fully reduced) or mersenne (2^keysize - c, ir reduces\n");
+	fprintf(stderr, "\t\t\twithout Montgomery), default full from the numberfile\n");
+	fprintf(stderr, "\t--sched=s\tIR passes on the work-stealing pool, converting the query while\n");
+	fprintf(stderr, "\t\t\tmultiplying, or omp (one OpenMP region per phase), default pool\n");
+	fprintf(stderr, "\t--batch=q\tanswer q queries with different primes in one pass (ir only)\n");
+	fprintf(stderr, "\t--stream[=mb]\tread the database in chunks of mb MiB (default %d)\n", CHUNKDEFAULT);
+	fprintf(stderr, "\t\t\tinstead of mapping it, for databases larger than memory\n");
+	fprintf(stderr, "\t--recursive\tretrieve one bit with a two-level query, answered with\n");
+	fprintf(stderr, "\t\t\tkeysize numbers instead of one per row (needs more rows than\n");
+	fprintf(stderr, "\t\t\tkeysize); both levels run locally, the service protocol has\n");
+	fprintf(stderr, "\t\t\tno recursive queries\n");
+	fprintf(stderr, "\t--latency\tprint p50/p99/p999 latencies of each thread's units of work\n");
+	fprintf(stderr, "\t\t\t(rows, IR tiles or simd blocks) and the thread imbalance\n");
+	fprintf(stderr, "\t--metrics=file\twrite the latencies as JSON to file after the run\n");
+	fprintf(stderr, "\t--metrics-interval=s\talso every s seconds during the run (to stdout as text\n");
+	fprintf(stderr, "\t\t\twithout --metrics), e.g. with --stream or --listen\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "BENCHMARK OPTIONS:\n");
+	fprintf(stderr, "\t--bench\t\tsweep over all combinations of the lists below\n");
+	fprintf(stderr, "\t--keysizes=l\tkey sizes (default -m)\n");
+	fprintf(stderr, "\t--sizes=l\tdatabase sizes (default -n)\n");
+	fprintf(stderr, "\t--lengths=l\tquery lengths (default -k)\n");
+	fprintf(stderr, "\t--threads=l\tthread counts (default all)\n");
+	fprintf(stderr, "\t--warmup=r\tunmeasured runs per point (default %d)\n", WARMUPDEFAULT);
+	fprintf(stderr, "\t--reps=r\tmeasured runs per point (default %d)\n", REPSDEFAULT);
+	fprintf(stderr, "\t--csv=file\twrite results as CSV\n");
+	fprintf(stderr, "\t--json=file\twrite results as JSON\n");
+	fprintf(stderr, "\tlists are comma separated, e.g. --keysizes=1024,2048\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "TUNING OPTIONS:\n");
+	fprintf(stderr, "\t--autotune\tmeasure engines (-e if given), threads and IR scheduler, tile and\n");
+	fprintf(stderr, "\t\t\ttable width for each of --keysizes over the -n/-k database,\n");
+	fprintf(stderr, "\t\t\tand save the fastest in the profile (uses --warmup, --reps)\n");
+	fprintf(stderr, "\t--profile=file\ttuning profile (default %s), applied to the other\n", PROFILEDEFAULT);
+	fprintf(stderr, "\t\t\truns on the host it was made on, options given win over it\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "SERVICE OPTIONS:\n");
+	fprintf(stderr, "\t--listen=a\tserve queries over the database on a until stopped,\n");
+	fprintf(stderr, "\t\t\tanswering up to --batch waiting queries in one pass\n");
+	fprintf(stderr, "\t--window=ms\twait up to ms after a query for --batch of them (default %d)\n", WINDOWDEFAULT);
+	fprintf(stderr, "\t--connect=a\tsend the query to the server on a\n");
+	fprintf(stderr, "\t--stop\t\tstop the server given with --connect\n");
+	fprintf(stderr, "\t--stats\t\tprint the latencies of the server given with --connect\n");
+	fprintf(stderr, "\t\t\tas JSON\n");
+	fprintf(stderr, "\ta is a UNIX socket path, or :port for a loopback TCP port\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "CONSTRAINTS:\n");
-	fprintf(stderr, "\tsz is a multiple of ops\n");
+	fprintf(stderr, "\tsz is a multiple of ops (other combinations are skipped in a sweep)\n");
 	exit(EXIT_FAILURE);
 }
 
+/**
+ * Parses a comma separated list of positive numbers. Returns -1 if invalid.
+ */
+static int parse_list(const char *str, struct list *l)
+{
+	const char *p = str;
+	unsigned long v;
+	int used;
+
+	free(l->v);
+	l->v = NULL;
+	l->len = 0;
+
+	for (;;) {
+		if (sscanf(p, "%lu%n", &v, &used) != 1 || !v)
+			return -1;
+		l->v = realloc(l->v, (l->len + 1) * sizeof(l->v[0]));
+		l->v[l->len++] = v;
+		p += used;
+		if (!*p)
+			return 0;
+		if (*p++ != ',')
+			return -1;
+	}
+}
+
+/**
+ * Sets l to the single value v, unless it was given on the command line.
+ */
+static void default_list(struct list *l, size_t v)
+{
+	if (l->len)
+		return;
+	l->v = malloc(sizeof(l->v[0]));
+	l->v[0] = v;
+	l->len = 1;
+}
+
+/**
+ * Returns the number of columns for which the two levels of a recursive query
+ * over n bits have about the same length (k and n / k numbers), with more
+ * rows than keysize so that the response shrinks. Returns 0 if there is none.
+ */
+static size_t recursive_k(size_t n, size_t keysize)
+{
+	size_t k = 1;
+
+	while (4 * k * k <= n && n % (2 * k) == 0 && n / (2 * k) > keysize)
+		k *= 2;
+	return n / k > keysize ? k : 0;
+}
+
 static void parse_arguments(int argc, char **argv)
 {
 	char extra;
-	int opt, i;
+	int opt, i, policy, mul, form, sched;
+	size_t k;
 
 	printf("Called with: argc=%d\n", argc);
 	for (i = 0; i < argc; i++)
@@ -63,21 +319,165 @@ static void parse_arguments(int argc, char **argv)
 	args.keysize = KEYDEFAULT;
 	args.db_size = -1;
 	args.query_length = -1;
+	args.db_file = NULL;
+	args.table_budget = 0;
+	make_seed(&args.seed, NULL);
+	args.engine = engine_select(DEFAULT_ENGINE);
+	args.warmup = WARMUPDEFAULT;
+	args.reps = REPSDEFAULT;
+	args.batch = 1;
+	args.window = WINDOWDEFAULT;
+	args.profile = PROFILEDEFAULT;
 
-	while((opt = getopt(argc, argv, OPTSTR)) != -1)
+	while((opt = getopt_long(argc, argv, OPTSTR, longopts, NULL)) != -1)
 		switch(opt) {
 		case 'n':
-			if (sscanf(optarg, "%d%c", &args.db_size, &extra) != 1)
+			if (sscanf(optarg, "%ld%c", &args.db_size, &extra) != 1)
 				usage(argv[0]);
 			break;
 		case 'k':
-			if (sscanf(optarg, "%d%c", &args.query_length, &extra) != 1)
+			if (sscanf(optarg, "%ld%c", &args.query_length, &extra) != 1)
 				usage(argv[0]);
 			break;
 		case 'm':
 			if (sscanf(optarg, "%d%c", &args.keysize, &extra) != 1)
 				usage(argv[0]);
 			break;
+		case 'd':
+			args.db_file = optarg;
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d%c", &args.table_budget, &extra) != 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			if (make_seed(&args.seed, optarg) < 0)
+				usage(argv[0]);
+			break;
+		case 'e':
+			args.engine = engine_select(optarg);
+			if (!args.engine) {
+				fprintf(stderr, "Unknown engine %s\n", optarg);
+				usage(argv[0]);
+			}
+			args.engine_given = 1;
+			break;
+		case OPT_BENCH:
+			args.bench = 1;
+			break;
+		case OPT_KEYSIZES:
+			if (parse_list(optarg, &args.keysizes) < 0)
+				usage(argv[0]);
+			break;
+		case OPT_SIZES:
+			if (parse_list(optarg, &args.sizes) < 0)
+				usage(argv[0]);
+			break;
+		case OPT_LENGTHS:
+			if (parse_list(optarg, &args.lengths) < 0)
+				usage(argv[0]);
+			break;
+		case OPT_THREADS:
+			if (parse_list(optarg, &args.threads) < 0)
+				usage(argv[0]);
+			break;
+		case OPT_WARMUP:
+			if (sscanf(optarg, "%d%c", &args.warmup, &extra) != 1 ||
+					args.warmup < 0)
+				usage(argv[0]);
+			break;
+		case OPT_REPS:
+			if (sscanf(optarg, "%d%c", &args.reps, &extra) != 1 ||
+					args.reps < 1)
+				usage(argv[0]);
+			break;
+		case OPT_CSV:
+			args.csv = optarg;
+			break;
+		case OPT_JSON:
+			args.json = optarg;
+			break;
+		case OPT_AFFINITY:
+			if ((policy = affinity_parse(optarg)) < 0) {
+				fprintf(stderr, "Unknown affinity %s\n", optarg);
+				usage(argv[0]);
+			}
+			affinity_set(policy);
+			break;
+		case OPT_LISTEN:
+			args.listen = optarg;
+			break;
+		case OPT_CONNECT:
+			args.connect = optarg;
+			break;
+		case OPT_STOP:
+			args.stop = 1;
+			break;
+		case OPT_BATCH:
+			if (sscanf(optarg, "%d%c", &args.batch, &extra) != 1 ||
+					args.batch < 1)
+				usage(argv[0]);
+			break;
+		case OPT_WINDOW:
+			if (sscanf(optarg, "%d%c", &args.window, &extra) != 1 ||
+					args.window < 0)
+				usage(argv[0]);
+			break;
+		case OPT_STREAM:
+			args.stream = CHUNKDEFAULT;
+			if (optarg && (sscanf(optarg, "%d%c", &args.stream,
+						&extra) != 1 || args.stream < 1))
+				usage(argv[0]);
+			break;
+		case OPT_IRMUL:
+			if ((mul = ir_mul_parse(optarg)) < 0) {
+				fprintf(stderr, "Unknown multiplication %s\n",
+						optarg);
+				usage(argv[0]);
+			}
+			ir_mul_set(mul);
+			break;
+		case OPT_PRIME:
+			if ((form = prime_form_parse(optarg)) < 0) {
+				fprintf(stderr, "Unknown prime form %s\n",
+						optarg);
+				usage(argv[0]);
+			}
+			prime_form_set(form);
+			break;
+		case OPT_SCHED:
+			if ((sched = pool_sched_parse(optarg)) < 0) {
+				fprintf(stderr, "Unknown scheduler %s\n",
+						optarg);
+				usage(argv[0]);
+			}
+			pool_sched_set(sched);
+			args.sched_given = 1;
+			break;
+		case OPT_AUTOTUNE:
+			args.autotune = 1;
+			break;
+		case OPT_PROFILE:
+			args.profile = optarg;
+			break;
+		case OPT_LATENCY:
+			args.latency = 1;
+			break;
+		case OPT_METRICS:
+			args.metrics = optarg;
+			break;
+		case OPT_METRICS_INTERVAL:
+			if (sscanf(optarg, "%lf%c", &args.metrics_interval,
+						&extra) != 1 ||
+					args.metrics_interval <= 0)
+				usage(argv[0]);
+			break;
+		case OPT_STATS:
+			args.stats = 1;
+			break;
+		case OPT_RECURSIVE:
+			args.recursive = 1;
+			break;
 		default: usage(argv[0]);
 		}
 
@@ -85,114 +485,786 @@ static void parse_arguments(int argc, char **argv)
 	if (optind != argc)
 		usage(argv[0]); /* extra arguments */
 
+	if (args.listen && args.connect) {
+		fprintf(stderr, "Use only one of --listen and --connect\n");
+		usage(argv[0]);
+	}
+	if (args.stop || args.stats) {
+		if (!args.connect) {
+			fprintf(stderr, "Missing --connect address\n");
+			usage(argv[0]);
+		}
+		return;
+	}
+
+	if (args.autotune && (args.bench || args.listen || args.connect ||
+				args.stream || args.batch > 1 || args.recursive)) {
+		fprintf(stderr, "--autotune is only for single runs\n");
+		usage(argv[0]);
+	}
+
+	if (args.bench) {
+		if ((args.db_size < 0 && !args.sizes.len) ||
+				(args.query_length < 0 && !args.lengths.len)) {
+			fprintf(stderr, "Missing/Invalid -n or -k values\n");
+			usage(argv[0]);
+		}
+
+		default_list(&args.keysizes, args.keysize);
+		default_list(&args.sizes, args.db_size);
+		default_list(&args.lengths, args.query_length);
+#ifdef HAVEOMP
+		default_list(&args.threads, omp_get_max_threads());
+#else
+		default_list(&args.threads, 1);
+#endif
+		return;
+	}
+
 	if (args.db_size < 0 || args.query_length < 0) {
 		fprintf(stderr, "Missing/Invalid -n or -k value\n");
 		usage(argv[0]);
 	}
 
+	if (args.table_budget < 0) {
+		fprintf(stderr, "Invalid table budget\n");
+		usage(argv[0]);
+	}
+
+	if (args.stream && (args.listen || args.connect || args.batch > 1)) {
+		fprintf(stderr, "--stream is only for single runs\n");
+		usage(argv[0]);
+	}
+
+	if (args.recursive && (args.stream || args.listen || args.connect ||
+				args.batch > 1)) {
+		fprintf(stderr, "--recursive is only for single runs\n");
+		usage(argv[0]);
+	}
+
 	if (args.db_size % args.query_length != 0) {
 		fprintf(stderr, "Database size is not multiple of ops\n");
 		usage(argv[0]);
 	}
+
+	/* the response of keysize numbers must be smaller than one per row */
+	if (args.recursive && args.db_size / args.query_length <= args.keysize) {
+		fprintf(stderr, "--recursive answers with %d numbers, not fewer "
+				"than the %ld rows of a plain query\n",
+				args.keysize, args.db_size / args.query_length);
+		k = recursive_k(args.db_size, (size_t)args.keysize);
+		if (k)
+			fprintf(stderr, "Balanced levels for this database: "
+					"-k %lu\n", k);
+		else
+			fprintf(stderr, "The database needs more than "
+					"%d bits\n", args.keysize);
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.autotune)
+		default_list(&args.keysizes, args.keysize);
 }
 
-int main(int argc, char **argv)
+static void load_query(struct query *q, size_t keysize, size_t length)
 {
-#ifdef IR_CODE
-	uint *_prime, *_inp, *_out;
-	uint sz, isz, osz;
+	q->keysize = keysize;
+	q->length = length;
+	q->converted = 0;
+	q->numbers = calloc(length, sizeof(q->numbers[0]));
+	if (!q->numbers) {
+		fprintf(stderr, "Cannot allocate memory for client numbers!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* numberfiles only hold full primes */
+	if (prime_form_get() != PRIME_FULL) {
+		memset(&q->nf, 0, sizeof(q->nf));
+		make_client_query(keysize, length, &args.seed, 0, q->prime,
+				&q->minvp, q->r2, q->numbers);
+		return;
+	}
+
+	get_client_query(keysize, length, &args.seed, q->prime, &q->minvp,
+			q->r2, q->numbers, &q->nf);
+}
+
+static void free_query(struct query *q)
+{
+	size_t i;
+
+	for (i = 0; i < q->length; i++)
+		mpz_clear(q->numbers[i]);
+	free(q->numbers);
+	mpz_clear(q->prime);
+	mpz_clear(q->r2);
+	numfile_unmap(&q->nf);
+}
+
+/**
+ * Runs the server once over db, with the first db->k numbers of q as query.
+ * Results must be cleared by the caller. Returns the time spent by the server
+ * (in ms).
+ */
+static double run_server(struct query *q, const struct database *db,
+		mpz_t *results)
+{
+	return server(args.engine, q, db, results,
+			(size_t)args.table_budget << 20);
+}
+
+/**
+ * Sends the first args.query_length numbers of q to the server on
+ * args.connect and reads its rows results (initialized here, cleared by the
+ * caller). Returns the time the server spent computing (in ms).
+ */
+static double run_remote(struct query *q, size_t rows, mpz_t *results)
+{
+	struct timespec st, en;
+	double time;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < rows; i++)
+		mpz_init(results[i]);
+
+	fd = service_connect(args.connect);
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	if (service_query(fd, q, (size_t)args.query_length, results, rows,
+				&time) < 0) {
+		fprintf(stderr, "Query to %s failed\n", args.connect);
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	close(fd);
+	printf("Round trip: %7.3lf ms\n", 1000 * time_diff(&st, &en));
+	return time;
+}
+
+/**
+ * Answers args.batch queries over db in one server pass: q and queries with
+ * other primes generated in memory. The results of query b are stored from
+ * results[b * db->rows] on. Returns the time spent by the server (in ms).
+ */
+static double run_batch(struct query *q, const struct database *db,
+		mpz_t *results)
+{
+	size_t b, count = args.batch;
+	struct query *extra, **qs;
+	mpz_t **outs;
+	double time;
+
+	extra = calloc(count, sizeof(extra[0]));
+	qs = calloc(count, sizeof(qs[0]));
+	outs = calloc(count, sizeof(outs[0]));
+	if (!extra || !qs || !outs) {
+		fprintf(stderr, "Cannot allocate memory for batch!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	qs[0] = q;
+	for (b = 1; b < count; b++) {
+		extra[b].keysize = q->keysize;
+		extra[b].length = db->k;
+		extra[b].numbers = calloc(db->k, sizeof(extra[b].numbers[0]));
+		if (!extra[b].numbers) {
+			fprintf(stderr, "Cannot allocate memory for client numbers!\n");
+			exit(EXIT_FAILURE);
+		}
+		make_client_query(q->keysize, db->k, &args.seed, b,
+				extra[b].prime, &extra[b].minvp, extra[b].r2,
+				extra[b].numbers);
+		qs[b] = &extra[b];
+	}
+	for (b = 0; b < count; b++)
+		outs[b] = &results[b * db->rows];
+
+	time = server_batch(args.engine, qs, count, db, outs);
+
+	for (b = 1; b < count; b++)
+		free_query(&extra[b]);
+	free(extra);
+	free(qs);
+	free(outs);
+	return time;
+}
+
+/**
+ * Runs the server once over the database streamed from its file in chunks of
+ * args.stream MiB (generating the file first if missing), with the first
+ * args.query_length numbers of q as query. Fills shape with the size of the
+ * database. Returns the time spent by the server (in ms).
+ */
+static double run_stream(struct query *q, gmp_randstate_t state,
+		struct database *shape, mpz_t *results)
+{
+	struct stream_stats stats;
+	struct database db;
+	struct db_stream *s;
+	double time;
+
+	/* only to create the file, pages are dropped when unmapped */
+	get_database(args.db_file, (size_t)args.db_size,
+			(size_t)args.query_length, state, &db);
+	release_database(&db);
+
+	s = db_stream_open(args.db_file, (size_t)args.db_size,
+			(size_t)args.query_length, (size_t)args.stream << 20,
+			DB_STREAM_BUFFERS, shape);
+	if (!s)
+		exit(EXIT_FAILURE);
+
+	time = server_stream(args.engine, q, s, shape, results);
+
+	db_stream_close(s, &stats);
+	db_stream_report(&stats);
+	return time;
+}
+
+static size_t list_max(const struct list *l)
+{
+	size_t i, m = 0;
+
+	for (i = 0; i < l->len; i++)
+		if (l->v[i] > m)
+			m = l->v[i];
+	return m;
+}
+
+static void clear_results(mpz_t *results, size_t num_outputs)
+{
+	size_t j;
+
+	for (j = 0; j < num_outputs; j++)
+		mpz_clear(results[j]);
+}
+
+/**
+ * Retrieves a bit of db chosen from the seed with a recursive query, decodes
+ * it as the client would and checks it against the database. Returns the time
+ * spent by the server (in ms).
+ */
+static double run_recursive(const struct database *db)
+{
+	size_t keysize = args.keysize, row, col;
+	struct query q, q2;
+	mpz_t *results, x;
+	double time;
+	int bit;
+
+	row = rng_mix(args.seed.w[0]) % db->rows;
+	col = rng_mix(args.seed.w[0] + 1) % db->k;
+
+	/* first level selects the column, second level the row */
+	memset(&q, 0, sizeof(q));
+	memset(&q2, 0, sizeof(q2));
+	q.keysize = q2.keysize = keysize;
+	q.length = db->k;
+	q2.length = db->rows;
+	q.numbers = calloc(q.length, sizeof(q.numbers[0]));
+	q2.numbers = calloc(q2.length, sizeof(q2.numbers[0]));
+	results = calloc(keysize, sizeof(results[0]));
+	if (!q.numbers || !q2.numbers || !results) {
+		fprintf(stderr, "Cannot allocate memory for recursive query!\n");
+		exit(EXIT_FAILURE);
+	}
+	make_ko_query(keysize, q.length, col, &args.seed, 1, q.prime,
+			&q.minvp, q.r2, q.numbers);
+	make_ko_query(keysize, q2.length, row, &args.seed, 2, q2.prime,
+			&q2.minvp, q2.r2, q2.numbers);
+
+	time = server_recursive(args.engine, &q, &q2, db, results,
+			(size_t)args.table_budget << 20);
+
+	mpz_init(x);
+	ko_decode_number((const mpz_t *)results, keysize, q2.prime, x);
+	bit = ko_decode_bit(x, q.prime);
+	printf("Response: %lu numbers instead of %lu\n", keysize, db->rows);
+	printf("Retrieved bit (%lu, %lu): %d (%s)\n", row, col, bit,
+			bit == db_bit(db, row, col) ? "ok" : "WRONG");
+	mpz_clear(x);
+
+#if DEBUG_RESULTS
+	dump_results(keysize, (const mpz_t *)results);
 #endif
 
-	mpz_t prime, *numbers, *results;
-	size_t minvp, num_outputs, j;
-	gmp_randstate_t state;
-	int i;
+	clear_results(results, keysize);
+	free(results);
+	free_query(&q);
+	free_query(&q2);
+	return time;
+}
 
-	parse_arguments(argc, argv);
+/**
+ * Runs args.warmup + args.reps times over db with t threads and writes the
+ * statistics of the measured runs.
+ */
+static void bench_point(struct query *q, const struct database *db, int t,
+		struct bench_output *o)
+{
+	double *round, *mmps, time;
+	struct bench_row row;
+	mpz_t *results;
+	int r;
 
-	numbers = calloc(args.query_length, sizeof(numbers[0]));
-	if (!numbers) {
-		fprintf(stderr, "Cannot allocate memory for client numbers!\n");
+#ifdef HAVEOMP
+	omp_set_num_threads(t);
+#endif
+
+	round = calloc(args.reps, sizeof(round[0]));
+	mmps = calloc(args.reps, sizeof(mmps[0]));
+	results = calloc(db->rows, sizeof(results[0]));
+	if (!round || !mmps || !results) {
+		fprintf(stderr, "Cannot allocate memory for benchmark!\n");
 		exit(EXIT_FAILURE);
 	}
 
-	num_outputs = args.db_size / args.query_length;
-	results = calloc(num_outputs, sizeof(results[0]));
-	if (!results) {
-		fprintf(stderr, "Cannot allocate memory for server results!\n");
+	for (r = 0; r < args.warmup + args.reps; r++) {
+		time = run_server(q, db, results);
+		clear_results(results, db->rows);
+		if (r < args.warmup)
+			continue;
+		round[r - args.warmup] = time / db->rows;
+		mmps[r - args.warmup] = 0.001 * db->n / time;
+	}
+
+	row.engine = args.engine->name;
+	row.keysize = q->keysize;
+	row.n = db->n;
+	row.k = db->k;
+	row.threads = t;
+	row.reps = args.reps;
+	bench_stats(round, args.reps, &row.round);
+	bench_stats(mmps, args.reps, &row.mmps);
+	bench_write(o, &row);
+
+	printf("%-16s m=%-5lu n=%-9lu k=%-5lu t=%-3d "
+			"round %9.4f ms (p5 %9.4f p95 %9.4f sd %8.4f) "
+			"%8.3f mmps (p5 %8.3f p95 %8.3f sd %7.3f)\n",
+			row.engine, row.keysize, row.n, row.k, t,
+			row.round.median, row.round.p5, row.round.p95,
+			row.round.stddev, row.mmps.median, row.mmps.p5,
+			row.mmps.p95, row.mmps.stddev);
+
+	free(round);
+	free(mmps);
+	free(results);
+}
+
+/**
+ * Sweeps over all combinations of keysizes, database sizes, query lengths and
+ * thread counts in this process. Queries are loaded once per keysize, the
+ * database once per size and length.
+ */
+static void bench(gmp_randstate_t state)
+{
+	size_t a, b, c, d, kmax = list_max(&args.lengths);
+	struct bench_output o;
+	struct database db;
+	struct query q;
+
+	if (bench_open(&o, args.csv, args.json) < 0)
 		exit(EXIT_FAILURE);
+
+	for (a = 0; a < args.keysizes.len; a++) {
+		load_query(&q, args.keysizes.v[a], kmax);
+
+		for (b = 0; b < args.sizes.len; b++)
+		for (c = 0; c < args.lengths.len; c++) {
+			if (args.sizes.v[b] % args.lengths.v[c]) {
+				fprintf(stderr, "Skipping n=%lu k=%lu: not a multiple\n",
+						args.sizes.v[b], args.lengths.v[c]);
+				continue;
+			}
+
+			get_database(NULL, args.sizes.v[b], args.lengths.v[c],
+					state, &db);
+			for (d = 0; d < args.threads.len; d++)
+				bench_point(&q, &db, args.threads.v[d], &o);
+			release_database(&db);
+		}
+
+		free_query(&q);
 	}
 
-	initialize_random(state, args.db_size);
-	get_client_query((size_t)args.keysize, (size_t)args.query_length,
-			state, prime, &minvp, numbers);
-	printf("%d %lu %d\n", mp_bits_per_limb, mpz_size(prime), args.keysize / mp_bits_per_limb);
-	printf("%lu %lu %lu %lu\n", sizeof(int), sizeof(long), sizeof(long long), sizeof(void*));
+	bench_close(&o);
+}
 
-#ifdef IR_CODE
-	sz = args.keysize / LIMB_SIZE;
-	isz = sz * args.query_length;
-	osz = sz * num_outputs;
-
-#ifdef ALIGN
-	_prime = (uint*)_mm_malloc(sz * sizeof(_prime[0]), ALIGNBOUNDARY);
-	_inp = (uint*)_mm_malloc(isz * sizeof(_inp[0]), ALIGNBOUNDARY);
-	_out = (uint*)_mm_malloc(osz * sizeof(_out[0]), ALIGNBOUNDARY);
-	__assume_aligned(&_prime[0], ALIGNBOUNDARY);
-	__assume_aligned(&_inp[0], ALIGNBOUNDARY);
-	__assume_aligned(&_out[0], ALIGNBOUNDARY);
-	memset(_prime, 0, sz * sizeof(_prime[0]));
-	memset(_inp, 0, isz * sizeof(_inp[0]));
-	memset(_out, 0, osz * sizeof(_out[0]));
-#else
-	_prime = calloc(sz, sizeof(_prime[0]));
-	_inp = calloc(isz, sizeof(_inp[0]));
-	_out = calloc(osz, sizeof(_out[0]));
+/**
+ * Returns the median throughput (in mmps) of args.reps runs of e over db,
+ * after args.warmup unmeasured ones.
+ */
+static double tune_measure(const struct engine *e, struct query *q,
+		const struct database *db)
+{
+	struct bench_stats st;
+	double *mmps, time;
+	mpz_t *results;
+	int r;
+
+	mmps = calloc(args.reps, sizeof(mmps[0]));
+	results = calloc(db->rows, sizeof(results[0]));
+	if (!mmps || !results) {
+		fprintf(stderr, "Cannot allocate memory for autotune!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (r = 0; r < args.warmup + args.reps; r++) {
+		time = server(e, q, db, results, 0);
+		clear_results(results, db->rows);
+		if (r >= args.warmup)
+			mmps[r - args.warmup] = 0.001 * db->n / time;
+	}
+	bench_stats(mmps, args.reps, &st);
+
+	free(mmps);
+	free(results);
+	return st.median;
+}
+
+/**
+ * Sets the threads, scheduler, tile and table width of c for the next runs.
+ */
+static void tune_apply(const struct tune_entry *c)
+{
+#ifdef HAVEOMP
+	omp_set_num_threads(c->threads);
 #endif
+	pool_sched_set(c->sched);
+	ir_tune_set(c->tile, c->width);
+}
 
-	convert_from_mpz_1(prime, _prime, sz);
-	convert_from_mpz(numbers, args.query_length, _inp, isz);
+/**
+ * Measures configuration c and makes it the best one if it is faster.
+ */
+static void tune_try(struct tune_entry *best, struct tune_entry *c,
+		struct query *q, const struct database *db)
+{
+	tune_apply(c);
+	c->mmps = tune_measure(engine_select(c->engine), q, db);
 
-	setN(sz);
-	printf("Numbers have %u limbs\n", getN());
-	server(args.db_size, _prime, minvp,
-			args.query_length, _inp,
-			num_outputs, _out);
-#else
-	server(args.db_size, prime, minvp, args.query_length,
-			(const mpz_t *)numbers, num_outputs, results);
+	printf("m=%-5lu %-6s t=%-3d sched %-4s tile %-3lu width %-2u "
+			"%8.3f mmps\n", c->keysize, c->engine, c->threads,
+			pool_sched_name(c->sched), c->tile, c->width, c->mmps);
+	if (c->mmps > best->mmps)
+		*best = *c;
+}
+
+/**
+ * Searches the fastest configuration of each of args.keysizes over the -n/-k
+ * database, one setting at a time: the engine with all threads (only -e if
+ * given), then the number of threads, then for the IR engine its scheduler,
+ * tile size and Four-Russians table width. The winners replace the entries of
+ * the profile of this host.
+ */
+static void autotune(gmp_randstate_t state)
+{
+	static const char *engines[] = { "naive", "mpn", "ir", "simd" };
+	char cpu[TUNE_CPU_LEN];
+	struct tune_profile p;
+	struct tune_entry best, c;
+	struct database db;
+	struct query q;
+	size_t a, i, v;
+	int maxt = 1;
+
+#ifdef HAVEOMP
+	maxt = omp_get_max_threads();
+#endif
+
+	tune_cpu(cpu, sizeof(cpu));
+	if (tune_load(args.profile, &p) == 0 && strcmp(p.cpu, cpu)) {
+		printf("Replacing profile %s of %s\n", args.profile, p.cpu);
+		tune_free(&p);
+	}
+	snprintf(p.cpu, sizeof(p.cpu), "%s", cpu);
+	printf("Tuning for %s\n", cpu);
+
+	get_database(args.db_file, (size_t)args.db_size,
+			(size_t)args.query_length, state, &db);
+
+	for (a = 0; a < args.keysizes.len; a++) {
+		load_query(&q, args.keysizes.v[a], (size_t)args.query_length);
+
+		memset(&best, 0, sizeof(best));
+		best.keysize = args.keysizes.v[a];
+		best.threads = maxt;
+		best.sched = POOL_SCHED_POOL;
+
+		for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+			if (args.engine_given &&
+					strcmp(engines[i], args.engine->name))
+				continue;
+			c = best;
+			snprintf(c.engine, sizeof(c.engine), "%s", engines[i]);
+			tune_try(&best, &c, &q, &db);
+		}
+
+		for (v = 1; v < (size_t)maxt; v *= 2) {
+			c = best;
+			c.threads = v;
+			tune_try(&best, &c, &q, &db);
+		}
+
+		if (!strcmp(best.engine, "ir")) {
+			c = best;
+			c.sched = POOL_SCHED_OMP;
+			tune_try(&best, &c, &q, &db);
+
+			for (v = 1; v <= TUNEMAXTILE && v <= db.rows; v *= 2) {
+				c = best;
+				c.tile = v;
+				tune_try(&best, &c, &q, &db);
+			}
+
+			for (v = 2; v <= TUNEMAXWIDTH && v <= db.k; v += 2) {
+				c = best;
+				c.width = v;
+				tune_try(&best, &c, &q, &db);
+			}
+		}
+
+		printf("m=%-5lu best: %s t=%d sched %s tile %lu width %u "
+				"%.3f mmps\n", best.keysize, best.engine,
+				best.threads, pool_sched_name(best.sched),
+				best.tile, best.width, best.mmps);
+		tune_put(&p, &best);
+		free_query(&q);
+	}
+
+	release_database(&db);
+	if (tune_save(args.profile, &p) < 0)
+		exit(EXIT_FAILURE);
+	printf("Profile written to %s\n", args.profile);
+	tune_free(&p);
+}
+
+/**
+ * Applies the entry for args.keysize of the profile made by --autotune on this
+ * host. Options given on the command line (and OMP_NUM_THREADS) win over it.
+ */
+static void apply_profile(void)
+{
+	const struct tune_entry *e;
+	char cpu[TUNE_CPU_LEN];
+	struct tune_profile p;
+
+	if (tune_load(args.profile, &p) < 0)
+		return;
+
+	tune_cpu(cpu, sizeof(cpu));
+	if (strcmp(p.cpu, cpu)) {
+		printf("Ignoring profile %s of %s\n", args.profile, p.cpu);
+		tune_free(&p);
+		return;
+	}
+
+	e = tune_find(&p, (size_t)args.keysize);
+	if (!e) {
+		tune_free(&p);
+		return;
+	}
+
+	if (!args.engine_given && engine_select(e->engine))
+		args.engine = engine_select(e->engine);
+#ifdef HAVEOMP
+	if (!getenv("OMP_NUM_THREADS"))
+		omp_set_num_threads(e->threads);
 #endif
+	if (!args.sched_given)
+		pool_sched_set(e->sched);
+	ir_tune_set(e->tile, e->width);
+
+	printf("Profile %s: engine %s threads %d sched %s tile %lu width %u\n",
+			args.profile, e->engine, e->threads,
+			pool_sched_name(e->sched), e->tile, e->width);
+	tune_free(&p);
+}
+
+/**
+ * Turns on the latency histograms if asked, before the runs of main.
+ */
+static void start_latency(void)
+{
+	if (args.latency || args.metrics || args.metrics_interval)
+		latency_enable();
+	latency_reset();
+
+	if (args.metrics_interval &&
+			latency_periodic(args.metrics, args.metrics_interval) < 0)
+		exit(EXIT_FAILURE);
+}
+
+/**
+ * Prints the latency histograms and writes them to args.metrics, as asked.
+ */
+static void report_latency(void)
+{
+	FILE *f;
+
+	if (args.latency)
+		latency_report(stdout);
+	if (!args.metrics)
+		return;
+
+	f = fopen(args.metrics, "w");
+	if (!f) {
+		perror(args.metrics);
+		return;
+	}
+	latency_json(f);
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	gmp_randstate_t state;
+	struct database db;
+	struct query q;
+	mpz_t *results;
+	double time;
+	int fd;
 
+	parse_arguments(argc, argv);
+	initialize_random(state, &args.seed);
+
+	if (args.bench) {
+		bench(state);
+		gmp_randclear(state);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.stop || args.stats) {
+		fd = service_connect(args.connect);
+		if (fd < 0 || (args.stop ? service_stop(fd) :
+					service_metrics(fd, stdout)) < 0)
+			exit(EXIT_FAILURE);
+		close(fd);
+		gmp_randclear(state);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.autotune) {
+		autotune(state);
+		gmp_randclear(state);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (!args.connect) {
+		apply_profile();
+		start_latency();
+	}
+
+	if (args.listen) {
+		get_database(args.db_file, (size_t)args.db_size,
+				(size_t)args.query_length, state, &db);
+		printf("Engine: %s\n", args.engine->name);
+		if (service_run(args.listen, args.engine, &db,
+					(size_t)args.table_budget << 20,
+					(size_t)args.batch,
+					(unsigned int)args.window) < 0)
+			exit(EXIT_FAILURE);
+		report_latency();
+		release_database(&db);
+		gmp_randclear(state);
+		exit(EXIT_SUCCESS);
+	}
+
+	results = calloc((size_t)args.batch * (args.db_size / args.query_length),
+			sizeof(results[0]));
+	if (!results) {
+		fprintf(stderr, "Cannot allocate memory for server results!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	load_query(&q, (size_t)args.keysize, (size_t)args.query_length);
+
+	if (args.connect) {
+		db.rows = args.db_size / args.query_length;
+		time = run_remote(&q, db.rows, results);
+		report_times(time, (size_t)args.db_size, db.rows);
 #if DEBUG_RESULTS
-#ifdef IR_CODE
-	debug_IR("Result: ", _out);
-	convert_to_mpz(results, num_outputs, _out, osz);
+		dump_results(db.rows, (const mpz_t *)results);
 #endif
-	dump_results(num_outputs, (const mpz_t *)results);
+		clear_results(results, db.rows);
+		free_query(&q);
+		gmp_randclear(state);
+		free(results);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.stream) {
+		printf("Engine: %s\n", args.engine->name);
+		time = run_stream(&q, state, &db, results);
+		report_times(time, db.n, db.rows);
+		perf_report();
+		affinity_report();
+		arena_report();
+		pool_report();
+		report_latency();
+#if DEBUG_RESULTS
+		dump_results(db.rows, (const mpz_t *)results);
 #endif
+		clear_results(results, db.rows);
+		free_query(&q);
+		gmp_randclear(state);
+		free(results);
+		exit(EXIT_SUCCESS);
+	}
 
-	for (i = 0; i < args.query_length; i++)
-		mpz_clear(numbers[i]);
+	get_database(args.db_file, (size_t)args.db_size,
+			(size_t)args.query_length, state, &db);
+	printf("%d %lu %d\n", mp_bits_per_limb, mpz_size(q.prime), args.keysize / mp_bits_per_limb);
+	printf("%lu %lu %lu %lu\n", sizeof(int), sizeof(long), sizeof(long long), sizeof(void*));
+	printf("Engine: %s", args.engine->name);
+	if (args.engine == &simd_engine)
+		printf(" (%s)", simd_kernel_name());
+	printf("\n");
 
-	for (j = 0; j < num_outputs; j++)
-		mpz_clear(results[j]);
+	if (args.recursive) {
+		time = run_recursive(&db);
+		/* both levels */
+		report_times(time, db.n + db.rows * args.keysize,
+				args.keysize);
+		perf_report();
+		affinity_report();
+		arena_report();
+		pool_report();
+		report_latency();
+		release_database(&db);
+		free_query(&q);
+		gmp_randclear(state);
+		free(results);
+		exit(EXIT_SUCCESS);
+	}
 
-	gmp_randclear(state);
-	mpz_clear(prime);
-	free(numbers);
-	free(results);
+	if (args.batch > 1) {
+		printf("Batch: %d queries\n", args.batch);
+		time = run_batch(&q, &db, results);
+	} else {
+		time = run_server(&q, &db, results);
+	}
+	/* throughput of the whole batch */
+	report_times(time, db.n * args.batch, db.rows * args.batch);
+	perf_report();
+	affinity_report();
+	arena_report();
+	pool_report();
+	report_latency();
 
-#ifdef IR_CODE
-#ifdef ALIGN
-	_mm_free(_prime);
-	_mm_free(_inp);
-	_mm_free(_out);
-#else
-	free(_prime);
-	free(_inp);
-	free(_out);
-#endif
+#if DEBUG_RESULTS
+	dump_results(db.rows * args.batch, (const mpz_t *)results);
 #endif
 
+	clear_results(results, db.rows * args.batch);
+	release_database(&db);
+	free_query(&q);
+	gmp_randclear(state);
+	free(results);
+
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,374 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gmp.h>
+
+#ifdef HAVEOMP
+#include <omp.h>
+#endif
+
+#include "globals.h"
+#include "latency.h"
+#include "pool.h"
+
+/* 2^SUBBITS sub-buckets per power of two, the first 2^(SUBBITS + 1) exact */
+#define SUBBITS	6
+#define SUB	(1 << SUBBITS)
+/* values (in ns) below 2^(MAXSHIFT + SUBBITS + 1), larger ones are clamped */
+#define MAXSHIFT	34
+#define BUCKETS	((MAXSHIFT + 2) * SUB)
+#define MAXVALUE	(((uint64_t)2 * SUB << MAXSHIFT) - 1)
+
+/* on separate cache lines, each written by its thread only */
+struct hist {
+	uint64_t counts[BUCKETS];
+	/* total and largest time of the units (in ns) */
+	uint64_t total, max;
+	struct timespec start;
+} __attribute__((aligned(64)));
+
+/* over one histogram or all */
+struct summary {
+	uint64_t n, total, max;
+	uint64_t p50, p99, p999;
+};
+
+static struct hist *hists;
+static int nhists;
+static int enabled;
+/* held while the histograms are cleared or read, not while recording */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	const char *file;
+	double interval;
+	struct timespec started;
+} periodic;
+
+static int thread_num(void)
+{
+	return pool_thread_num();
+}
+
+static unsigned int bucket(uint64_t v)
+{
+	unsigned int shift = 0;
+
+	if (v > MAXVALUE)
+		v = MAXVALUE;
+	if (v >= 2 * SUB)
+		shift = 63 - __builtin_clzll(v) - SUBBITS;
+	return shift * SUB + (v >> shift);
+}
+
+/**
+ * Returns the middle of the values of bucket b.
+ */
+static uint64_t bucket_value(unsigned int b)
+{
+	unsigned int shift;
+
+	if (b < 2 * SUB)
+		return b;
+	shift = b / SUB - 1;
+	return ((uint64_t)(b - shift * SUB) << shift) +
+		((uint64_t)1 << shift) / 2;
+}
+
+/* the reader may be the periodic thread */
+static uint64_t get(const uint64_t *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static void set(uint64_t *c, uint64_t v)
+{
+	__atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+void latency_enable(void)
+{
+	enabled = 1;
+}
+
+void latency_reset(void)
+{
+	int n = 1;
+
+#ifdef HAVEOMP
+	n = omp_get_max_threads();
+#endif
+	pthread_mutex_lock(&lock);
+	if (n > nhists) {
+		free(hists);
+		hists = aligned_alloc(64, n * sizeof(hists[0]));
+		if (!hists) {
+			fprintf(stderr, "Cannot allocate memory for latencies!\n");
+			exit(EXIT_FAILURE);
+		}
+		nhists = n;
+	}
+	memset(hists, 0, nhists * sizeof(hists[0]));
+	pthread_mutex_unlock(&lock);
+}
+
+void latency_begin(void)
+{
+	int t = thread_num();
+
+	if (!enabled || t >= nhists)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &hists[t].start);
+}
+
+void latency_end(void)
+{
+	int t = thread_num();
+	struct timespec en;
+	struct hist *h;
+	unsigned int b;
+	uint64_t v;
+
+	if (!enabled || t >= nhists)
+		return;
+
+	h = &hists[t];
+	clock_gettime(CLOCK_MONOTONIC, &en);
+	v = (en.tv_sec - h->start.tv_sec) * 1000000000ULL +
+		en.tv_nsec - h->start.tv_nsec;
+
+	b = bucket(v);
+	set(&h->counts[b], h->counts[b] + 1);
+	set(&h->total, h->total + v);
+	if (v > h->max)
+		set(&h->max, v);
+}
+
+/**
+ * Returns the time below which a fraction q of the n units of counts fall.
+ */
+static uint64_t percentile(const uint64_t *counts, uint64_t n, double q)
+{
+	uint64_t rank = q * n, seen = 0;
+	unsigned int b;
+
+	/* rounded up: the p99 of 4 units is the largest */
+	if (rank < q * n || rank < 1)
+		rank++;
+	for (b = 0; b < BUCKETS; b++) {
+		seen += counts[b];
+		if (seen >= rank)
+			return bucket_value(b);
+	}
+	return 0;
+}
+
+static void summarize(const uint64_t *counts, uint64_t n, uint64_t total,
+		uint64_t max, struct summary *s)
+{
+	s->n = n;
+	s->total = total;
+	s->max = max;
+	s->p50 = percentile(counts, n, 0.5);
+	s->p99 = percentile(counts, n, 0.99);
+	s->p999 = percentile(counts, n, 0.999);
+
+	/* the middle of the last bucket may be above the largest unit */
+	if (s->p50 > max)
+		s->p50 = max;
+	if (s->p99 > max)
+		s->p99 = max;
+	if (s->p999 > max)
+		s->p999 = max;
+}
+
+/**
+ * Summarizes each thread into threads (nhists of them) and all threads into
+ * all. Returns the imbalance, 0 if nothing was recorded. Called with the lock.
+ */
+static double snapshot(struct summary *threads, struct summary *all)
+{
+	uint64_t *counts = calloc(BUCKETS, sizeof(counts[0]));
+	uint64_t n = 0, total = 0, max = 0, busiest = 0, c;
+	unsigned int b;
+	int t, active = 0;
+
+	if (!counts) {
+		fprintf(stderr, "Cannot allocate memory for latencies!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (t = 0; t < nhists; t++) {
+		struct hist *h = &hists[t];
+		uint64_t tc[BUCKETS];
+
+		for (b = 0; b < BUCKETS; b++) {
+			tc[b] = get(&h->counts[b]);
+			counts[b] += tc[b];
+		}
+		/* counted from the buckets read, the thread may go on */
+		for (b = 0, c = 0; b < BUCKETS; b++)
+			c += tc[b];
+		summarize(tc, c, get(&h->total), get(&h->max), &threads[t]);
+
+		if (!c)
+			continue;
+		active++;
+		n += c;
+		total += threads[t].total;
+		if (threads[t].max > max)
+			max = threads[t].max;
+		if (threads[t].total > busiest)
+			busiest = threads[t].total;
+	}
+
+	summarize(counts, n, total, max, all);
+	free(counts);
+	return total ? (double)busiest * active / total : 0;
+}
+
+void latency_report(FILE *f)
+{
+	struct summary *threads, all;
+	double imbalance;
+	int t;
+
+	pthread_mutex_lock(&lock);
+	threads = calloc(nhists ? nhists : 1, sizeof(threads[0]));
+	imbalance = snapshot(threads, &all);
+	if (all.n) {
+		fprintf(f, "Latency (us): %lu units, imbalance %.3f\n", all.n,
+				imbalance);
+		fprintf(f, "  all: p50 %9.3f p99 %9.3f p999 %9.3f max %9.3f\n",
+				all.p50 / 1e3, all.p99 / 1e3, all.p999 / 1e3,
+				all.max / 1e3);
+		for (t = 0; t < nhists; t++) {
+			if (!threads[t].n)
+				continue;
+			fprintf(f, "  %3d: p50 %9.3f p99 %9.3f p999 %9.3f "
+					"max %9.3f units %8lu total %9.3f ms\n",
+					t, threads[t].p50 / 1e3,
+					threads[t].p99 / 1e3,
+					threads[t].p999 / 1e3,
+					threads[t].max / 1e3, threads[t].n,
+					threads[t].total / 1e6);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	free(threads);
+}
+
+static void json_summary(FILE *f, const struct summary *s)
+{
+	fprintf(f, "\"units\": %lu, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"p999_us\": %.3f, \"max_us\": %.3f, "
+			"\"total_ms\": %.3f", s->n, s->p50 / 1e3,
+			s->p99 / 1e3, s->p999 / 1e3, s->max / 1e3,
+			s->total / 1e6);
+}
+
+void latency_json(FILE *f)
+{
+	struct summary *threads, all;
+	double imbalance;
+	int t, first = 1;
+
+	pthread_mutex_lock(&lock);
+	threads = calloc(nhists ? nhists : 1, sizeof(threads[0]));
+	imbalance = snapshot(threads, &all);
+
+	fprintf(f, "{\"imbalance\": %.3f, \"all\": {", imbalance);
+	json_summary(f, &all);
+	fprintf(f, "}, \"threads\": [");
+	for (t = 0; t < nhists; t++) {
+		if (!threads[t].n)
+			continue;
+		fprintf(f, "%s\n  {\"thread\": %d, ", first ? "" : ",", t);
+		json_summary(f, &threads[t]);
+		fprintf(f, "}");
+		first = 0;
+	}
+	fprintf(f, "\n]}\n");
+
+	pthread_mutex_unlock(&lock);
+	free(threads);
+}
+
+/**
+ * Writes the JSON dump to a temporary file renamed over periodic.file, so
+ * that readers never see a partial one.
+ */
+static void write_file(void)
+{
+	size_t len = strlen(periodic.file) + 5;
+	char *tmp = malloc(len);
+	FILE *f;
+
+	snprintf(tmp, len, "%s.tmp", periodic.file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		free(tmp);
+		return;
+	}
+	latency_json(f);
+	if (fclose(f) || rename(tmp, periodic.file))
+		perror(periodic.file);
+	free(tmp);
+}
+
+static void *periodic_main(void *arg)
+{
+	struct timespec delay, now;
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	(void) arg;
+	delay.tv_sec = periodic.interval;
+	delay.tv_nsec = (periodic.interval - delay.tv_sec) * 1e9;
+
+	for (;;) {
+		nanosleep(&delay, NULL);
+		if (periodic.file) {
+			write_file();
+			continue;
+		}
+
+		/* in one piece, and nothing while no unit was recorded */
+		buf = NULL;
+		f = open_memstream(&buf, &len);
+		if (!f)
+			continue;
+		latency_report(f);
+		fclose(f);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (len)
+			printf("[%.1f s] %s", time_diff(&periodic.started,
+						&now), buf);
+		fflush(stdout);
+		free(buf);
+	}
+	return NULL;
+}
+
+int latency_periodic(const char *file, double interval)
+{
+	pthread_t thread;
+
+	periodic.file = file;
+	periodic.interval = interval;
+	clock_gettime(CLOCK_MONOTONIC, &periodic.started);
+
+	/* runs until the process exits */
+	if (pthread_create(&thread, NULL, periodic_main, NULL)) {
+		perror("pthread_create");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef LATENCY_H__
+#define LATENCY_H__
+
+#include <stdio.h>
+
+/**
+ * Latency histograms of the server. Each thread records the time of its units
+ * of work, the ones the schedule hands out: an output row (naive, mpn, IR
+ * with tables), a tile of outputs (IR) or a block of lanes (simd). Each
+ * histogram is HDR-style: 64 linear sub-buckets per power of two, so values
+ * are kept within 1/64 of their size, from 1 ns to about half an hour.
+ *
+ * Recording is off until latency_enable. The histograms accumulate over all
+ * runs since latency_reset.
+ */
+
+void latency_enable(void);
+
+/**
+ * Clears the histograms of all threads (omp_get_max_threads of them).
+ */
+void latency_reset(void);
+
+/**
+ * Starts a unit of work in the calling thread.
+ */
+void latency_begin(void);
+
+/**
+ * Ends the unit of work of the calling thread and records its time.
+ */
+void latency_end(void);
+
+/**
+ * Prints count, p50, p99, p999 and max per thread and over all threads, and
+ * the imbalance: the busiest thread's total time over the mean of the threads
+ * that recorded anything. Prints nothing if nothing was recorded.
+ */
+void latency_report(FILE *f);
+
+/**
+ * Writes the same as one JSON object.
+ */
+void latency_json(FILE *f);
+
+/**
+ * Starts a thread writing the histograms every interval seconds while the
+ * runs go on: as JSON to file (replaced atomically), or as text to stdout if
+ * file is NULL. Returns -1 if the thread cannot be started.
+ */
+int latency_periodic(const char *file, double interval);
+
+#endif
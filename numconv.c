@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <gmp.h>
+
+#include "client.h"
+
+static void usage(const char *prg)
+{
+	fprintf(stderr, "Usage: %s [-M] keysize...\n", prg);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Converts numberfiles/numbers_<keysize>_bits to the binary\n");
+	fprintf(stderr, "numberfiles/numbers_<keysize>_bits.bin\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "\t-M\tstore query numbers in Montgomery representation\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, mont = 0, count;
+	size_t keysize;
+	char extra;
+
+	while((opt = getopt(argc, argv, "M")) != -1)
+		switch(opt) {
+		case 'M':
+			mont = 1;
+			break;
+		default: usage(argv[0]);
+		}
+
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (; optind < argc; optind++) {
+		if (sscanf(argv[optind], "%lu%c", &keysize, &extra) != 1)
+			usage(argv[0]);
+
+		count = convert_numberfile(keysize, mont);
+		if (count < 0) {
+			fprintf(stderr, "Cannot convert numberfile for %lu bits\n",
+					keysize);
+			exit(EXIT_FAILURE);
+		}
+		printf("%lu bits: %d numbers\n", keysize, count);
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "numfile.h"
+
+#define MAGIC "PIRNUM\0\0"
+#define MAGICLEN 8
+#define VERSION 1
+/* reads back as another value on machines with other byte order */
+#define ENDIANMARK 0x0102030405060708UL
+/* alignment of the limb arrays */
+#define NUMALIGN 64
+
+struct numfile_header {
+	char magic[MAGICLEN];
+	uint32_t version;
+	uint32_t limb_bits;
+	uint64_t endian;
+	uint64_t keysize;
+	uint64_t count;
+	uint64_t minvp;
+	uint32_t flags;
+	uint32_t pad[3];
+};
+
+/**
+ * Returns the number of limbs in one number. Query numbers are stored back to
+ * back so the kernels can use them without copying; each of them is aligned
+ * as long as keysize is a multiple of 512.
+ */
+static size_t number_stride(size_t keysize)
+{
+	return (keysize + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+}
+
+/**
+ * Returns the size (in limbs) of the slots holding prime and R^2, such that
+ * the following array starts at a NUMALIGN boundary.
+ */
+static size_t slot(size_t stride)
+{
+	size_t align = NUMALIGN / sizeof(mp_limb_t);
+	return (stride + align - 1) / align * align;
+}
+
+int numfile_map(const char *fname, size_t keysize, struct numfile *nf)
+{
+	const struct numfile_header *h;
+	mp_limb_t *limbs;
+	struct stat st;
+	size_t stride;
+	void *map;
+	int fd;
+
+	memset(nf, 0, sizeof(*nf));
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	h = map;
+	stride = number_stride(keysize);
+	if (memcmp(h->magic, MAGIC, MAGICLEN) || h->version != VERSION ||
+			h->limb_bits != GMP_NUMB_BITS ||
+			h->endian != ENDIANMARK || h->keysize != keysize ||
+			(size_t)st.st_size != sizeof(*h) + (2 * slot(stride) +
+			h->count * stride) * sizeof(mp_limb_t)) {
+		fprintf(stderr, "Invalid binary numberfile %s\n", fname);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	limbs = (mp_limb_t *)(h + 1);
+	nf->keysize = keysize;
+	nf->count = h->count;
+	nf->stride = stride;
+	nf->flags = h->flags;
+	nf->minvp = h->minvp;
+	nf->prime = limbs;
+	nf->r2 = limbs + slot(stride);
+	nf->numbers = limbs + 2 * slot(stride);
+	nf->map = map;
+	nf->maplen = st.st_size;
+	return 0;
+}
+
+/**
+ * Writes num as stride limbs. Returns 0 on success, -1 on failure.
+ */
+static int write_number(FILE *f, const mpz_t num, mp_limb_t *buff,
+		size_t stride)
+{
+	size_t nsz = mpz_size(num);
+
+	memset(buff, 0, stride * sizeof(buff[0]));
+	memcpy(buff, mpz_limbs_read(num), nsz * sizeof(buff[0]));
+	return fwrite(buff, sizeof(buff[0]), stride, f) == stride ? 0 : -1;
+}
+
+/**
+ * Writes the header and the numbers of a numberfile to f. Returns 0 on
+ * success, -1 on failure.
+ */
+static int write_numbers(FILE *f, size_t keysize, const mpz_t prime,
+		size_t minvp, const mpz_t r2, size_t count, const mpz_t *numbers,
+		unsigned int flags)
+{
+	size_t stride = number_stride(keysize), i;
+	struct numfile_header h;
+	mp_limb_t *buff;
+	mpz_t aux;
+	int ret = 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, MAGICLEN);
+	h.version = VERSION;
+	h.limb_bits = GMP_NUMB_BITS;
+	h.endian = ENDIANMARK;
+	h.keysize = keysize;
+	h.count = count;
+	h.minvp = minvp;
+	h.flags = flags;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		return -1;
+
+	buff = calloc(slot(stride), sizeof(buff[0]));
+	if (!buff)
+		return -1;
+	if (write_number(f, prime, buff, slot(stride)) < 0 ||
+			write_number(f, r2, buff, slot(stride)) < 0)
+		ret = -1;
+
+	mpz_init(aux);
+	for (i = 0; !ret && i < count; i++) {
+		if (flags & NUMFILE_MONT) {
+			mpz_mul_2exp(aux, numbers[i], keysize);
+			mpz_mod(aux, aux, prime);
+			ret = write_number(f, aux, buff, stride);
+		} else {
+			ret = write_number(f, numbers[i], buff, stride);
+		}
+	}
+	mpz_clear(aux);
+	free(buff);
+	return ret;
+}
+
+int numfile_write(const char *fname, size_t keysize, const mpz_t prime,
+		size_t minvp, const mpz_t r2, size_t count, const mpz_t *numbers,
+		unsigned int flags)
+{
+	size_t len = strlen(fname) + 5;
+	char *tmp = malloc(len);
+	FILE *f;
+	int ret;
+
+	if (!tmp)
+		return -1;
+
+	/*
+	 * another process may have fname mapped: write a new file and rename
+	 * it over the old one, a short write leaves the old one as it was
+	 */
+	snprintf(tmp, len, "%s.tmp", fname);
+	f = fopen(tmp, "w");
+	if (!f) {
+		free(tmp);
+		return -1;
+	}
+
+	ret = write_numbers(f, keysize, prime, minvp, r2, count, numbers,
+			flags);
+	if (ferror(f))
+		ret = -1;
+	if (fclose(f))
+		ret = -1;
+	if (!ret && rename(tmp, fname))
+		ret = -1;
+	if (ret)
+		unlink(tmp);
+
+	free(tmp);
+	return ret;
+}
+
+void numfile_unmap(struct numfile *nf)
+{
+	if (nf->map)
+		munmap(nf->map, nf->maplen);
+	memset(nf, 0, sizeof(*nf));
+}
+
+void numfile_get(mpz_t num, const mp_limb_t *limbs, size_t stride)
+{
+	memcpy(mpz_limbs_write(num, stride), limbs, stride * sizeof(limbs[0]));
+	mpz_limbs_finish(num, stride);
+}
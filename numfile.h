@@ -0,0 +1,64 @@
+#ifndef NUMFILE_H__
+#define NUMFILE_H__
+
+#include <stdint.h>
+
+#include <gmp.h>
+
+/* query numbers are stored as x * 2^keysize `mod` prime */
+#define NUMFILE_MONT 1
+
+/**
+ * Binary numberfile: a 64-byte header followed by the prime, R^2 `mod` prime
+ * and `count` query numbers. Every number is an array of `stride` native
+ * 64-bit limbs (least significant first), and every array starts at a 64-byte
+ * boundary.
+ *
+ * The file is mapped privately and writable, so the query numbers can be
+ * used (and converted in place) directly by the kernels.
+ */
+struct numfile {
+	size_t keysize;
+	/* number of query numbers */
+	size_t count;
+	/* number of limbs in one number */
+	size_t stride;
+	/* NUMFILE_* flags */
+	unsigned int flags;
+	size_t minvp;
+	const mp_limb_t *prime;
+	const mp_limb_t *r2;
+	/* first limb of first query number */
+	mp_limb_t *numbers;
+	void *map;
+	size_t maplen;
+};
+
+/**
+ * Maps fname as a binary numberfile for keysize. Returns 0 on success, -1 if
+ * the file doesn't exist or is invalid (other version, keysize, limb size or
+ * endianness).
+ */
+int numfile_map(const char *fname, size_t keysize, struct numfile *nf);
+
+/**
+ * Writes a binary numberfile. With NUMFILE_MONT in flags the numbers are
+ * stored in Montgomery representation. The file is written as fname.tmp and
+ * renamed, so that processes mapping the old one keep it. Returns 0 on
+ * success, -1 on failure.
+ */
+int numfile_write(const char *fname, size_t keysize, const mpz_t prime,
+		size_t minvp, const mpz_t r2, size_t count, const mpz_t *numbers,
+		unsigned int flags);
+
+/**
+ * Unmaps the numberfile.
+ */
+void numfile_unmap(struct numfile *nf);
+
+/**
+ * Sets num to the value of limbs (stride of them, from a numberfile).
+ */
+void numfile_get(mpz_t num, const mp_limb_t *limbs, size_t stride);
+
+#endif
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gmp.h>
+
+#ifdef HAVEOMP
+#include <omp.h>
+#endif
+
+#include "globals.h"
+#include "perf.h"
+#include "pool.h"
+
+/* assumed size of the transfers counted as LLC misses */
+#define LINESIZE 64
+
+enum {
+	EV_CYCLES,
+	EV_INSTRUCTIONS,
+	EV_L1DMISS,
+	EV_LLCMISS,
+	EV_BRANCHMISS,
+	EVENTS
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+	const char *name;
+} events[EVENTS] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+	{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "L1D misses"},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses"},
+};
+
+static const char *section_names[PERF_SECTIONS] = {
+	"montgomerry", "multiply", "convert_from_mont"
+};
+
+/**
+ * One reading of the event group of a thread, scaled values are computed
+ * from enabled and running times.
+ */
+struct sample {
+	uint64_t enabled, running;
+	uint64_t v[EVENTS];
+};
+
+struct perf_thread {
+	/* group leader (cycles), -1 if counters are unavailable */
+	int leader;
+	int opened;
+	/* position of event e in a group read, -1 if it couldn't be opened */
+	int idx[EVENTS];
+	int nr;
+	struct sample start[PERF_SECTIONS];
+	struct timespec tstart[PERF_SECTIONS];
+	/* accumulated over the run */
+	double count[PERF_SECTIONS][EVENTS];
+	double time[PERF_SECTIONS];
+	size_t muls[PERF_SECTIONS];
+};
+
+static struct perf_thread *threads;
+static int nthreads;
+
+static int thread_num(void)
+{
+	return pool_thread_num();
+}
+
+static int open_event(int e, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[e].type;
+	attr.config = events[e].config;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP |
+		PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/* this thread, any CPU */
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/**
+ * Opens the counters of the calling thread, which keeps them for all runs.
+ */
+static void open_counters(struct perf_thread *t)
+{
+	static int warned;
+	int e, fd;
+
+	t->opened = 1;
+	t->nr = 0;
+	for (e = 0; e < EVENTS; e++)
+		t->idx[e] = -1;
+
+	t->leader = open_event(EV_CYCLES, -1);
+	if (t->leader < 0) {
+#ifdef HAVEOMP
+#pragma omp critical
+#endif
+		if (!warned) {
+			perror("perf_event_open (only times are measured)");
+			warned = 1;
+		}
+		return;
+	}
+	t->idx[EV_CYCLES] = t->nr++;
+
+	for (e = EV_CYCLES + 1; e < EVENTS; e++) {
+		fd = open_event(e, t->leader);
+		if (fd >= 0)
+			t->idx[e] = t->nr++;
+		/* group members are closed with the leader at exit */
+	}
+
+	ioctl(t->leader, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void read_counters(const struct perf_thread *t, struct sample *s)
+{
+	uint64_t buf[3 + EVENTS];
+	int e;
+
+	memset(s, 0, sizeof(*s));
+	if (t->leader < 0 ||
+			read(t->leader, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(buf[0])))
+		return;
+
+	s->enabled = buf[1];
+	s->running = buf[2];
+	for (e = 0; e < EVENTS; e++)
+		if (t->idx[e] >= 0)
+			s->v[e] = buf[3 + t->idx[e]];
+}
+
+void perf_reset(void)
+{
+	int i, n = 1;
+
+#ifdef HAVEOMP
+	n = omp_get_max_threads();
+#endif
+	if (n > nthreads) {
+		threads = realloc(threads, n * sizeof(threads[0]));
+		memset(&threads[nthreads], 0,
+				(n - nthreads) * sizeof(threads[0]));
+		nthreads = n;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		memset(threads[i].count, 0, sizeof(threads[i].count));
+		memset(threads[i].time, 0, sizeof(threads[i].time));
+		memset(threads[i].muls, 0, sizeof(threads[i].muls));
+	}
+}
+
+void perf_begin(enum perf_section s)
+{
+	struct perf_thread *t;
+
+	/* threads beyond those of the last perf_reset are not counted */
+	if (thread_num() >= nthreads)
+		return;
+	t = &threads[thread_num()];
+	if (!t->opened)
+		open_counters(t);
+
+	clock_gettime(CLOCK_MONOTONIC, &t->tstart[s]);
+	read_counters(t, &t->start[s]);
+}
+
+void perf_end(enum perf_section s, size_t muls)
+{
+	struct perf_thread *t;
+	struct timespec en;
+	struct sample cur;
+	double scale = 1;
+	int e;
+
+	if (thread_num() >= nthreads)
+		return;
+	t = &threads[thread_num()];
+	read_counters(t, &cur);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	/* counters may have been multiplexed with other users */
+	if (cur.running > t->start[s].running)
+		scale = (double)(cur.enabled - t->start[s].enabled) /
+			(cur.running - t->start[s].running);
+
+	for (e = 0; e < EVENTS; e++)
+		t->count[s][e] += scale * (cur.v[e] - t->start[s].v[e]);
+	t->time[s] += time_diff(&t->tstart[s], &en);
+	t->muls[s] += muls;
+}
+
+void perf_report(void)
+{
+	double count[PERF_SECTIONS][EVENTS], time[PERF_SECTIONS];
+	double multiply, bandwidth;
+	size_t muls[PERF_SECTIONS];
+	int i, s, e, have;
+
+	memset(count, 0, sizeof(count));
+	memset(muls, 0, sizeof(muls));
+
+	/* sections run in parallel: wall time is the one of the slowest thread */
+	for (s = 0; s < PERF_SECTIONS; s++) {
+		time[s] = 0;
+		for (i = 0; i < nthreads; i++) {
+			for (e = 0; e < EVENTS; e++)
+				count[s][e] += threads[i].count[s][e];
+			muls[s] += threads[i].muls[s];
+			if (threads[i].time[s] > time[s])
+				time[s] = threads[i].time[s];
+		}
+	}
+
+	/* convert_from_mont is measured inside multiply */
+	for (e = 0; e < EVENTS; e++)
+		count[PERF_MULTIPLY][e] -= count[PERF_CONVERT][e];
+	time[PERF_MULTIPLY] -= time[PERF_CONVERT];
+
+	have = 0;
+	for (i = 0; i < nthreads; i++)
+		have |= threads[i].opened && threads[i].leader >= 0;
+
+	printf("Counters:\n");
+	for (s = 0; s < PERF_SECTIONS; s++) {
+		printf("  %s:\n", section_names[s]);
+		if (have) {
+			for (e = 0; e < EVENTS; e++)
+				printf("    %-14s %16.0f\n", events[e].name,
+						count[s][e]);
+			printf("    %-14s %16.3f\n", "IPC",
+					count[s][EV_CYCLES] ?
+					count[s][EV_INSTRUCTIONS] /
+					count[s][EV_CYCLES] : 0);
+			printf("    %-14s %16.1f\n", "cycles/mul",
+					muls[s] ? count[s][EV_CYCLES] /
+					muls[s] : 0);
+			bandwidth = time[s] ? count[s][EV_LLCMISS] *
+				LINESIZE / time[s] / 1e9 : 0;
+			printf("    %-14s %16.3f GB/s\n", "bandwidth",
+					bandwidth);
+		}
+		printf("    %-14s %16lu\n", "muls", muls[s]);
+	}
+
+	printf("Thread times (ms):\n");
+	for (i = 0; i < nthreads; i++) {
+		multiply = threads[i].time[PERF_MULTIPLY] -
+			threads[i].time[PERF_CONVERT];
+		printf("  %3d: montgomerry %9.3f multiply %9.3f "
+				"convert_from_mont %9.3f\n", i,
+				1000 * threads[i].time[PERF_MONT],
+				1000 * multiply,
+				1000 * threads[i].time[PERF_CONVERT]);
+	}
+}
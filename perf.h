@@ -0,0 +1,52 @@
+#ifndef PERF_H__
+#define PERF_H__
+
+#include <stddef.h>
+
+/**
+ * Sections of the server measured separately. PERF_CONVERT runs nested in
+ * PERF_MULTIPLY and is subtracted from it when reporting.
+ */
+enum perf_section {
+	PERF_MONT,
+	PERF_MULTIPLY,
+	PERF_CONVERT,
+	PERF_SECTIONS
+};
+
+#ifdef PERF_COUNTERS
+/**
+ * Hardware counters (cycles, instructions, L1D and LLC misses, branch
+ * misses) read with perf_event_open around each section, per thread. If the
+ * kernel doesn't allow counting, only the per-thread times are collected.
+ */
+
+/**
+ * Clears the counts of all threads. Called before each server run.
+ */
+void perf_reset(void);
+
+/**
+ * Starts section s in the calling thread.
+ */
+void perf_begin(enum perf_section s);
+
+/**
+ * Ends section s in the calling thread, which did muls Montgomery
+ * multiplications (or conversions, for PERF_CONVERT) in it.
+ */
+void perf_end(enum perf_section s, size_t muls);
+
+/**
+ * Prints IPC, cycles per multiplication, miss rates, estimated memory
+ * bandwidth and per-thread times of each section.
+ */
+void perf_report(void);
+#else
+#define perf_reset()
+#define perf_begin(s)
+#define perf_end(s, muls)	((void)(muls))
+#define perf_report()
+#endif
+
+#endif
@@ -0,0 +1,320 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gmp.h>
+
+#ifdef HAVEOMP
+#include <omp.h>
+#endif
+
+#include "affinity.h"
+#include "globals.h"
+#include "pool.h"
+
+struct worker {
+	pthread_t thread;
+	int id;
+	/* remaining tasks [lo, hi) as hi << 32 | lo, changed by CAS */
+	uint64_t range;
+	/* time spent in tasks during the current run */
+	double busy;
+	/* since pool_reset */
+	size_t tasks, steals;
+	double idle;
+};
+
+static struct {
+	struct worker *workers;
+	int n;
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	/* bumped for each run, workers run it once */
+	unsigned long gen;
+	int running, quit;
+	const struct pool_job *job;
+	/* since pool_reset */
+	size_t runs;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static enum pool_sched sched = POOL_SCHED_POOL;
+
+static const char *sched_names[] = { "omp", "pool" };
+
+/* worker number of the calling thread, -1 outside runs */
+static __thread int self = -1;
+
+int pool_sched_parse(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(sched_names) / sizeof(sched_names[0]); i++)
+		if (!strcmp(name, sched_names[i]))
+			return i;
+	return -1;
+}
+
+void pool_sched_set(enum pool_sched s)
+{
+	sched = s;
+}
+
+enum pool_sched pool_sched_get(void)
+{
+	return sched;
+}
+
+const char *pool_sched_name(enum pool_sched s)
+{
+	return sched_names[s];
+}
+
+int pool_workers(void)
+{
+#ifdef HAVEOMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+int pool_thread_num(void)
+{
+	if (self >= 0)
+		return self;
+#ifdef HAVEOMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+static uint64_t pack(size_t lo, size_t hi)
+{
+	return (uint64_t)hi << 32 | lo;
+}
+
+/**
+ * Takes the lowest remaining task of w. Returns 0 if w has none left.
+ */
+static int take(struct worker *w, size_t *task)
+{
+	uint64_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+	size_t lo, hi;
+
+	do {
+		lo = (uint32_t)r;
+		hi = r >> 32;
+		if (lo >= hi)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&w->range, &r, pack(lo + 1, hi),
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	*task = lo;
+	return 1;
+}
+
+/**
+ * Moves the upper half of the remaining tasks of another worker (the
+ * nearest one after w with tasks left) to w, whose range is empty. Returns 0
+ * if no worker has tasks left.
+ */
+static int steal(struct worker *w)
+{
+	struct worker *v;
+	uint64_t r;
+	size_t lo, hi, mid;
+	int i;
+
+	for (i = 1; i < pool.n; i++) {
+		v = &pool.workers[(w->id + i) % pool.n];
+		r = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+		for (;;) {
+			lo = (uint32_t)r;
+			hi = r >> 32;
+			if (lo >= hi)
+				break;
+			mid = hi - (hi - lo + 1) / 2;
+			if (__atomic_compare_exchange_n(&v->range, &r,
+						pack(lo, mid), 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&w->range, pack(mid, hi),
+						__ATOMIC_RELEASE);
+				w->steals++;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Runs the tasks of w, then the ones it can steal.
+ */
+static void work(struct worker *w, const struct pool_job *job)
+{
+	struct timespec st, en;
+	size_t task;
+
+	self = w->id;
+	if (affinity_pinned())
+		affinity_pin(w->id);
+
+	if (job->begin)
+		job->begin(job->arg);
+	do {
+		while (take(w, &task)) {
+			clock_gettime(CLOCK_MONOTONIC, &st);
+			job->task(job->arg, task);
+			clock_gettime(CLOCK_MONOTONIC, &en);
+			w->busy += time_diff(&st, &en);
+			w->tasks++;
+		}
+	} while (steal(w));
+	if (job->end)
+		job->end(job->arg);
+
+	self = -1;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long seen = 0;
+	const struct pool_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.gen == seen && !pool.quit)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		if (pool.quit) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+		seen = pool.gen;
+		job = pool.job;
+		pthread_mutex_unlock(&pool.lock);
+
+		work(w, job);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0)
+			pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.lock);
+	}
+}
+
+static void stop_workers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 1; i < pool.n; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	pool.quit = 0;
+	pool.gen = 0;
+}
+
+/**
+ * Starts n workers (n - 1 threads), stopping the current ones first. The
+ * statistics are kept for the workers that remain.
+ */
+static void start_workers(int n)
+{
+	int i;
+
+	if (pool.n)
+		stop_workers();
+
+	pool.workers = realloc(pool.workers, n * sizeof(pool.workers[0]));
+	if (n > pool.n)
+		memset(&pool.workers[pool.n], 0,
+				(n - pool.n) * sizeof(pool.workers[0]));
+	pool.n = n;
+
+	for (i = 0; i < n; i++) {
+		pool.workers[i].id = i;
+		if (i && pthread_create(&pool.workers[i].thread, NULL,
+					worker_main, &pool.workers[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void pool_run(const struct pool_job *job, size_t tasks)
+{
+	struct timespec st, en;
+	double wall;
+	int i, n = pool_workers();
+
+	if (n != pool.n)
+		start_workers(n);
+
+	/* contiguous shares, like a static schedule */
+	for (i = 0; i < n; i++) {
+		pool.workers[i].range = pack(tasks * i / n,
+				tasks * (i + 1) / n);
+		pool.workers[i].busy = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.running = n - 1;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	work(&pool.workers[0], job);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	wall = time_diff(&st, &en);
+	for (i = 0; i < n; i++)
+		pool.workers[i].idle += wall - pool.workers[i].busy;
+	pool.runs++;
+}
+
+void pool_reset(void)
+{
+	int i;
+
+	for (i = 0; i < pool.n; i++) {
+		pool.workers[i].tasks = 0;
+		pool.workers[i].steals = 0;
+		pool.workers[i].idle = 0;
+	}
+	pool.runs = 0;
+}
+
+void pool_report(void)
+{
+	int i;
+
+	if (!pool.runs)
+		return;
+
+	printf("Pool: %d workers, %lu runs\n", pool.n, pool.runs);
+	for (i = 0; i < pool.n; i++)
+		printf("  %3d: tasks %8lu steals %6lu idle %9.3f ms\n", i,
+				pool.workers[i].tasks, pool.workers[i].steals,
+				1000 * pool.workers[i].idle);
+}
@@ -0,0 +1,83 @@
+#ifndef POOL_H__
+#define POOL_H__
+
+#include <stddef.h>
+
+/**
+ * Persistent work-stealing pool for the passes of the IR engine. Its workers
+ * are started on first use, one per OpenMP thread (omp_get_max_threads), the
+ * calling thread being worker 0, and sleep between runs: a stream of small
+ * queries doesn't pay for a fork and a join per phase.
+ *
+ * A run hands each worker a contiguous share of the tasks. A worker out of
+ * tasks steals the upper half of the remaining ones of another worker.
+ */
+
+/**
+ * Schedulers of the IR engine passes:
+ * 	- omp: one OpenMP region per phase (conversion, multiplication), with
+ * 	  the OMPSCHED schedule and a barrier in between
+ * 	- pool: tiles of outputs are tasks of the pool, and the query is
+ * 	  converted by blocks as the tiles first need them
+ */
+enum pool_sched {
+	POOL_SCHED_OMP,
+	POOL_SCHED_POOL
+};
+
+/**
+ * Returns the scheduler called name, or -1 if unknown.
+ */
+int pool_sched_parse(const char *name);
+
+/**
+ * Sets the scheduler of the next passes.
+ */
+void pool_sched_set(enum pool_sched sched);
+
+enum pool_sched pool_sched_get(void);
+
+const char *pool_sched_name(enum pool_sched sched);
+
+/**
+ * Work of one run. begin and end (optional) are called by each worker before
+ * its first task and after its last one, like the code of an OpenMP region
+ * around its loop.
+ */
+struct pool_job {
+	void (*task)(void *arg, size_t task);
+	void (*begin)(void *arg);
+	void (*end)(void *arg);
+	void *arg;
+};
+
+/**
+ * Runs tasks 0, ..., tasks - 1 of job on the workers and returns when all are
+ * done. Workers are pinned with the affinity policy.
+ */
+void pool_run(const struct pool_job *job, size_t tasks);
+
+/**
+ * Returns the number of workers of the next run.
+ */
+int pool_workers(void);
+
+/**
+ * Returns the worker number of the calling thread during a run, its OpenMP
+ * thread number otherwise.
+ */
+int pool_thread_num(void);
+
+/**
+ * Clears the statistics of all workers. Called before each server run.
+ */
+void pool_reset(void);
+
+/**
+ * Prints the tasks, steals and idle time of each worker since pool_reset.
+ * Idle time is the part of the runs a worker spent waking up, looking for
+ * tasks or waiting for the others. Prints nothing if the pool didn't run.
+ */
+void pool_report(void);
+
+#endif
@@ -1,6 +1,8 @@
 #define _GNU_SOURCE
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <gmp.h>
@@ -9,12 +11,16 @@
 #include <omp.h>
 #endif
 
+#include "affinity.h"
+#include "arena.h"
+#include "database.h"
 #include "globals.h"
-#include "server.h"
-
-#ifdef IR_CODE
 #include "integer-reg.h"
-#endif
+#include "latency.h"
+#include "perf.h"
+#include "pool.h"
+#include "server.h"
+#include "simd.h"
 
 #ifdef ALIGN
 #include <malloc.h>
@@ -28,187 +34,1496 @@
 #define DUMPFILE "dump"
 #endif
 
-#ifdef IR_CODE
+/* IR engine: hand-written Montgomery kernels on limb arrays */
+
 /**
  * Converts each input number in inp to Montgomery representation, once.
+ * Montgomery multiplication with r2 = R^2 `mod` p gives a*R `mod` p.
  */
 #ifdef RESTRICT
-static void montgomerry(uint *restrict inp, size_t inplen, const uint *restrict prime)
+static void montgomerry(const struct ir_kernel *k,
+		limb *restrict inp, size_t inplen, const limb *restrict prime,
+		const limb *restrict r2, size_t minvp)
 #else
-static void montgomerry(uint *inp, size_t inplen, const uint *prime)
+static void montgomerry(const struct ir_kernel *k,
+		limb *inp, size_t inplen, const limb *prime,
+		const limb *r2, size_t minvp)
 #endif
 {
-	const size_t N = getN();
-	const size_t mj = 2 * N;
-	size_t i, j;
+	const size_t N = k->n;
 
 #ifdef HAVEOMP
-#pragma omp parallel for private(j) schedule(OMPSCHED)
+#pragma omp parallel
 #endif
-	for (i = 0; i < inplen; i++) {
-		uint *p = &inp[N * i];
+	{
+		size_t i, muls = 0;
+
+		perf_begin(PERF_MONT);
+#ifdef HAVEOMP
+#pragma omp for schedule(OMPSCHED) nowait
+#endif
+		for (i = 0; i < inplen; i++) {
+			mul_full(k, &inp[N * i], r2, prime, minvp);
+			muls++;
+		}
+		perf_end(PERF_MONT, muls);
+	}
+}
+
+/* set by ir_tune_set, 0 keeps the choices of ir_tiling and table_width */
+static size_t tuned_tile;
+static uint tuned_width;
+
+void ir_tune_set(size_t tile, unsigned int width)
+{
+	tuned_tile = tile;
+	tuned_width = width;
+}
+
+/**
+ * Picks the blocking of multiply: tiles of tile outputs are computed together
+ * against blocks of block query elements, so that the accumulators of a tile
+ * stay in L1 and a block of the query stays in L2 while all outputs of the
+ * tile use it. Tiles are kept small enough to give each thread several,
+ * unless ir_tune_set gave their size. numbytes is the size of one number
+ * times the queries of the pass.
+ */
+#define MINTILES 4
+static void ir_tiling(size_t numbytes, size_t inplen, size_t outlen,
+		size_t *tile, size_t *block)
+{
+	size_t threads = 1;
+
+#ifdef HAVEOMP
+	threads = omp_get_max_threads();
+#endif
+
+	/* half of each cache, the rest is left for the database and prime */
+	*tile = cache_size(1) / 2 / numbytes;
+	*block = cache_size(2) / 2 / numbytes;
+
+	if (*tile > outlen / (threads * MINTILES))
+		*tile = outlen / (threads * MINTILES);
+	if (tuned_tile)
+		*tile = tuned_tile < outlen ? tuned_tile : outlen;
+	if (!*tile)
+		*tile = 1;
+	if (!*block || *block > inplen)
+		*block = inplen ? inplen : 1;
+}
+#undef MINTILES
+
+/**
+ * One query of a multiply pass. inps and primes hold one copy per NUMA node,
+ * m1 is the Montgomery representation of 1.
+ */
+struct ir_operand {
+	limb *const *inps;
+	const limb *const *primes;
+	limb *out, *m1;
+	size_t minvp;
+	/* R^2 `mod` p if the pass converts inps[0] itself (pool only) */
+	const limb *r2;
+};
+
+/* conversion of a block of the query in a pooled pass */
+enum {
+	BLOCK_TODO,
+	BLOCK_BUSY,
+	BLOCK_DONE
+};
+
+struct pass_worker {
+	/* blocks the current tile put off */
+	unsigned char *later;
+	size_t muls, rows;
+	struct timespec st;
+};
+
+/**
+ * A multiply pass run by the pool, with one task per output tile. The first
+ * tile that needs a block of a query with r2 set converts it; tiles that find
+ * a block being converted multiply by the other blocks first and come back
+ * to it, so conversion overlaps with multiplication instead of being a phase
+ * of its own. The product doesn't depend on the order of the blocks.
+ */
+struct pass {
+	const struct ir_kernel *k;
+	const struct database *db;
+	struct ir_operand *ops;
+	size_t count, inplen, outlen, tile, block, blocks;
+	/* BLOCK_TODO, BLOCK_BUSY or BLOCK_DONE for each block */
+	int *state;
+	/* one per worker */
+	struct pass_worker *workers;
+};
+
+static void pass_begin(void *arg)
+{
+	struct pass *ps = arg;
+	struct pass_worker *w = &ps->workers[pool_thread_num()];
+
+	clock_gettime(CLOCK_MONOTONIC, &w->st);
+	perf_begin(PERF_MULTIPLY);
+}
+
+static void pass_end(void *arg)
+{
+	struct pass *ps = arg;
+	struct pass_worker *w = &ps->workers[pool_thread_num()];
+	struct timespec en;
+
+	perf_end(PERF_MULTIPLY, w->muls);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	/* as in multiply */
+	affinity_account((w->muls + w->rows * ps->count) * ps->k->n *
+			sizeof(limb) + w->rows * ps->db->stride *
+			sizeof(uint64_t), time_diff(&w->st, &en));
+}
+
+/**
+ * Converts block jb of the queries with r2 set. Queries converted by the pass
+ * are not replicated (see ir_operand): all nodes use inps[0].
+ */
+static void pass_convert(struct pass *ps, size_t jb)
+{
+	const size_t N = ps->k->n, j0 = jb * ps->block;
+	const size_t j1 = j0 + ps->block < ps->inplen ? j0 + ps->block :
+		ps->inplen;
+	size_t b, j, muls = 0;
+
+	perf_end(PERF_MULTIPLY, 0);
+	perf_begin(PERF_MONT);
+	for (b = 0; b < ps->count; b++) {
+		const struct ir_operand *op = &ps->ops[b];
+
+		if (!op->r2)
+			continue;
+		for (j = j0; j < j1; j++)
+			mul_full(ps->k, &op->inps[0][N * j], op->r2,
+					op->primes[0], op->minvp);
+		muls += j1 - j0;
+	}
+	perf_end(PERF_MONT, muls);
+	perf_begin(PERF_MULTIPLY);
+
+	__atomic_store_n(&ps->state[jb], BLOCK_DONE, __ATOMIC_RELEASE);
+}
+
+/**
+ * Multiplies the outputs [i0, i1) by the elements of block jb their rows
+ * select.
+ */
+static void pass_multiply(struct pass *ps, struct pass_worker *w, size_t jb,
+		size_t i0, size_t i1)
+{
+	const size_t N = ps->k->n, j0 = jb * ps->block;
+	const size_t j1 = j0 + ps->block < ps->inplen ? j0 + ps->block :
+		ps->inplen;
+	const int node = affinity_node();
+	size_t b, i, j;
+
+	for (i = i0; i < i1; i++) {
 #ifdef UNROLL
 #pragma unroll
 #endif
-		for (j = 0; j < mj; j++)
-			convert_to_mont(p, prime);
+		for (j = j0; j < j1; j++) {
+			if (!db_bit(ps->db, i, j))
+				continue;
+			for (b = 0; b < ps->count; b++) {
+				const struct ir_operand *op = &ps->ops[b];
+
+				mul_full(ps->k, &op->out[N * i],
+						&op->inps[node][N * j],
+						op->primes[node], op->minvp);
+			}
+			w->muls += ps->count;
+		}
 	}
 }
 
-#ifdef RESTRICT
-static void multiply(uint *restrict inp, size_t inplen,
-		uint *restrict out, size_t outlen,
-		const uint *restrict prime, size_t minvp)
-#else
-static void multiply(uint *inp, size_t inplen,
-		uint *out, size_t outlen,
-		const uint *prime, size_t minvp)
-#endif
+static void pass_tile(void *arg, size_t t)
+{
+	struct pass *ps = arg;
+	struct pass_worker *w = &ps->workers[pool_thread_num()];
+	const size_t N = ps->k->n, i0 = t * ps->tile;
+	const size_t i1 = i0 + ps->tile < ps->outlen ? i0 + ps->tile :
+		ps->outlen;
+	const int node = affinity_node();
+	size_t b, i, jb, later = 0;
+	int s;
+
+	latency_begin();
+	for (b = 0; b < ps->count; b++)
+		for (i = i0; i < i1; i++)
+			memcpy(&ps->ops[b].out[N * i], ps->ops[b].m1,
+					N * sizeof(limb));
+
+	for (jb = 0; jb < ps->blocks; jb++) {
+		s = __atomic_load_n(&ps->state[jb], __ATOMIC_ACQUIRE);
+		if (s == BLOCK_TODO && __atomic_compare_exchange_n(
+					&ps->state[jb], &s, BLOCK_BUSY, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			pass_convert(ps, jb);
+			s = BLOCK_DONE;
+		}
+
+		w->later[jb] = s != BLOCK_DONE;
+		if (w->later[jb]) {
+			later++;
+			continue;
+		}
+		pass_multiply(ps, w, jb, i0, i1);
+	}
+
+	/* blocks other workers were converting */
+	for (jb = 0; later && jb < ps->blocks; jb++) {
+		if (!w->later[jb])
+			continue;
+		while (__atomic_load_n(&ps->state[jb], __ATOMIC_ACQUIRE) !=
+				BLOCK_DONE)
+			sched_yield();
+		pass_multiply(ps, w, jb, i0, i1);
+		later--;
+	}
+
+	perf_begin(PERF_CONVERT);
+	for (b = 0; b < ps->count; b++)
+		for (i = i0; i < i1; i++)
+			convert_from_mont(ps->k, &ps->ops[b].out[N * i],
+					ps->ops[b].primes[node],
+					ps->ops[b].minvp);
+	perf_end(PERF_CONVERT, (i1 - i0) * ps->count);
+	w->rows += i1 - i0;
+	latency_end();
+}
+
+/**
+ * multiply on the pool (see struct pass).
+ */
+static void multiply_pooled(const struct ir_kernel *k,
+		const struct database *db, struct ir_operand *ops,
+		size_t count, size_t inplen, size_t outlen, size_t tile,
+		size_t block)
 {
-	uint *m1 = one_to_mont(prime);
+	struct pass ps;
+	const struct pool_job job = { pass_tile, pass_begin, pass_end, &ps };
+	size_t b, jb;
+	int i, n = pool_workers(), convert = 0;
+
+	ps.k = k;
+	ps.db = db;
+	ps.ops = ops;
+	ps.count = count;
+	ps.inplen = inplen;
+	ps.outlen = outlen;
+	ps.tile = tile;
+	ps.block = block;
+	ps.blocks = (inplen + block - 1) / block;
+
+	for (b = 0; b < count; b++) {
+		ops[b].m1 = one_to_mont(k, ops[b].primes[0]);
+		convert |= ops[b].r2 != NULL;
+	}
+
+	ps.state = calloc(ps.blocks, sizeof(ps.state[0]));
+	ps.workers = calloc(n, sizeof(ps.workers[0]));
+	if (!ps.state || !ps.workers) {
+		fprintf(stderr, "Cannot allocate memory for IR pass!\n");
+		exit(EXIT_FAILURE);
+	}
+	for (jb = 0; jb < ps.blocks; jb++)
+		ps.state[jb] = convert ? BLOCK_TODO : BLOCK_DONE;
+	for (i = 0; i < n; i++)
+		ps.workers[i].later = calloc(ps.blocks ? ps.blocks : 1, 1);
+
+	pool_run(&job, (outlen + tile - 1) / tile);
+
+	for (i = 0; i < n; i++)
+		free(ps.workers[i].later);
+	free(ps.workers);
+	free(ps.state);
+	for (b = 0; b < count; b++) {
 #ifdef ALIGN
-	__assume_aligned(m1, ALIGNBOUNDARY);
+		_mm_free(ops[b].m1);
+#else
+		free(ops[b].m1);
 #endif
-	const size_t N = getN();
-	size_t i, j;
+	}
+}
+
+/**
+ * Multiplies into each output the inputs selected by its database row, for
+ * count queries at once: every database bit is read once and used for all of
+ * them. Each thread reads the copies of inps and primes of its own node.
+ * Outputs are processed in tiles of tile outputs, each tile going over the
+ * query in blocks of block elements (see ir_tiling).
+ */
+static void multiply(const struct ir_kernel *k, const struct database *db,
+		struct ir_operand *ops, size_t count, size_t inplen,
+		size_t outlen, size_t tile, size_t block)
+{
+	const size_t N = k->n;
+	const size_t tiles = (outlen + tile - 1) / tile;
+	size_t b;
 
-	debug_IR("Computed once: ", m1);
+	if (pool_sched_get() == POOL_SCHED_POOL) {
+		multiply_pooled(k, db, ops, count, inplen, outlen, tile,
+				block);
+		return;
+	}
+
+	for (b = 0; b < count; b++) {
+		ops[b].m1 = one_to_mont(k, ops[b].primes[0]);
+		debug_IR(k, "Computed once: ", ops[b].m1);
+	}
 
 #ifdef HAVEOMP
-#pragma omp parallel for private(j) schedule(OMPSCHED)
+#pragma omp parallel private(b)
 #endif
-	for (i = 0; i < outlen; i++) {
-		uint *p = &out[N * i];
-		/* set accumulator/out to Montgomery representation of 1 */
+	{
+		const int node = affinity_node();
+		size_t t, i, j, i0, i1, j0, j1, muls = 0, rows = 0;
+		struct timespec st, en;
+
+		clock_gettime(CLOCK_MONOTONIC, &st);
+		perf_begin(PERF_MULTIPLY);
+#ifdef HAVEOMP
+#pragma omp for schedule(OMPSCHED) nowait
+#endif
+		for (t = 0; t < tiles; t++) {
+			i0 = t * tile;
+			i1 = i0 + tile < outlen ? i0 + tile : outlen;
+			latency_begin();
+
+			/* set accumulators/out to Montgomery representation of 1 */
+			for (b = 0; b < count; b++)
+			for (i = i0; i < i1; i++) {
+				limb *p = &ops[b].out[N * i];
+				const limb *m1 = ops[b].m1;
 #ifdef ALIGN
-		__assume_aligned(p, ALIGNBOUNDARY);
-		__assume_aligned(m1, ALIGNBOUNDARY);
+				__assume_aligned(p, ALIGNBOUNDARY);
+				__assume_aligned(m1, ALIGNBOUNDARY);
 #pragma vector aligned
 #endif
-		for (j = 0; j < N; j++)
-			p[j] = m1[j];
+				for (j = 0; j < N; j++)
+					p[j] = m1[j];
+			}
 
-		/* multiply into out */
+			/* multiply into out the elements selected by the rows */
+			for (j0 = 0; j0 < inplen; j0 = j1) {
+				j1 = j0 + block < inplen ? j0 + block : inplen;
+				for (i = i0; i < i1; i++) {
 #ifdef UNROLL
 #pragma unroll
 #endif
-		for (j = 0; j < inplen; j++) {
-			uint *q = &inp[N * j];
-			debug_IR("to multiply: ", q);
-			mul_full(p, q, prime, minvp);
-			debug_IR("now: ", p);
+					for (j = j0; j < j1; j++) {
+						if (!db_bit(db, i, j))
+							continue;
+						for (b = 0; b < count; b++) {
+							limb *p = &ops[b].out[N * i];
+							const limb *q =
+								&ops[b].inps[node][N * j];
+							debug_IR(k, "to multiply: ", q);
+							mul_full(k, p, q,
+								ops[b].primes[node],
+								ops[b].minvp);
+							debug_IR(k, "now: ", p);
+						}
+						muls += count;
+					}
+				}
+			}
+
+			/* convert out back from Montgomery */
+			perf_begin(PERF_CONVERT);
+			for (b = 0; b < count; b++)
+			for (i = i0; i < i1; i++) {
+				limb *p = &ops[b].out[N * i];
+				convert_from_mont(k, p, ops[b].primes[node],
+						ops[b].minvp);
+				debug_IR(k, "final result: ", p);
+			}
+			perf_end(PERF_CONVERT, (i1 - i0) * count);
+			rows += i1 - i0;
+			latency_end();
 		}
+		perf_end(PERF_MULTIPLY, muls);
+		clock_gettime(CLOCK_MONOTONIC, &en);
 
-		/* convert out back from Montgomery */
-		convert_from_mont(p, prime, minvp);
-		debug_IR("final result: ", p);
+		/* inputs read, database rows read (once), outputs written */
+		affinity_account((muls + rows * count) * N * sizeof(limb) +
+				rows * db->stride * sizeof(uint64_t),
+				time_diff(&st, &en));
 	}
 
+	for (b = 0; b < count; b++) {
+#ifdef ALIGN
+		_mm_free(ops[b].m1);
+#else
+		free(ops[b].m1);
+#endif
+	}
+}
+
+/**
+ * Picks the width w of the Four-Russians groups. With groups of w query
+ * elements, each output needs one multiplication per group (instead of one
+ * per selected element) while building the tables costs 2^w multiplications
+ * per group. Widths whose tables don't fit in budget are not considered.
+ * Lookups in tables larger than the last level cache are charged an extra
+ * DRAMCOST multiplications each. Returns 0 if no width fits the budget.
+ */
+#define MAXWIDTH 16
+#define DRAMCOST 0.25
+static uint table_width(size_t inplen, size_t outlen, size_t numbytes,
+		size_t budget)
+{
+	double cost, best_cost = 0;
+	size_t groups, bytes, llc = cache_size(3);
+	uint w, best = 0;
+
+	for (w = 1; w <= MAXWIDTH && w <= inplen; w++) {
+		groups = (inplen + w - 1) / w;
+		bytes = (groups << w) * numbytes;
+		if (bytes > budget)
+			break;
+
+		cost = (double)outlen * groups + (double)groups * (1UL << w);
+		if (bytes > llc)
+			cost += DRAMCOST * outlen * groups;
+
+		if (!best || cost < best_cost) {
+			best = w;
+			best_cost = cost;
+		}
+	}
+
+	return best;
+}
+#undef DRAMCOST
+#undef MAXWIDTH
+
+/**
+ * Four-Russians variant of multiply: inp is split in groups of w elements
+ * and for each group all 2^w subset products are computed once, in Montgomery
+ * representation. Then each output needs one multiplication per group, using
+ * the w bits of its row as index in the group table.
+ */
+static void multiply_tables(const struct ir_kernel *k,
+		const struct database *db,
+		limb *inp, size_t inplen,
+		limb *out, size_t outlen,
+		const limb *prime, size_t minvp, uint w)
+{
+	limb *m1 = one_to_mont(k, prime);
+	const size_t N = k->n, entries = 1UL << w;
+	const size_t groups = (inplen + w - 1) / w;
+	size_t i, j, g, idx, hb;
+	limb *tables;
+
+	tables = calloc(groups * entries * N, sizeof(tables[0]));
+	if (!tables) {
+		fprintf(stderr, "Cannot allocate memory for tables!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/**
+	 * tables[g][idx] = product of elements of group g selected by idx,
+	 * obtained from the entry without the highest bit of idx
+	 */
+#ifdef HAVEOMP
+#pragma omp parallel private(idx, hb, j)
+#endif
+	{
+		size_t muls = 0;
+
+		perf_begin(PERF_MULTIPLY);
+#ifdef HAVEOMP
+#pragma omp for schedule(OMPSCHED) nowait
+#endif
+		for (g = 0; g < groups; g++) {
+			limb *t = &tables[g * entries * N];
+			size_t gw = inplen - g * w < w ? inplen - g * w : w;
+
+			for (j = 0; j < N; j++)
+				t[j] = m1[j];
+
+			for (hb = 0; hb < gw; hb++)
+				for (idx = 1UL << hb; idx < 2UL << hb; idx++) {
+					limb *e = &t[idx * N];
+					const limb *q = &inp[(g * w + hb) * N];
+
+					if (idx == 1UL << hb) {
+						for (j = 0; j < N; j++)
+							e[j] = q[j];
+						continue;
+					}
+
+					for (j = 0; j < N; j++)
+						e[j] = t[(idx ^ (1UL << hb)) * N + j];
+					mul_full(k, e, q, prime, minvp);
+					muls++;
+				}
+		}
+		perf_end(PERF_MULTIPLY, muls);
+	}
+
+#ifdef HAVEOMP
+#pragma omp parallel private(g, idx, j)
+#endif
+	{
+		size_t muls = 0;
+
+		perf_begin(PERF_MULTIPLY);
+#ifdef HAVEOMP
+#pragma omp for schedule(OMPSCHED) nowait
+#endif
+		for (i = 0; i < outlen; i++) {
+			limb *p = &out[N * i];
+			int first = 1;
+
+			latency_begin();
+			for (g = 0; g < groups; g++) {
+				size_t gw = inplen - g * w < w ? inplen - g * w : w;
+				const limb *e;
+
+				idx = db_bits(db, i, g * w, gw);
+				if (!idx)
+					continue;
+
+				e = &tables[(g * entries + idx) * N];
+				if (first) {
+					/* skip multiplying with 1 */
+					for (j = 0; j < N; j++)
+						p[j] = e[j];
+					first = 0;
+				} else {
+					mul_full(k, p, e, prime, minvp);
+					muls++;
+				}
+			}
+
+			if (first)
+				for (j = 0; j < N; j++)
+					p[j] = m1[j];
+
+			/* convert out back from Montgomery */
+			perf_begin(PERF_CONVERT);
+			convert_from_mont(k, p, prime, minvp);
+			perf_end(PERF_CONVERT, 1);
+			latency_end();
+		}
+		perf_end(PERF_MULTIPLY, muls);
+	}
+
+	free(tables);
 #ifdef ALIGN
 	_mm_free(m1);
 #else
 	free(m1);
 #endif
 }
+
+/* 64-bit limbs of a binary numberfile are also little-endian 32-bit limbs */
+#if LIMB_SIZE == 64 || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define INPLACE_NUMBERS 1
 #else
-#ifdef LLIMPL
-static void low_level_work_kernel(const mp_limb_t *prime, mp_size_t numlen,
-		size_t minvp, size_t inplen, const mp_limb_t * const * inp,
-		size_t outlen, mp_limb_t **out)
+#define INPLACE_NUMBERS 0
+#endif
+
+struct ir_state {
+	struct ir_kernel kernel;
+	const struct database *db;
+	limb *prime, *r2, *inp, *out;
+	size_t minvp, inplen, outlen, isz, osz;
+	/* inp points into the mapped numberfile */
+	int inplace;
+	/* inp is already in Montgomery representation */
+	int mont;
+	/* width of Four-Russians tables, 0 for none */
+	uint w;
+	/* outputs per tile and query elements per block of multiply */
+	size_t tile, block;
+	/* copies of inp and prime for each NUMA node */
+	int nodes, replicate;
+	limb **inps, **primes;
+};
+
+/**
+ * Copies inp and prime to the replicas of each node, from a thread running
+ * on that node so that the pages are placed there.
+ */
+static void ir_replicate(struct ir_state *st)
 {
-	size_t i, j, sz = 2 * numlen;
-	mp_limb_t* scratch = calloc(sz, sizeof(scratch[0]));
-	mp_limb_t* quot = calloc(sz, sizeof(scratch[0]));
+	const size_t N = st->kernel.n;
 
-	(void) minvp;
-	for (i = 0; i < outlen; i++) {
-		for (j = 0; j < inplen; j++) {
-			mpn_mul_n(scratch, out[i], inp[j], numlen);
-			mpn_tdiv_qr(quot, out[i], 0, scratch, sz, prime, numlen);
+	if (!st->replicate)
+		return;
+
+#ifdef HAVEOMP
+#pragma omp parallel
+#endif
+	{
+		int node = affinity_node();
+
+		if (affinity_node_leader()) {
+			memcpy(st->inps[node], st->inp,
+					st->isz * sizeof(limb));
+			memcpy(st->primes[node], st->prime,
+					N * sizeof(limb));
 		}
 	}
-
-	free(scratch);
-	free(quot);
 }
 
-static void low_level_impl(const mpz_t prime, size_t minvp,
-		size_t inplen, const mpz_t * const inp,
-		size_t outlen, mpz_t *out)
+/* multiplications chained by the check of lazy and pseudo-Mersenne kernels */
+#define FORMCHECK 64
+
+/**
+ * Loads prime, r2, minvp and (unless used in place) the query numbers of q,
+ * and selects the kernels for the form of the prime, checking them against
+ * GMP unless they are the full ones. Pseudo-Mersenne kernels don't use
+ * Montgomery representation: r2 becomes 1. Returns -1 if the kernels
+ * disagree with GMP.
+ */
+static int ir_load(struct ir_state *st, struct query *q)
 {
-	size_t i, sz = mpz_size(prime);
+	uint sz = q->keysize / LIMB_SIZE;
 
-	const mp_limb_t** inputs = calloc(inplen, sizeof(inputs[0]));
-	for (i = 0; i< inplen; i++)
-		inputs[i] = mpz_limbs_read(inp[i]);
+	st->minvp = q->minvp;
+	convert_from_mpz_1(q->prime, st->prime, sz);
+	convert_from_mpz_1(q->r2, st->r2, sz);
 
-	mp_limb_t** outputs = calloc(outlen, sizeof(outputs[0]));
-	for (i = 0; i < outlen; i++)
-		outputs[i] = mpz_limbs_write(out[i], sz);
+	ir_kernel_select(q->keysize, ir_prime_form(sz, st->prime),
+			&st->kernel);
+	if (st->kernel.form != IR_FORM_FULL && ir_kernel_check(&st->kernel,
+				q->prime, st->minvp, FORMCHECK) < 0) {
+		fprintf(stderr, "IR kernels for the prime disagree with GMP!\n");
+		return -1;
+	}
+	if (st->kernel.form == IR_FORM_MERSENNE) {
+		memset(st->r2, 0, sz * sizeof(limb));
+		st->r2[0] = 1;
+	}
 
-	low_level_work_kernel(mpz_limbs_read(prime), sz,
-			minvp, inplen, inputs,
-			outlen, outputs);
+	if (!st->inplace) {
+		convert_from_mpz(q->numbers, st->inplen, st->inp, st->isz);
+		st->mont = 0;
+	}
+	return 0;
+}
 
-	for (i = 0; i < outlen; i++)
-		mpz_limbs_finish(out[i], sz);
+int query_prime_form(const struct query *q)
+{
+	uint sz = q->keysize / LIMB_SIZE;
+	limb p[sz];
+
+	convert_from_mpz_1((mpz_ptr)q->prime, p, sz);
+	return ir_prime_form(sz, p);
+}
 
-	free(outputs);
-	free(inputs);
+static limb *ir_alloc(size_t count)
+{
+#ifdef ALIGN
+	limb *p = (limb*)_mm_malloc(count * sizeof(limb), ALIGNBOUNDARY);
+	memset(p, 0, count * sizeof(limb));
+	return p;
+#else
+	return calloc(count, sizeof(limb));
+#endif
 }
+
+static void ir_free(limb *p)
+{
+#ifdef ALIGN
+	_mm_free(p);
 #else
-static void naive_impl(const mpz_t prime, size_t minvp,
-		size_t inplen, const mpz_t * const inp,
-		size_t outlen, mpz_t *out)
+	free(p);
+#endif
+}
+
+static void ir_finish(void *state, mpz_t *out);
+
+/**
+ * Prepares the state of one query, with outputs first-touched for the tiling
+ * of a pass over count queries. Returns NULL if the query cannot be loaded.
+ */
+static struct ir_state *ir_setup(struct query *q, const struct database *db,
+		size_t table_budget, size_t count)
+{
+	struct ir_state *st = calloc(1, sizeof(*st));
+	uint sz = q->keysize / LIMB_SIZE;
+	size_t t, i;
+	int n;
+
+	if (!st) {
+		fprintf(stderr, "Cannot allocate memory for IR engine!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	st->db = db;
+	st->inplen = db->k;
+	st->outlen = db->rows;
+	st->isz = sz * db->k;
+	st->osz = sz * db->rows;
+
+	/*
+	 * use the mapped query numbers directly if they have our layout and
+	 * were not converted to Montgomery representation by a previous run
+	 */
+	st->inplace = INPLACE_NUMBERS && q->nf.map &&
+		q->nf.stride * GMP_NUMB_BITS == sz * LIMB_SIZE &&
+		!q->converted;
+	st->mont = st->inplace && (q->nf.flags & NUMFILE_MONT);
+	if (st->inplace && !st->mont)
+		q->converted = 1;
+
+	st->prime = ir_alloc(sz);
+	st->r2 = ir_alloc(sz);
+	st->inp = st->inplace ? (limb*)q->nf.numbers : ir_alloc(st->isz);
+	st->out = node_alloc(st->osz * sizeof(limb));
+#ifdef ALIGN
+	__assume_aligned(&st->prime[0], ALIGNBOUNDARY);
+	__assume_aligned(&st->r2[0], ALIGNBOUNDARY);
+	__assume_aligned(&st->inp[0], ALIGNBOUNDARY);
+	__assume_aligned(&st->out[0], ALIGNBOUNDARY);
+#endif
+
+	ir_tiling(count * sz * sizeof(limb), st->inplen, st->outlen,
+			&st->tile, &st->block);
+
+	/* first touch of each output tile by the thread computing it */
+#ifdef HAVEOMP
+#pragma omp parallel for schedule(OMPSCHED)
+#endif
+	for (t = 0; t < (st->outlen + st->tile - 1) / st->tile; t++)
+		for (i = t * st->tile; i < (t + 1) * st->tile &&
+				i < st->outlen; i++)
+			memset(&st->out[sz * i], 0, sz * sizeof(limb));
+
+	st->nodes = affinity_nodes();
+	st->replicate = st->nodes > 1 && affinity_pinned();
+	st->inps = calloc(st->nodes, sizeof(st->inps[0]));
+	st->primes = calloc(st->nodes, sizeof(st->primes[0]));
+	for (n = 0; n < st->nodes; n++) {
+		st->inps[n] = st->replicate ?
+			node_alloc(st->isz * sizeof(limb)) : st->inp;
+		st->primes[n] = st->replicate ?
+			node_alloc(sz * sizeof(limb)) : st->prime;
+	}
+
+	if (ir_load(st, q) < 0) {
+		ir_finish(st, NULL);
+		return NULL;
+	}
+
+	if (table_budget) {
+		st->w = table_width(st->inplen, st->outlen,
+				st->kernel.n * sizeof(limb), table_budget);
+		printf("Table width: %u\n", st->w);
+	}
+
+	return st;
+}
+
+static void *ir_prepare(struct query *q, const struct database *db,
+		size_t table_budget)
+{
+	struct ir_state *st = ir_setup(q, db, table_budget, 1);
+
+	if (st && !table_budget && tuned_width)
+		st->w = tuned_width < st->inplen ? tuned_width : st->inplen;
+	return st;
+}
+
+static int ir_reload(void *state, struct query *q)
+{
+	struct ir_state *st = state;
+	int n;
+
+	/* numbers of another query: stop using the mapped ones */
+	if (st->inplace) {
+		st->inp = ir_alloc(st->isz);
+		for (n = 0; !st->replicate && n < st->nodes; n++)
+			st->inps[n] = st->inp;
+		st->inplace = 0;
+		st->mont = 0;
+	}
+
+	return ir_load(st, q);
+}
+
+/**
+ * Converts the query of st to Montgomery representation (unless it already
+ * is) and copies it to the other nodes. Fills op for a multiply pass. With
+ * overlap set and the pool scheduler, a query that is not replicated is left
+ * for the multiply pass to convert.
+ */
+static void ir_operand(struct ir_state *st, struct ir_operand *op,
+		int overlap)
+{
+	op->r2 = NULL;
+	if (!st->mont && overlap && !st->replicate &&
+			pool_sched_get() == POOL_SCHED_POOL)
+		op->r2 = st->r2;
+	else if (!st->mont)
+		montgomerry(&st->kernel, st->inp, st->inplen, st->prime,
+				st->r2, st->minvp);
+	st->mont = 1;
+	ir_replicate(st);
+
+	op->inps = st->inps;
+	op->primes = (const limb *const *)st->primes;
+	op->out = st->out;
+	op->minvp = st->minvp;
+}
+
+static void ir_compute(void *state)
+{
+	struct ir_state *st = state;
+	struct ir_operand op;
+
+	ir_operand(st, &op, !st->w);
+	if (st->w)
+		multiply_tables(&st->kernel, st->db, st->inp, st->inplen,
+				st->out, st->outlen, st->prime, st->minvp,
+				st->w);
+	else
+		multiply(&st->kernel, st->db, &op, 1, st->inplen,
+				st->outlen, st->tile, st->block);
+}
+
+static void ir_stream(void *state, const struct database *chunk, size_t first)
+{
+	struct ir_state *st = state;
+	struct ir_operand op;
+
+	/* the query is converted with the first chunk only */
+	ir_operand(st, &op, 1);
+	op.out += st->kernel.n * first;
+	multiply(&st->kernel, chunk, &op, 1, st->inplen, chunk->rows,
+			st->tile, st->block);
+}
+
+static void ir_results(void *state, mpz_t *out)
+{
+	struct ir_state *st = state;
+
+	debug_IR(&st->kernel, "Result: ", st->out);
+	convert_to_mpz(out, st->outlen, st->out, st->osz);
+}
+
+static void ir_finish(void *state, mpz_t *out)
+{
+	struct ir_state *st = state;
+	size_t i;
+	int n;
+
+	if (out) {
+		for (i = 0; i < st->outlen; i++)
+			mpz_init(out[i]);
+		ir_results(st, out);
+	}
+
+	for (n = 0; st->replicate && n < st->nodes; n++) {
+		node_free(st->inps[n], st->isz * sizeof(limb));
+		node_free(st->primes[n], st->kernel.n * sizeof(limb));
+	}
+	free(st->inps);
+	free(st->primes);
+	node_free(st->out, st->osz * sizeof(limb));
+
+	ir_free(st->prime);
+	ir_free(st->r2);
+	if (!st->inplace)
+		ir_free(st->inp);
+	free(st);
+}
+
+/* queries of the same keysize sharing one pass over the database */
+struct ir_batch {
+	size_t count;
+	struct ir_state **st;
+	struct ir_operand *ops;
+};
+
+static void ir_batch_finish(void *state, mpz_t *const *outs);
+
+static void *ir_batch_prepare(struct query *const *qs, size_t count,
+		const struct database *db)
+{
+	struct ir_batch *bt = calloc(1, sizeof(*bt));
+	size_t b;
+
+	if (!bt) {
+		fprintf(stderr, "Cannot allocate memory for IR engine!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	bt->count = count;
+	bt->st = calloc(count, sizeof(bt->st[0]));
+	bt->ops = calloc(count, sizeof(bt->ops[0]));
+	for (b = 0; b < count; b++) {
+		if (qs[b]->keysize != qs[0]->keysize) {
+			fprintf(stderr, "Batched queries need the same keysize!\n");
+			exit(EXIT_FAILURE);
+		}
+		bt->st[b] = ir_setup(qs[b], db, 0, count);
+		if (!bt->st[b]) {
+			bt->count = b;
+			ir_batch_finish(bt, NULL);
+			return NULL;
+		}
+		/* one pass runs the kernels of the first query */
+		if (bt->st[b]->kernel.form != bt->st[0]->kernel.form) {
+			fprintf(stderr, "Batched queries need primes of the same form!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return bt;
+}
+
+static void ir_batch_compute(void *state)
+{
+	struct ir_batch *bt = state;
+	struct ir_state *st = bt->st[0];
+	size_t b;
+
+	for (b = 0; b < bt->count; b++)
+		ir_operand(bt->st[b], &bt->ops[b], 1);
+	multiply(&st->kernel, st->db, bt->ops, bt->count, st->inplen,
+			st->outlen, st->tile, st->block);
+}
+
+static void ir_batch_finish(void *state, mpz_t *const *outs)
+{
+	struct ir_batch *bt = state;
+	size_t b;
+
+	for (b = 0; b < bt->count; b++)
+		ir_finish(bt->st[b], outs ? outs[b] : NULL);
+	free(bt->st);
+	free(bt->ops);
+	free(bt);
+}
+
+static const struct engine ir_engine = {
+	"ir", ir_prepare, ir_reload, ir_compute, ir_results, ir_finish,
+	ir_batch_prepare, ir_batch_compute, ir_batch_finish, ir_stream
+};
+
+/* mpn engine: Montgomery multiplication with low-level GNU MP routines */
+
+/**
+ * Montgomery reduction: rp = {tp, 2n} / B^n `mod` p, where B = 2^GMP_NUMB_BITS.
+ * Needs {tp, 2n} < p * B^n. Destroys tp. Result is fully reduced.
+ */
+static void redc(mp_limb_t *rp, mp_limb_t *tp, const mp_limb_t *prime,
+		mp_size_t numlen, mp_limb_t minvp)
+{
+	mp_size_t i;
+	mp_limb_t cy;
+
+	/**
+	 * Each step clears tp[i]. The carry out belongs at tp[i + numlen], but
+	 * it is only needed at the end, so keep it in tp[i] meanwhile.
+	 */
+	for (i = 0; i < numlen; i++)
+		tp[i] = mpn_addmul_1(tp + i, prime, numlen, tp[i] * minvp);
+
+	cy = mpn_add_n(rp, tp + numlen, tp, numlen);
+	if (cy || mpn_cmp(rp, prime, numlen) >= 0)
+		mpn_sub_n(rp, rp, prime, numlen);
+}
+
+/**
+ * Converts the inp numbers to Montgomery representation (in place) and then
+ * computes each out number as the product of the inputs selected by its
+ * database row. Each thread has its own scratch space.
+ *
+ * 	one:	Montgomery representation of 1 (B^n `mod` p)
+ * 	r2:	B^2n `mod` p, used to convert to Montgomery representation
+ */
+static void low_level_work_kernel(const struct database *db,
+		const mp_limb_t *prime, mp_size_t numlen,
+		mp_limb_t minvp, const mp_limb_t *one, const mp_limb_t *r2,
+		size_t inplen, mp_limb_t *inp,
+		size_t outlen, mp_limb_t *out)
 {
 	size_t i, j;
 
-	(void) minvp;
 #ifdef HAVEOMP
-#pragma omp parallel for
+#pragma omp parallel private(i, j)
+#endif
+	{
+		mp_limb_t* scratch = calloc(2 * numlen, sizeof(scratch[0]));
+
+#ifdef HAVEOMP
+#pragma omp for schedule(OMPSCHED)
 #endif
-	for (i = 0; i < outlen; i++) {
-		mpz_init_set_ui(out[i], 1);
 		for (j = 0; j < inplen; j++) {
-			mpz_mul(out[i], out[i], inp[j]);
-			mpz_mod(out[i], out[i], prime);
+			mp_limb_t *q = &inp[numlen * j];
+			mpn_mul_n(scratch, q, r2, numlen);
+			redc(q, scratch, prime, numlen, minvp);
+		}
+
+#ifdef HAVEOMP
+#pragma omp for schedule(OMPSCHED)
+#endif
+		for (i = 0; i < outlen; i++) {
+			mp_limb_t *p = &out[numlen * i];
+
+			latency_begin();
+			mpn_copyi(p, one, numlen);
+
+			for (j = 0; j < inplen; j++) {
+				if (!db_bit(db, i, j))
+					continue;
+				mpn_mul_n(scratch, p, &inp[numlen * j], numlen);
+				redc(p, scratch, prime, numlen, minvp);
+			}
+
+			/* convert out back from Montgomery */
+			mpn_copyi(scratch, p, numlen);
+			mpn_zero(scratch + numlen, numlen);
+			redc(p, scratch, prime, numlen, minvp);
+			latency_end();
 		}
+
+		free(scratch);
 	}
 }
 
+struct mpn_state {
+	const struct database *db;
+	const mp_limb_t *prime;
+	mp_size_t sz;
+	mp_limb_t minvp;
+	/* one: B^n `mod` p, r2: B^2n `mod` p */
+	mp_limb_t *inputs, *outputs, *one, *r2;
+	size_t inplen, outlen;
+};
+
+/**
+ * Loads prime, minvp, r2, one and the query numbers of q.
+ */
+static void mpn_load(struct mpn_state *st, struct query *q)
+{
+	mp_size_t sz = st->sz, nsz;
+	mp_limb_t *scratch;
+	size_t i;
+	mpz_t aux;
+
+	st->prime = mpz_limbs_read(q->prime);
+	st->minvp = q->minvp;
+	scratch = calloc(2 * sz, sizeof(scratch[0]));
+
+	/* q->r2 is for R = 2^keysize, recompute it if that is not B^n */
+	mpz_init_set(aux, q->r2);
+	if (mpz_sizeinbase(q->prime, 2) != (size_t)sz * GMP_NUMB_BITS) {
+		mpz_ui_pow_ui(aux, 2, 2 * sz * GMP_NUMB_BITS);
+		mpz_mod(aux, aux, q->prime);
+	}
+	mpn_zero(st->r2, sz);
+	mpn_copyi(st->r2, mpz_limbs_read(aux), mpz_size(aux));
+	mpz_clear(aux);
+
+	/* one = B^n mod p, the Montgomery reduction of r2 */
+	mpn_copyi(scratch, st->r2, sz);
+	redc(st->one, scratch, st->prime, sz, st->minvp);
+	free(scratch);
+
+	for (i = 0; i < st->inplen; i++) {
+		nsz = mpz_size(q->numbers[i]);
+		mpn_zero(&st->inputs[sz * i], sz);
+		mpn_copyi(&st->inputs[sz * i], mpz_limbs_read(q->numbers[i]),
+				nsz);
+	}
+}
+
+static void *mpn_prepare(struct query *q, const struct database *db,
+		size_t table_budget)
+{
+	struct mpn_state *st = calloc(1, sizeof(*st));
+	mp_size_t sz;
+
+	(void) table_budget;
+	if (!st) {
+		fprintf(stderr, "Cannot allocate memory for mpn engine!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	st->db = db;
+	st->sz = sz = mpz_size(q->prime);
+	st->inplen = db->k;
+	st->outlen = db->rows;
+	st->inputs = calloc(st->inplen * sz, sizeof(st->inputs[0]));
+	st->outputs = calloc(st->outlen * sz, sizeof(st->outputs[0]));
+	st->one = calloc(sz, sizeof(st->one[0]));
+	st->r2 = calloc(sz, sizeof(st->r2[0]));
+
+	mpn_load(st, q);
+	return st;
+}
+
+static int mpn_reload(void *state, struct query *q)
+{
+	struct mpn_state *st = state;
+
+	/* a shorter prime would leave stale high limbs */
+	if ((mp_size_t)mpz_size(q->prime) != st->sz) {
+		fprintf(stderr, "mpn engine: prime of another size!\n");
+		return -1;
+	}
+	mpn_load(st, q);
+	return 0;
+}
+
+static void mpn_compute(void *state)
+{
+	struct mpn_state *st = state;
+
+	low_level_work_kernel(st->db, st->prime, st->sz, st->minvp, st->one,
+			st->r2, st->inplen, st->inputs, st->outlen,
+			st->outputs);
+}
+
+static void mpn_results(void *state, mpz_t *out)
+{
+	struct mpn_state *st = state;
+	mp_size_t sz = st->sz;
+	size_t i;
+
+	for (i = 0; i < st->outlen; i++) {
+		mpn_copyi(mpz_limbs_write(out[i], sz), &st->outputs[sz * i],
+				sz);
+		mpz_limbs_finish(out[i], sz);
+	}
+}
+
+static void mpn_finish(void *state, mpz_t *out)
+{
+	struct mpn_state *st = state;
+	size_t i;
+
+	if (out) {
+		for (i = 0; i < st->outlen; i++)
+			mpz_init2(out[i], st->sz * GMP_NUMB_BITS);
+		mpn_results(st, out);
+	}
+
+	free(st->inputs);
+	free(st->outputs);
+	free(st->one);
+	free(st->r2);
+	free(st);
+}
+
+static const struct engine mpn_engine = {
+	"mpn", mpn_prepare, mpn_reload, mpn_compute, mpn_results, mpn_finish,
+	NULL, NULL, NULL, NULL
+};
+
+/*
+ * naive engine: mpz_mul and mpz_mod. Outputs and the product temporary hold
+ * 2 * keysize bits from the start, and the temporaries of GMP come from
+ * per-thread arenas, so that threads don't contend in malloc.
+ */
+
+struct naive_state {
+	const struct database *db;
+	mpz_srcptr prime;
+	const mpz_t *inp;
+	mpz_t *out;
+	size_t inplen, outlen;
+	/* bits of a product */
+	size_t bits;
+};
+
+/**
+ * Points the state to the prime and numbers of q and resets the outputs to 1.
+ */
+static void naive_load(struct naive_state *st, struct query *q)
+{
+	size_t i;
+
+	st->prime = q->prime;
+	st->inp = (const mpz_t *)q->numbers;
+	for (i = 0; i < st->outlen; i++)
+		mpz_set_ui(st->out[i], 1);
+}
+
+static void *naive_prepare(struct query *q, const struct database *db,
+		size_t table_budget)
+{
+	struct naive_state *st = calloc(1, sizeof(*st));
+	size_t i;
+
+	(void) table_budget;
+	if (!st) {
+		fprintf(stderr, "Cannot allocate memory for naive engine!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	arena_install();
+
+	st->db = db;
+	st->inplen = db->k;
+	st->outlen = db->rows;
+	st->bits = 2 * q->keysize;
+	st->out = calloc(st->outlen, sizeof(st->out[0]));
+	for (i = 0; i < st->outlen; i++)
+		mpz_init2(st->out[i], st->bits);
+
+	naive_load(st, q);
+	return st;
+}
+
+static int naive_reload(void *state, struct query *q)
+{
+	naive_load(state, q);
+	return 0;
+}
+
+static void naive_compute(void *state)
+{
+	struct naive_state *st = state;
+	size_t i, j;
+
+#ifdef HAVEOMP
+#pragma omp parallel private(i, j)
 #endif
-#endif
+	{
+		/* out of place, mpz_mul would copy out[i] first */
+		mpz_t product;
 
-#ifdef IR_CODE
-void server(size_t dbsize, const uint *prime, size_t minvp,
-		size_t inplen, uint *inp,
-		size_t outlen, uint *out)
-#else
-void server(size_t dbsize, const mpz_t prime, size_t minvp,
-		size_t inplen, const mpz_t * const inp,
-		size_t outlen, mpz_t *out)
+		mpz_init2(product, st->bits);
+		arena_enter();
+
+#ifdef HAVEOMP
+#pragma omp for
 #endif
+		for (i = 0; i < st->outlen; i++) {
+			latency_begin();
+			for (j = 0; j < st->inplen; j++) {
+				if (!db_bit(st->db, i, j))
+					continue;
+				mpz_mul(product, st->out[i], st->inp[j]);
+				mpz_mod(st->out[i], product, st->prime);
+			}
+			latency_end();
+		}
+
+		arena_leave();
+		mpz_clear(product);
+	}
+}
+
+static void naive_results(void *state, mpz_t *out)
+{
+	struct naive_state *st = state;
+	size_t i;
+
+	for (i = 0; i < st->outlen; i++)
+		mpz_set(out[i], st->out[i]);
+}
+
+static void naive_finish(void *state, mpz_t *out)
+{
+	struct naive_state *st = state;
+	size_t i;
+
+	for (i = 0; i < st->outlen; i++) {
+		if (out) {
+			mpz_init(out[i]);
+			mpz_swap(out[i], st->out[i]);
+		}
+		mpz_clear(st->out[i]);
+	}
+
+	free(st->out);
+	free(st);
+}
+
+static const struct engine naive_engine = {
+	"naive", naive_prepare, naive_reload, naive_compute, naive_results,
+	naive_finish, NULL, NULL, NULL, NULL
+};
+
+/* all engines, auto picks among them */
+static const struct engine *engines[] = {
+	&naive_engine, &mpn_engine, &ir_engine, &simd_engine,
+};
+
+const struct engine *engine_select(const char *name)
+{
+	size_t i;
+
+	/* the vectorized kernels beat mpn when the CPU has them */
+	if (!strcmp(name, "auto"))
+		name = simd_accelerated() ? "simd" : "mpn";
+
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+		if (!strcmp(engines[i]->name, name))
+			return engines[i];
+	return NULL;
+}
+
+/**
+ * Prepares engine e for q over db, exiting if the query cannot be loaded.
+ */
+static void *prepare(const struct engine *e, struct query *q,
+		const struct database *db, size_t table_budget)
+{
+	void *state = e->prepare(q, db, table_budget);
+
+	if (!state) {
+		fprintf(stderr, "%s engine cannot answer the query!\n",
+				e->name);
+		exit(EXIT_FAILURE);
+	}
+	return state;
+}
+
+double server(const struct engine *e, struct query *q,
+		const struct database *db, mpz_t *out, size_t table_budget)
 {
-	double total_time, time_per_mul, time_per_round, mmps;
 	struct timespec st, en;
+	void *state;
+
+	/* pin threads before prepare first-touches the outputs */
+	affinity_apply();
+	state = prepare(e, q, db, table_budget);
 
+	perf_reset();
+	arena_reset();
+	pool_reset();
 	clock_gettime(CLOCK_MONOTONIC, &st);
+	e->compute(state);
+	clock_gettime(CLOCK_MONOTONIC, &en);
 
-#if IR_CODE
-	montgomerry(inp, inplen, prime);
-	multiply(inp, inplen, out, outlen, prime, minvp);
-#else
-#ifdef LLIMPL
-	low_level_impl(prime, minvp, inplen, inp, outlen, out);
-#else
-	naive_impl(prime, minvp, inplen, inp, outlen, out);
-#endif
-#endif
+	e->finish(state, out);
+
+	return 1000 * time_diff(&st, &en); /* in ms */
+}
+
+double server_batch(const struct engine *e, struct query *const *qs,
+		size_t count, const struct database *db, mpz_t *const *outs)
+{
+	struct timespec st, en;
+	double time = 0;
+	void *state;
+	size_t b;
+
+	/* one pass per query */
+	if (!e->batch_prepare) {
+		for (b = 0; b < count; b++)
+			time += server(e, qs[b], db, outs[b], 0);
+		return time;
+	}
+
+	affinity_apply();
+	state = e->batch_prepare(qs, count, db);
+	if (!state) {
+		fprintf(stderr, "%s engine cannot answer the queries!\n",
+				e->name);
+		exit(EXIT_FAILURE);
+	}
+
+	perf_reset();
+	arena_reset();
+	pool_reset();
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	e->batch_compute(state);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	e->batch_finish(state, outs);
+
+	return 1000 * time_diff(&st, &en); /* in ms */
+}
+
+double server_recursive(const struct engine *e, struct query *q,
+		struct query *q2, const struct database *db, mpz_t *out,
+		size_t table_budget)
+{
+	struct timespec st, en;
+	struct database bits;
+	mpz_t *first;
+	double time;
+	size_t i;
+
+	first = calloc(db->rows, sizeof(first[0]));
+	if (!first) {
+		fprintf(stderr, "Cannot allocate memory for server results!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	time = server(e, q, db, first, table_budget);
+
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	database_from_numbers((const mpz_t *)first, db->rows, q->keysize,
+			&bits);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+	time += 1000 * time_diff(&st, &en);
+
+	time += server(e, q2, &bits, out, 0);
+
+	release_database(&bits);
+	for (i = 0; i < db->rows; i++)
+		mpz_clear(first[i]);
+	free(first);
+
+	return time;
+}
+
+double server_stream(const struct engine *e, struct query *q,
+		struct db_stream *s, const struct database *shape, mpz_t *out)
+{
+	struct timespec st, en;
+	struct database chunk;
+	size_t first;
+	void *state = NULL;
+	int r;
 
+	affinity_apply();
+	if (e->stream)
+		state = prepare(e, q, shape, 0);
+
+	perf_reset();
+	arena_reset();
+	pool_reset();
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	while ((r = db_stream_next(s, &chunk, &first)) > 0) {
+		if (e->stream) {
+			e->stream(state, &chunk, first);
+			continue;
+		}
+
+		/* one run per chunk */
+		state = prepare(e, q, &chunk, 0);
+		e->compute(state);
+		e->finish(state, out + first);
+	}
 	clock_gettime(CLOCK_MONOTONIC, &en);
 
-	total_time = 1000 * time_diff(&st, &en); /* in ms */
-	time_per_mul = total_time / dbsize;
+	if (r < 0) {
+		fprintf(stderr, "Cannot read the database!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (e->stream)
+		e->finish(state, out);
+
+	return 1000 * time_diff(&st, &en); /* in ms */
+}
+
+void report_times(double total_time, size_t n, size_t outlen)
+{
+	double time_per_mul, time_per_round, mmps;
+
+	time_per_mul = total_time / n;
 	time_per_round = total_time / outlen;
 	mmps = 0.001 / time_per_mul; /* in mmps */
 	printf("Total time: %7.3lf ms\n", total_time);
@@ -1,17 +1,139 @@
 #ifndef SERVER_H__
 #define SERVER_H__
 
+#include "numfile.h"
+
 struct mpz_t;
+struct database;
+struct db_stream;
 
-#ifdef IR_CODE
-void server(size_t dbsize, const uint *prime, size_t minvp,
-		size_t inplen, uint *inp,
-		size_t outlen, uint *out);
-#else
-void server(size_t dbsize, const mpz_t prime, size_t minvp,
-		size_t inplen, const mpz_t * const inp,
-		size_t outlen, mpz_t *out);
-#endif
+/**
+ * Client query for one keysize, loaded once and used by all server runs.
+ */
+struct query {
+	size_t keysize;
+	/* number of query numbers loaded */
+	size_t length;
+	mpz_t prime, r2, *numbers;
+	size_t minvp;
+	/* binary numberfile the numbers came from (map is NULL if none) */
+	struct numfile nf;
+	/* numbers in nf were converted in place by a previous run */
+	int converted;
+};
+
+/**
+ * A server engine. A run goes through:
+ * 	- prepare: converts the first db->k numbers of q to the engine's own
+ * 	  representation and allocates the outputs, returns the engine state
+ * 	  (NULL if the engine cannot answer q, e.g. its kernels disagree with
+ * 	  GMP for the prime)
+ * 	- compute: converts to Montgomery representation, multiplies the
+ * 	  selected inputs into each output and converts back (timed)
+ * 	- finish: writes the outputs to out (initializing them) unless out is
+ * 	  NULL, and frees the state
+ * A long running server keeps the state between queries instead:
+ * 	- reload: loads another query of the same keysize over the same
+ * 	  database into the state, reusing its buffers, returns -1 if the
+ * 	  engine cannot answer q (the state can then only be finished)
+ * 	- results: writes the outputs of the last compute to out, which is
+ * 	  already initialized
+ * Engines able to answer several queries in one pass over the database
+ * also have batch_prepare, batch_compute and batch_finish, which work like
+ * the above on count queries of the same keysize (NULL otherwise).
+ * batch_prepare returns NULL if one of the queries cannot be answered.
+ * Engines able to work on a database streamed in chunks have stream, called
+ * between prepare (given the shape of the whole database) and finish for
+ * each chunk in order, with the index of its first row (NULL otherwise).
+ */
+struct engine {
+	const char *name;
+	void *(*prepare)(struct query *q, const struct database *db,
+			size_t table_budget);
+	int (*reload)(void *state, struct query *q);
+	void (*compute)(void *state);
+	void (*results)(void *state, mpz_t *out);
+	void (*finish)(void *state, mpz_t *out);
+	void *(*batch_prepare)(struct query *const *qs, size_t count,
+			const struct database *db);
+	void (*batch_compute)(void *state);
+	void (*batch_finish)(void *state, mpz_t *const *outs);
+	void (*stream)(void *state, const struct database *chunk,
+			size_t first);
+};
+
+/**
+ * Returns the engine called name (naive, mpn, ir or simd). "auto" picks the
+ * fastest engine for this CPU. Returns NULL for unknown names.
+ */
+const struct engine *engine_select(const char *name);
+
+/**
+ * Overrides the choices of the IR engine in the next runs, 0 keeps them:
+ * outputs per tile of a multiply pass, and width of the Four-Russians tables
+ * used when no table budget is given.
+ */
+void ir_tune_set(size_t tile, unsigned int width);
+
+/**
+ * Runs engine e over db with the first db->k numbers of q as query and
+ * stores the results in out, which must be cleared before calling again.
+ * With table_budget > 0, the IR engine uses Four-Russians tables of at most
+ * table_budget bytes.
+ *
+ * Returns the time spent computing (in ms).
+ */
+double server(const struct engine *e, struct query *q,
+		const struct database *db, mpz_t *out, size_t table_budget);
+
+/**
+ * Runs engine e once for count queries of the same keysize and stores the
+ * results of qs[b] in outs[b]. Engines with batch support read the database
+ * once for all queries, the others run them one after the other. Four-Russians
+ * tables are not used.
+ *
+ * Returns the time spent computing (in ms).
+ */
+double server_batch(const struct engine *e, struct query *const *qs,
+		size_t count, const struct database *db, mpz_t *const *outs);
+
+/**
+ * Returns the form of the prime of q as the IR kernels see it (an enum
+ * ir_form). Queries of one server_batch pass need primes of the same form.
+ */
+int query_prime_form(const struct query *q);
+
+/**
+ * Answers a recursive (two-level) query: runs engine e over db with q, then
+ * over the database made of the bits of the db->rows outputs (see
+ * database_from_numbers) with the first db->rows numbers of q2. Stores the
+ * q->keysize results of the second level in out, which must be cleared
+ * before calling again: the response shrinks from db->rows to q->keysize
+ * numbers, if db->rows is larger. Both levels run in this process, the
+ * service protocol has no recursive queries.
+ *
+ * Returns the time spent computing both levels (in ms).
+ */
+double server_recursive(const struct engine *e, struct query *q,
+		struct query *q2, const struct database *db, mpz_t *out,
+		size_t table_budget);
+
+/**
+ * Runs engine e over the database read from s, whose size is in shape, and
+ * stores the results in out like server. Each chunk is multiplied while the
+ * next ones are being read. Engines without stream support do a whole run
+ * (prepare, compute, finish) per chunk. Four-Russians tables are not used.
+ *
+ * Returns the time spent computing and waiting for chunks (in ms).
+ */
+double server_stream(const struct engine *e, struct query *q,
+		struct db_stream *s, const struct database *shape, mpz_t *out);
+
+/**
+ * Prints the timings of a server run of total_time ms over a database of n
+ * bits with outlen outputs.
+ */
+void report_times(double total_time, size_t n, size_t outlen);
 
 void dump_results(size_t outlen, const mpz_t * const out);
 
@@ -0,0 +1,842 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gmp.h>
+
+#include "affinity.h"
+#include "arena.h"
+#include "database.h"
+#include "globals.h"
+#include "latency.h"
+#include "perf.h"
+#include "server.h"
+#include "service.h"
+
+/* results converted and sent at once */
+#define CHUNKROWS 64
+
+/* key sizes accepted from clients (in bits) */
+#define MINKEYSIZE 64
+#define MAXKEYSIZE 8192
+
+/* longest wait for a client to take more results (in ms) */
+#define SENDTIMEOUT 5000
+
+/**
+ * Fills a socket address from addr (":port" or a path). Returns the address
+ * family or -1.
+ */
+static int parse_addr(const char *addr, struct sockaddr_storage *sa,
+		socklen_t *len)
+{
+	struct sockaddr_in *in = (struct sockaddr_in *)sa;
+	struct sockaddr_un *un = (struct sockaddr_un *)sa;
+	unsigned int port;
+	char extra;
+
+	memset(sa, 0, sizeof(*sa));
+
+	if (addr[0] == ':') {
+		if (sscanf(addr + 1, "%u%c", &port, &extra) != 1 ||
+				port > 65535)
+			return -1;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		*len = sizeof(*in);
+		return AF_INET;
+	}
+
+	if (strlen(addr) >= sizeof(un->sun_path))
+		return -1;
+	un->sun_family = AF_UNIX;
+	strcpy(un->sun_path, addr);
+	*len = sizeof(*un);
+	return AF_UNIX;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		r = send(fd, p, len, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		/* non-blocking server side: wait a bounded time for room */
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+
+			if (poll(&pfd, 1, SENDTIMEOUT) > 0)
+				continue;
+			return -1;
+		}
+		if (r <= 0)
+			return -1;
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int read_number(int fd, mpz_t num, uint64_t *words, size_t n)
+{
+	if (read_full(fd, words, n * sizeof(words[0])) < 0)
+		return -1;
+	mpz_import(num, n, -1, sizeof(words[0]), 0, 0, words);
+	return 0;
+}
+
+static void write_number(uint64_t *words, size_t n, const mpz_t num)
+{
+	memset(words, 0, n * sizeof(words[0]));
+	mpz_export(words, NULL, -1, sizeof(words[0]), 0, 0, num);
+}
+
+/**
+ * Resizes q to k numbers of keysize bits.
+ */
+static void resize_query(struct query *q, size_t keysize, size_t k)
+{
+	size_t i;
+
+	for (i = k; i < q->length; i++)
+		mpz_clear(q->numbers[i]);
+	q->numbers = realloc(q->numbers, k * sizeof(q->numbers[0]));
+	if (k && !q->numbers) {
+		fprintf(stderr, "Cannot allocate memory for query!\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = q->length; i < k; i++)
+		mpz_init2(q->numbers[i], keysize);
+
+	q->keysize = keysize;
+	q->length = k;
+}
+
+/**
+ * Checks the header of a query before anything is allocated for it. Returns
+ * its status.
+ */
+static int check_query(const struct service_request *req,
+		const struct database *db)
+{
+	if (req->keysize < MINKEYSIZE || req->keysize > MAXKEYSIZE ||
+			req->keysize % 64)
+		return SERVICE_EINVAL;
+	if (req->k != db->k)
+		return SERVICE_ESHAPE;
+	return SERVICE_OK;
+}
+
+/**
+ * Loads the prime and the numbers of a checked query, received whole in
+ * words, into q. Returns the status of the request.
+ */
+static int parse_query(const struct service_request *req,
+		const uint64_t *words, struct query *q)
+{
+	size_t i, n = req->keysize / 64, bits;
+
+	mpz_import(q->prime, n, -1, sizeof(words[0]), 0, 0, words);
+	if (req->keysize != q->keysize)
+		resize_query(q, req->keysize, req->k);
+	for (i = 0; i < req->k; i++)
+		mpz_import(q->numbers[i], n, -1, sizeof(words[0]), 0, 0,
+				&words[n * (i + 1)]);
+
+	/*
+	 * kernels assume an odd prime of exactly keysize bits, or below R / 4,
+	 * and engines size their numbers from the prime: its top word is used
+	 */
+	bits = mpz_sizeinbase(q->prime, 2);
+	if ((bits != req->keysize && bits + 2 > req->keysize) ||
+			mpz_even_p(q->prime) || mpz_size(q->prime) != n)
+		return SERVICE_EINVAL;
+
+	/* a wrong Montgomery constant would give wrong results silently */
+	if ((uint64_t)mpz_getlimbn(q->prime, 0) * req->minvp != UINT64_MAX)
+		return SERVICE_EINVAL;
+
+	q->minvp = req->minvp;
+	mpz_ui_pow_ui(q->r2, 2, 2 * req->keysize);
+	mpz_mod(q->r2, q->r2, q->prime);
+	return SERVICE_OK;
+}
+
+/**
+ * Sends the reply header and the results, chunk by chunk.
+ */
+static int write_results(int fd, const mpz_t *out, size_t rows,
+		size_t keysize, double time)
+{
+	struct service_reply rep;
+	size_t i, j, n = keysize / 64;
+	uint64_t *buf;
+	int ret = 0;
+
+	rep.magic = SERVICE_REPLY;
+	rep.status = SERVICE_OK;
+	rep.rows = rows;
+	rep.words = n;
+	rep.time = time;
+	if (write_full(fd, &rep, sizeof(rep)) < 0)
+		return -1;
+
+	buf = malloc(CHUNKROWS * n * sizeof(buf[0]));
+	for (i = 0; i < rows && !ret; i += CHUNKROWS) {
+		for (j = i; j < rows && j < i + CHUNKROWS; j++)
+			write_number(&buf[(j - i) * n], n, out[j]);
+		ret = write_full(fd, buf, (j - i) * n * sizeof(buf[0]));
+	}
+	free(buf);
+
+	return ret;
+}
+
+static int write_status(int fd, int status)
+{
+	struct service_reply rep;
+
+	memset(&rep, 0, sizeof(rep));
+	rep.magic = SERVICE_REPLY;
+	rep.status = status;
+	return write_full(fd, &rep, sizeof(rep));
+}
+
+/**
+ * Sends the JSON dump of the latency histograms as one row.
+ */
+static int write_metrics(int fd)
+{
+	struct service_reply rep;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int ret;
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		return write_status(fd, SERVICE_EINVAL);
+	latency_json(f);
+	/* NUL padding up to whole words */
+	fwrite("\0\0\0\0\0\0\0", 1, 7 - (ftell(f) + 7) % 8, f);
+	fclose(f);
+
+	memset(&rep, 0, sizeof(rep));
+	rep.magic = SERVICE_REPLY;
+	rep.status = SERVICE_OK;
+	rep.rows = 1;
+	rep.words = len / 8;
+	ret = write_full(fd, &rep, sizeof(rep));
+	if (!ret)
+		ret = write_full(fd, buf, len);
+	free(buf);
+	return ret;
+}
+
+/* connections served at once */
+#define MAXCONN 64
+
+/* a client connection and its last query */
+struct conn {
+	int fd;
+	/* request being received: have of its need bytes are in in */
+	unsigned char *in;
+	size_t have, need;
+	/* query read, waiting for the next pass */
+	int pending;
+	struct query q;
+	mpz_t *out;
+};
+
+/* state kept by the server between passes */
+struct service {
+	const struct engine *e;
+	const struct database *db;
+	size_t table_budget;
+	/* most queries answered in one pass */
+	size_t batch;
+	/* longest wait for more queries after the first pending one (in ms) */
+	unsigned int window;
+	struct timespec first;
+	/* engine state of single queries, prepared for keysize loaded */
+	void *state;
+	size_t loaded;
+	size_t passes;
+	struct conn conns[MAXCONN];
+};
+
+static void conn_open(struct service *sv, struct conn *c, int fd)
+{
+	size_t i;
+
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	/* requests arrive piecewise, the loop never waits for one client */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->need = sizeof(struct service_request);
+	c->in = malloc(c->need);
+	mpz_init(c->q.prime);
+	mpz_init(c->q.r2);
+	c->out = calloc(sv->db->rows, sizeof(c->out[0]));
+	if (!c->out || !c->in) {
+		fprintf(stderr, "Cannot allocate memory for results!\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < sv->db->rows; i++)
+		mpz_init(c->out[i]);
+}
+
+static void conn_close(struct service *sv, struct conn *c)
+{
+	size_t i;
+
+	close(c->fd);
+	free(c->in);
+	for (i = 0; i < sv->db->rows; i++)
+		mpz_clear(c->out[i]);
+	free(c->out);
+	for (i = 0; i < c->q.length; i++)
+		mpz_clear(c->q.numbers[i]);
+	free(c->q.numbers);
+	mpz_clear(c->q.prime);
+	mpz_clear(c->q.r2);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/**
+ * Handles the header of c, just received. Returns 0 after a stop request, -1
+ * if the connection must be closed, 1 otherwise.
+ */
+static int read_header(struct service *sv, struct conn *c)
+{
+	const struct service_request *req = (const void *)c->in;
+	size_t need;
+	void *in;
+	int status;
+
+	if (req->magic != SERVICE_REQUEST ||
+			(req->op != SERVICE_QUERY && req->op != SERVICE_STOP &&
+			 req->op != SERVICE_METRICS)) {
+		write_status(c->fd, SERVICE_EINVAL);
+		return -1;
+	}
+	if (req->op == SERVICE_STOP) {
+		write_status(c->fd, SERVICE_OK);
+		return 0;
+	}
+	if (req->op == SERVICE_METRICS) {
+		c->have = 0;
+		return write_metrics(c->fd) < 0 ? -1 : 1;
+	}
+
+	status = check_query(req, sv->db);
+	if (status != SERVICE_OK) {
+		/* the stream may be out of step now */
+		write_status(c->fd, status);
+		return -1;
+	}
+
+	/* the prime and the k numbers follow */
+	need = sizeof(*req) + (req->k + 1) * (req->keysize / 8);
+	in = realloc(c->in, need);
+	if (!in) {
+		write_status(c->fd, SERVICE_EINVAL);
+		return -1;
+	}
+	c->in = in;
+	c->need = need;
+	return 1;
+}
+
+/**
+ * Receives what c sent, without waiting for the rest of a request. A query
+ * received whole is left pending. Returns 0 after a stop request, -1 if the
+ * connection must be closed, 1 otherwise.
+ */
+static int read_request(struct service *sv, struct conn *c)
+{
+	const struct service_request *req;
+	ssize_t r;
+	int status;
+
+	for (;;) {
+		r = recv(c->fd, c->in + c->have, c->need - c->have, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		if (r <= 0)
+			return -1;
+
+		c->have += r;
+		if (c->have < c->need)
+			continue;
+
+		if (c->need == sizeof(*req)) {
+			status = read_header(sv, c);
+			if (status <= 0)
+				return status;
+			continue;
+		}
+
+		req = (const void *)c->in;
+		status = parse_query(req, (const uint64_t *)(req + 1), &c->q);
+		c->have = 0;
+		c->need = sizeof(*req);
+		if (status != SERVICE_OK) {
+			write_status(c->fd, status);
+			return -1;
+		}
+
+		/* the client waits for the results before its next request */
+		c->pending = 1;
+		return 1;
+	}
+}
+
+/**
+ * Answers the query of c alone, with the engine state kept between passes.
+ * Returns the time spent computing (in ms), or -1 if the engine cannot
+ * answer the query.
+ */
+static double run_single(struct service *sv, struct conn *c)
+{
+	const struct engine *e = sv->e;
+	struct timespec st, en;
+
+	/* buffers are kept while the keysize doesn't change */
+	if (sv->state && sv->loaded == c->q.keysize) {
+		if (e->reload(sv->state, &c->q) < 0) {
+			e->finish(sv->state, NULL);
+			sv->state = NULL;
+			return -1;
+		}
+	} else {
+		if (sv->state)
+			e->finish(sv->state, NULL);
+		sv->state = e->prepare(&c->q, sv->db, sv->table_budget);
+		sv->loaded = c->q.keysize;
+		if (!sv->state)
+			return -1;
+	}
+
+	perf_reset();
+	arena_reset();
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	e->compute(sv->state);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	e->results(sv->state, c->out);
+	return 1000 * time_diff(&st, &en);
+}
+
+/**
+ * Answers the queries of the count connections in cs in one pass over the
+ * database. Returns the time spent computing (in ms), or -1 if the engine
+ * cannot answer one of them.
+ */
+static double run_batch(struct service *sv, struct conn **cs, size_t count)
+{
+	const struct engine *e = sv->e;
+	struct query *qs[MAXCONN];
+	mpz_t *outs[MAXCONN];
+	struct timespec st, en;
+	void *state;
+	size_t b, i;
+
+	for (b = 0; b < count; b++) {
+		qs[b] = &cs[b]->q;
+		outs[b] = cs[b]->out;
+	}
+
+	state = e->batch_prepare(qs, count, sv->db);
+	if (!state)
+		return -1;
+	perf_reset();
+	arena_reset();
+	clock_gettime(CLOCK_MONOTONIC, &st);
+	e->batch_compute(state);
+	clock_gettime(CLOCK_MONOTONIC, &en);
+
+	/* batch_finish initializes the outputs again */
+	for (b = 0; b < count; b++)
+		for (i = 0; i < sv->db->rows; i++)
+			mpz_clear(outs[b][i]);
+	e->batch_finish(state, outs);
+
+	return 1000 * time_diff(&st, &en);
+}
+
+/**
+ * Answers all pending queries, up to sv->batch of the same keysize per pass,
+ * and sends the results back.
+ */
+static void run_pending(struct service *sv)
+{
+	struct conn *cs[MAXCONN];
+	size_t count, b, i;
+	double time;
+
+	for (;;) {
+		/* pending queries with the keysize and prime form of the first */
+		count = 0;
+		for (i = 0; i < MAXCONN && count < sv->batch; i++) {
+			struct conn *c = &sv->conns[i];
+
+			if (c->fd < 0 || !c->pending)
+				continue;
+			if (count && (c->q.keysize != cs[0]->q.keysize ||
+						query_prime_form(&c->q) !=
+						query_prime_form(&cs[0]->q)))
+				continue;
+			cs[count++] = c;
+		}
+		if (!count)
+			return;
+
+		time = -1;
+		if (count > 1 && sv->e->batch_prepare)
+			time = run_batch(sv, cs, count);
+		/* one query alone, or the first one of a batch that failed */
+		if (time < 0) {
+			count = 1;
+			time = run_single(sv, cs[0]);
+		}
+		if (time < 0) {
+			cs[0]->pending = 0;
+			write_status(cs[0]->fd, SERVICE_EINVAL);
+			conn_close(sv, cs[0]);
+			continue;
+		}
+
+		sv->passes++;
+		printf("Pass %lu: %lu queries, %lu bits, %7.3f ms\n",
+				sv->passes, count, cs[0]->q.keysize, time);
+		fflush(stdout);
+
+		for (b = 0; b < count; b++) {
+			cs[b]->pending = 0;
+			if (write_results(cs[b]->fd, (const mpz_t *)cs[b]->out,
+						sv->db->rows, cs[b]->q.keysize,
+						time) < 0)
+				conn_close(sv, cs[b]);
+		}
+	}
+}
+
+static size_t count_pending(const struct service *sv)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < MAXCONN; i++)
+		count += sv->conns[i].fd >= 0 && sv->conns[i].pending;
+	return count;
+}
+
+/**
+ * Accepts all waiting connections, those beyond MAXCONN are closed, and
+ * receives what they already sent. Returns 0 if one of them asked to stop.
+ */
+static int accept_all(struct service *sv, int fd)
+{
+	struct conn *c;
+	int conn, ret = 1;
+	size_t i;
+
+	for (;;) {
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0 && errno == EINTR)
+			continue;
+		if (conn < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return ret;
+		}
+
+		for (i = 0; i < MAXCONN; i++)
+			if (sv->conns[i].fd < 0)
+				break;
+		if (i == MAXCONN) {
+			close(conn);
+			continue;
+		}
+
+		c = &sv->conns[i];
+		conn_open(sv, c, conn);
+		switch (read_request(sv, c)) {
+		case 0:
+			ret = 0;
+			break;
+		case -1:
+			conn_close(sv, c);
+			break;
+		}
+	}
+}
+
+int service_run(const char *addr, const struct engine *e,
+		const struct database *db, size_t table_budget, size_t batch,
+		unsigned int window)
+{
+	struct pollfd fds[MAXCONN + 1];
+	struct conn *polled[MAXCONN + 1];
+	struct sockaddr_storage sa;
+	struct service sv;
+	struct timespec now;
+	size_t i, n, pending, count;
+	socklen_t len;
+	int fd, family, timeout, one = 1, stop = 0;
+
+	family = parse_addr(addr, &sa, &len);
+	if (family < 0) {
+		fprintf(stderr, "Invalid address %s\n", addr);
+		return -1;
+	}
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (family == AF_UNIX)
+		unlink(addr);
+	else
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sa, len) < 0 ||
+			listen(fd, MAXCONN) < 0) {
+		perror(addr);
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&sv, 0, sizeof(sv));
+	sv.e = e;
+	sv.db = db;
+	sv.table_budget = table_budget;
+	sv.batch = batch < 1 ? 1 : batch > MAXCONN ? MAXCONN : batch;
+	sv.window = window;
+	for (i = 0; i < MAXCONN; i++)
+		sv.conns[i].fd = -1;
+
+	/* pinned once, the threads stay on their CPUs between queries */
+	affinity_apply();
+	perf_reset();
+	latency_enable();
+	latency_reset();
+	printf("Listening on %s\n", addr);
+	fflush(stdout);
+
+	while (!stop) {
+		/* wait for new clients and for requests of idle ones */
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		for (i = 0, n = 1; i < MAXCONN; i++) {
+			if (sv.conns[i].fd < 0 || sv.conns[i].pending)
+				continue;
+			fds[n].fd = sv.conns[i].fd;
+			fds[n].events = POLLIN;
+			polled[n++] = &sv.conns[i];
+		}
+
+		/* until the window of the pending queries closes */
+		pending = count_pending(&sv);
+		timeout = -1;
+		if (pending) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = sv.window - 1000 * time_diff(&sv.first, &now);
+			if (timeout < 0)
+				timeout = 0;
+		}
+
+		if (poll(fds, n, timeout) < 0) {
+			if (errno != EINTR)
+				perror("poll");
+			continue;
+		}
+
+		for (i = 1; i < n; i++) {
+			if (!fds[i].revents)
+				continue;
+			switch (read_request(&sv, polled[i])) {
+			case 0:
+				stop = 1;
+				break;
+			case -1:
+				conn_close(&sv, polled[i]);
+				break;
+			}
+		}
+
+		if ((fds[0].revents & POLLIN) && !accept_all(&sv, fd))
+			stop = 1;
+
+		/* a pass once batch queries wait, or window ms after the first */
+		count = count_pending(&sv);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (count && !pending)
+			sv.first = now;
+		if (count && (count >= sv.batch || stop ||
+					1000 * time_diff(&sv.first, &now) >=
+					sv.window))
+			run_pending(&sv);
+	}
+
+	if (sv.state)
+		e->finish(sv.state, NULL);
+	for (i = 0; i < MAXCONN; i++)
+		if (sv.conns[i].fd >= 0)
+			conn_close(&sv, &sv.conns[i]);
+
+	close(fd);
+	if (family == AF_UNIX)
+		unlink(addr);
+	return 0;
+}
+
+int service_connect(const char *addr)
+{
+	struct sockaddr_storage sa;
+	socklen_t len;
+	int fd, family;
+
+	family = parse_addr(addr, &sa, &len);
+	if (family < 0) {
+		fprintf(stderr, "Invalid address %s\n", addr);
+		return -1;
+	}
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&sa, len) < 0) {
+		perror(addr);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int service_query(int fd, const struct query *q, size_t k, mpz_t *out,
+		size_t rows, double *time)
+{
+	struct service_request req;
+	struct service_reply rep;
+	size_t i, n = q->keysize / 64;
+	uint64_t *words;
+	int ret = -1;
+
+	req.magic = SERVICE_REQUEST;
+	req.op = SERVICE_QUERY;
+	req.keysize = q->keysize;
+	req.k = k;
+	req.minvp = q->minvp;
+
+	words = malloc(n * sizeof(words[0]));
+	if (write_full(fd, &req, sizeof(req)) < 0)
+		goto out;
+	write_number(words, n, q->prime);
+	if (write_full(fd, words, n * sizeof(words[0])) < 0)
+		goto out;
+	for (i = 0; i < k; i++) {
+		write_number(words, n, q->numbers[i]);
+		if (write_full(fd, words, n * sizeof(words[0])) < 0)
+			goto out;
+	}
+
+	if (read_full(fd, &rep, sizeof(rep)) < 0 ||
+			rep.magic != SERVICE_REPLY)
+		goto out;
+	if (rep.status != SERVICE_OK) {
+		fprintf(stderr, "Server refused the query (status %u)\n",
+				rep.status);
+		goto out;
+	}
+	if (rep.rows != rows || rep.words != n) {
+		fprintf(stderr, "Server returned %lu results of %lu words\n",
+				rep.rows, rep.words);
+		goto out;
+	}
+
+	for (i = 0; i < rows; i++)
+		if (read_number(fd, out[i], words, n) < 0)
+			goto out;
+	*time = rep.time;
+	ret = 0;
+
+out:
+	free(words);
+	return ret;
+}
+
+int service_stop(int fd)
+{
+	struct service_request req;
+	struct service_reply rep;
+
+	memset(&req, 0, sizeof(req));
+	req.magic = SERVICE_REQUEST;
+	req.op = SERVICE_STOP;
+	if (write_full(fd, &req, sizeof(req)) < 0 ||
+			read_full(fd, &rep, sizeof(rep)) < 0)
+		return -1;
+	return rep.status == SERVICE_OK ? 0 : -1;
+}
+
+int service_metrics(int fd, FILE *out)
+{
+	struct service_request req;
+	struct service_reply rep;
+	char *buf;
+	int ret = -1;
+
+	memset(&req, 0, sizeof(req));
+	req.magic = SERVICE_REQUEST;
+	req.op = SERVICE_METRICS;
+	if (write_full(fd, &req, sizeof(req)) < 0 ||
+			read_full(fd, &rep, sizeof(rep)) < 0 ||
+			rep.magic != SERVICE_REPLY ||
+			rep.status != SERVICE_OK || rep.rows != 1)
+		return -1;
+
+	buf = malloc(rep.words * 8 + 1);
+	if (buf && read_full(fd, buf, rep.words * 8) == 0) {
+		buf[rep.words * 8] = '\0';
+		fputs(buf, out);
+		ret = 0;
+	}
+	free(buf);
+	return ret;
+}
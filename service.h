@@ -0,0 +1,118 @@
+#ifndef SERVICE_H__
+#define SERVICE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <gmp.h>
+
+struct database;
+struct engine;
+struct query;
+
+/**
+ * Long running server: the database is mapped once and queries arrive over a
+ * socket. An address is the path of a UNIX domain socket, or ":port" for a TCP
+ * port on the loopback interface.
+ *
+ * All fields are in host byte order (clients run on the same machine). A
+ * connection carries any number of requests, each answered before the next
+ * one is read. The compute time in a reply is the one of the whole pass the
+ * query was answered in.
+ */
+
+/* "PIRQ" and "PIRR" read as little endian */
+#define SERVICE_REQUEST	0x51524950
+#define SERVICE_REPLY	0x52524950
+
+enum service_op {
+	/* run a query */
+	SERVICE_QUERY = 1,
+	/* stop the server after replying */
+	SERVICE_STOP = 2,
+	/* latency histograms of the server (see latency.h) */
+	SERVICE_METRICS = 3,
+};
+
+enum service_status {
+	SERVICE_OK = 0,
+	/* bad magic, operation, keysize or prime */
+	SERVICE_EINVAL = 1,
+	/* k is not the query length of the database */
+	SERVICE_ESHAPE = 2,
+};
+
+/**
+ * Request header. A SERVICE_QUERY is followed by the prime and the k query
+ * numbers, each keysize / 64 64-bit words, least significant first. keysize
+ * is a multiple of 64 from 64 to 8192, others are refused before anything is
+ * read. The server receives requests piecewise: a client that stops halfway
+ * only holds its own connection. The prime
+ * must have exactly keysize bits, and the ir engine needs it just above
+ * 2^(keysize - 1), as its accumulators hold values below 2p in keysize bits.
+ * Primes below 2^(keysize - 2) are also accepted, the ir engine uses lazily
+ * reduced kernels for them. Primes 2^keysize - c with a small c are reduced
+ * without Montgomery multiplication. minvp must be -p^-1 `mod` 2^64.
+ */
+struct service_request {
+	uint32_t magic;
+	uint32_t op;
+	uint64_t keysize;
+	uint64_t k;
+	uint64_t minvp;
+};
+
+/**
+ * Reply header. With SERVICE_OK it is followed by rows results of words
+ * 64-bit words each, as they are converted. The reply to SERVICE_METRICS is
+ * one row: the JSON dump of latency_json, padded with NULs to whole words.
+ */
+struct service_reply {
+	uint32_t magic;
+	uint32_t status;
+	uint64_t rows;
+	uint64_t words;
+	/* time spent computing (in ms) */
+	double time;
+};
+
+/**
+ * Serves queries over db with engine e on addr until a SERVICE_STOP request.
+ * Once a query has arrived, the server goes on accepting clients and
+ * receiving queries until batch of them are pending or window ms have
+ * passed. Then the pending queries are answered, up to batch of the same
+ * keysize and prime form in one pass over the database (with engines
+ * supporting it). With batch 1 each query is answered as soon as it arrives. A lone query reuses the engine state (and
+ * the OpenMP threads) of the previous one of the same keysize. Latencies are
+ * recorded for SERVICE_METRICS. Returns 0, or -1 if addr cannot be listened
+ * on.
+ */
+int service_run(const char *addr, const struct engine *e,
+		const struct database *db, size_t table_budget, size_t batch,
+		unsigned int window);
+
+/**
+ * Connects to the server on addr. Returns the socket or -1.
+ */
+int service_connect(const char *addr);
+
+/**
+ * Sends the first k numbers of q and reads rows results into out (already
+ * initialized). Stores the server's compute time (in ms) in time. Returns 0,
+ * or -1 on errors or if the server doesn't return rows results.
+ */
+int service_query(int fd, const struct query *q, size_t k, mpz_t *out,
+		size_t rows, double *time);
+
+/**
+ * Asks the server to stop. Returns 0 or -1.
+ */
+int service_stop(int fd);
+
+/**
+ * Reads the latency histograms of the server, recorded since it started, and
+ * writes them to out as JSON. Returns 0 or -1.
+ */
+int service_metrics(int fd, FILE *out);
+
+#endif
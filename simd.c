@@ -0,0 +1,510 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gmp.h>
+#include <immintrin.h>
+
+#ifdef HAVEOMP
+#include <omp.h>
+#endif
+
+#include "database.h"
+#include "latency.h"
+#include "server.h"
+#include "simd.h"
+
+/* most lanes any kernel has */
+#define MAXLANES 8
+
+/* alignment of the interleaved accumulators */
+#define SIMDALIGN 64
+
+/**
+ * A lane-parallel Montgomery kernel. All numbers have m limbs of `radix` bits
+ * each, stored in 64-bit words. Accumulators are interleaved: limb l of lane
+ * s is at acc[l * lanes + s]. The multiplicand b and the prime p are shared
+ * by all lanes.
+ *
+ * mul() sets acc = acc * b / 2^(radix * m) mod p in all lanes whose bit is
+ * set in mask. Values are kept in [0, 2p), which works because m is chosen
+ * such that 4p < 2^(radix * m).
+ */
+struct simd_kernel {
+	const char *name;
+	uint radix;
+	uint lanes;
+	int (*supported)(void);
+	void (*mul)(uint m, uint64_t *acc, const uint64_t *b,
+			const uint64_t *p, uint64_t k0, uint mask);
+};
+
+/* portable kernel: 26-bit limbs, full products fit in 64 bits */
+
+#define GRADIX 26
+#define GLANES 4
+#define GMASK ((1UL << GRADIX) - 1)
+
+static int generic_supported(void)
+{
+	return 1;
+}
+
+static void generic_mul(uint m, uint64_t *acc, const uint64_t *b,
+		const uint64_t *p, uint64_t k0, uint mask)
+{
+	uint64_t t[2 * m * GLANES], u[GLANES], c[GLANES], x;
+	uint i, l, s;
+
+	memset(t, 0, sizeof(t));
+
+	for (i = 0; i < m; i++) {
+		uint64_t *ti = t + i * GLANES;
+
+		/* t += acc * b[i] */
+		for (l = 0; l < m; l++)
+			for (s = 0; s < GLANES; s++)
+				ti[l * GLANES + s] += acc[l * GLANES + s] * b[i];
+
+		/* t += u * p, such that the lowest limb becomes 0 */
+		for (s = 0; s < GLANES; s++)
+			u[s] = ((ti[s] & GMASK) * k0) & GMASK;
+		for (l = 0; l < m; l++)
+			for (s = 0; s < GLANES; s++)
+				ti[l * GLANES + s] += u[s] * p[l];
+
+		/* t /= base */
+		for (s = 0; s < GLANES; s++)
+			ti[GLANES + s] += ti[s] >> GRADIX;
+	}
+
+	/* normalize and store in the selected lanes */
+	for (s = 0; s < GLANES; s++)
+		c[s] = 0;
+	for (l = 0; l < m; l++)
+		for (s = 0; s < GLANES; s++) {
+			x = t[(m + l) * GLANES + s] + c[s];
+			c[s] = x >> GRADIX;
+			if (mask & (1U << s))
+				acc[l * GLANES + s] = x & GMASK;
+		}
+}
+
+/* AVX2 kernel: same algorithm as the portable one, using vpmuludq */
+
+#define ARADIX GRADIX
+#define ALANES 4
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void avx2_mul(uint m, uint64_t *acc, const uint64_t *b,
+		const uint64_t *p, uint64_t k0, uint mask)
+{
+	const __m256i rmask = _mm256_set1_epi64x(GMASK);
+	const __m256i k0v = _mm256_set1_epi64x(k0);
+	const __m256i smask = _mm256_set_epi64x(
+			-(long long)((mask >> 3) & 1),
+			-(long long)((mask >> 2) & 1),
+			-(long long)((mask >> 1) & 1),
+			-(long long)(mask & 1));
+	__m256i t[2 * m], bi, u, x, c;
+	uint i, l;
+
+	for (l = 0; l < 2 * m; l++)
+		t[l] = _mm256_setzero_si256();
+
+	for (i = 0; i < m; i++) {
+		__m256i *ti = t + i;
+
+		bi = _mm256_set1_epi64x(b[i]);
+		for (l = 0; l < m; l++) {
+			x = _mm256_load_si256((const __m256i *)(acc + l * ALANES));
+			ti[l] = _mm256_add_epi64(ti[l], _mm256_mul_epu32(x, bi));
+		}
+
+		u = _mm256_and_si256(ti[0], rmask);
+		u = _mm256_and_si256(_mm256_mul_epu32(u, k0v), rmask);
+		for (l = 0; l < m; l++) {
+			x = _mm256_set1_epi64x(p[l]);
+			ti[l] = _mm256_add_epi64(ti[l], _mm256_mul_epu32(u, x));
+		}
+
+		ti[1] = _mm256_add_epi64(ti[1], _mm256_srli_epi64(ti[0], ARADIX));
+	}
+
+	c = _mm256_setzero_si256();
+	for (l = 0; l < m; l++) {
+		x = _mm256_add_epi64(t[m + l], c);
+		c = _mm256_srli_epi64(x, ARADIX);
+		x = _mm256_and_si256(x, rmask);
+		_mm256_maskstore_epi64((long long *)(acc + l * ALANES), smask, x);
+	}
+}
+
+/* AVX-512 IFMA kernel: 52-bit limbs, products split in low and high halves */
+
+#define IRADIX 52
+#define ILANES 8
+#define IMASK ((1UL << IRADIX) - 1)
+
+static int ifma_supported(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512ifma");
+}
+
+__attribute__((target("avx512f,avx512ifma")))
+static void ifma_mul(uint m, uint64_t *acc, const uint64_t *b,
+		const uint64_t *p, uint64_t k0, uint mask)
+{
+	const __m512i rmask = _mm512_set1_epi64(IMASK);
+	const __m512i k0v = _mm512_set1_epi64(k0);
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i t[2 * m], bi, u, x, c;
+	uint i, l;
+
+	for (l = 0; l < 2 * m; l++)
+		t[l] = zero;
+
+	for (i = 0; i < m; i++) {
+		__m512i *ti = t + i;
+
+		bi = _mm512_set1_epi64(b[i]);
+		for (l = 0; l < m; l++) {
+			x = _mm512_load_si512(acc + l * ILANES);
+			ti[l] = _mm512_madd52lo_epu64(ti[l], x, bi);
+			ti[l + 1] = _mm512_madd52hi_epu64(ti[l + 1], x, bi);
+		}
+
+		/* only the low 52 bits of ti[0] matter for u */
+		u = _mm512_madd52lo_epu64(zero, ti[0], k0v);
+		for (l = 0; l < m; l++) {
+			x = _mm512_set1_epi64(p[l]);
+			ti[l] = _mm512_madd52lo_epu64(ti[l], u, x);
+			ti[l + 1] = _mm512_madd52hi_epu64(ti[l + 1], u, x);
+		}
+
+		ti[1] = _mm512_add_epi64(ti[1], _mm512_srli_epi64(ti[0], IRADIX));
+	}
+
+	c = zero;
+	for (l = 0; l < m; l++) {
+		x = _mm512_add_epi64(t[m + l], c);
+		c = _mm512_srli_epi64(x, IRADIX);
+		x = _mm512_and_si512(x, rmask);
+		_mm512_mask_store_epi64(acc + l * ILANES, (__mmask8)mask, x);
+	}
+}
+
+/* fastest first */
+static const struct simd_kernel kernels[] = {
+	{ "avx512ifma", IRADIX, ILANES, ifma_supported, ifma_mul },
+	{ "avx2", ARADIX, ALANES, avx2_supported, avx2_mul },
+	{ "generic", GRADIX, GLANES, generic_supported, generic_mul },
+};
+
+static const struct simd_kernel *simd_kernel_select(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]) - 1; i++)
+		if (kernels[i].supported())
+			return &kernels[i];
+	return &kernels[i];
+}
+
+const char *simd_kernel_name(void)
+{
+	return simd_kernel_select()->name;
+}
+
+int simd_accelerated(void)
+{
+	return simd_kernel_select()->supported != generic_supported;
+}
+
+/* conversions between mpz_t and radix limbs */
+
+/**
+ * Splits num into m limbs of radix bits, written at repr[0], repr[stride],
+ * ..., repr[(m - 1) * stride].
+ */
+static void to_radix(const mpz_t num, uint radix, uint m,
+		uint64_t *repr, size_t stride)
+{
+	const uint64_t rmask = (1UL << radix) - 1;
+	size_t nsz = mpz_size(num), pos, w, sh;
+	uint64_t v;
+	uint l;
+
+	for (l = 0, pos = 0; l < m; l++, pos += radix) {
+		w = pos / GMP_NUMB_BITS;
+		sh = pos % GMP_NUMB_BITS;
+		v = w < nsz ? mpz_getlimbn(num, w) >> sh : 0;
+		if (sh + radix > GMP_NUMB_BITS && w + 1 < nsz)
+			v |= mpz_getlimbn(num, w + 1) << (GMP_NUMB_BITS - sh);
+		repr[l * stride] = v & rmask;
+	}
+}
+
+/**
+ * Reverse of to_radix. Limbs must be normalized (less than 2^radix).
+ */
+static void from_radix(mpz_t num, uint radix, uint m,
+		const uint64_t *repr, size_t stride)
+{
+	size_t nsz = ((size_t)radix * m + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+	size_t pos, w, sh;
+	mp_limb_t *d;
+	uint l;
+
+	d = mpz_limbs_write(num, nsz);
+	memset(d, 0, nsz * sizeof(d[0]));
+	for (l = 0, pos = 0; l < m; l++, pos += radix) {
+		w = pos / GMP_NUMB_BITS;
+		sh = pos % GMP_NUMB_BITS;
+		d[w] |= repr[l * stride] << sh;
+		if (sh + radix > GMP_NUMB_BITS)
+			d[w + 1] |= repr[l * stride] >> (GMP_NUMB_BITS - sh);
+	}
+	mpz_limbs_finish(num, nsz);
+}
+
+struct simd_state {
+	const struct simd_kernel *k;
+	const struct database *db;
+	mpz_srcptr prime;
+	const mpz_t *inp;
+	size_t inplen, outlen, blocks;
+	uint m;
+	/* prime, R `mod` p, R^2 `mod` p and plain 1, m radix limbs each */
+	uint64_t *p, *one, *r2, *redc;
+	/* query elements in Montgomery representation, m limbs each */
+	uint64_t *q;
+	/* query elements while converted, lanes of them interleaved */
+	uint64_t *stage;
+	/* accumulators of lanes outputs each, interleaved */
+	uint64_t *acc;
+	uint64_t k0;
+};
+
+static void simd_release(struct simd_state *st)
+{
+	free(st->p);
+	free(st->one);
+	free(st->r2);
+	free(st->redc);
+	free(st->q);
+	free(st->stage);
+	free(st->acc);
+}
+
+/**
+ * Converts the query elements to Montgomery representation, lanes of them at
+ * a time: multiplied by R^2 `mod` p with the kernel, so that the conversion
+ * is as parallel as the compute. Results are below 2p, as the kernel needs.
+ */
+static void simd_convert(struct simd_state *st)
+{
+	const struct simd_kernel *k = st->k;
+	const uint lanes = k->lanes, radix = k->radix, m = st->m;
+	const uint full = (1U << lanes) - 1;
+	const size_t groups = (st->inplen + lanes - 1) / lanes;
+	size_t g;
+
+#ifdef HAVEOMP
+#pragma omp parallel for schedule(OMPSCHED)
+#endif
+	for (g = 0; g < groups; g++) {
+		uint64_t *a = st->stage + g * m * lanes;
+		size_t j;
+		uint l, s;
+		mpz_t aux;
+
+		for (s = 0, j = g * lanes; s < lanes; s++, j++) {
+			if (j >= st->inplen) {
+				for (l = 0; l < m; l++)
+					a[l * lanes + s] = 0;
+			} else if (mpz_cmp(st->inp[j], st->prime) < 0) {
+				to_radix(st->inp[j], radix, m, a + s, lanes);
+			} else {
+				/* not reduced by the client */
+				mpz_init(aux);
+				mpz_mod(aux, st->inp[j], st->prime);
+				to_radix(aux, radix, m, a + s, lanes);
+				mpz_clear(aux);
+			}
+		}
+
+		k->mul(m, a, st->r2, st->p, st->k0, full);
+
+		for (s = 0, j = g * lanes; s < lanes && j < st->inplen;
+				s++, j++)
+			for (l = 0; l < m; l++)
+				st->q[j * m + l] = a[l * lanes + s];
+	}
+}
+
+/**
+ * Loads the prime and numbers of qr, (re)allocating the buffers if the
+ * prime needs another number of radix limbs.
+ */
+static void simd_load(struct simd_state *st, struct query *qr)
+{
+	const uint lanes = st->k->lanes, radix = st->k->radix;
+	const size_t groups = (st->inplen + lanes - 1) / lanes;
+	uint m;
+	mpz_t aux, base;
+
+	st->prime = qr->prime;
+	st->inp = (const mpz_t *)qr->numbers;
+	m = (mpz_sizeinbase(qr->prime, 2) + 2 + radix - 1) / radix;
+
+	if (m != st->m) {
+		simd_release(st);
+		st->m = m;
+		st->p = calloc(m, sizeof(st->p[0]));
+		st->one = calloc(m, sizeof(st->one[0]));
+		st->r2 = calloc(m, sizeof(st->r2[0]));
+		st->redc = calloc(m, sizeof(st->redc[0]));
+		st->q = calloc(st->inplen * m, sizeof(st->q[0]));
+		st->stage = aligned_alloc(SIMDALIGN,
+				groups * m * lanes * sizeof(st->stage[0]));
+		st->acc = aligned_alloc(SIMDALIGN,
+				st->blocks * m * lanes * sizeof(st->acc[0]));
+		if (!st->p || !st->one || !st->r2 || !st->redc || !st->q ||
+				!st->stage || !st->acc) {
+			fprintf(stderr, "Cannot allocate memory for SIMD engine!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	mpz_init(aux);
+	mpz_init(base);
+
+	/* k0 = -p^-1 mod 2^radix */
+	mpz_ui_pow_ui(base, 2, radix);
+	mpz_invert(aux, qr->prime, base);
+	mpz_sub(aux, base, aux);
+	st->k0 = mpz_get_ui(aux);
+
+	/* R = 2^(radix * m), one = R mod p */
+	mpz_ui_pow_ui(base, 2, radix * m);
+	mpz_mod(aux, base, qr->prime);
+	to_radix(qr->prime, radix, m, st->p, 1);
+	to_radix(aux, radix, m, st->one, 1);
+	mpz_mul(aux, aux, aux);
+	mpz_mod(aux, aux, qr->prime);
+	to_radix(aux, radix, m, st->r2, 1);
+	st->redc[0] = 1;
+
+	mpz_clear(aux);
+	mpz_clear(base);
+
+	simd_convert(st);
+}
+
+static void *simd_prepare(struct query *qr, const struct database *db,
+		size_t table_budget)
+{
+	struct simd_state *st = calloc(1, sizeof(*st));
+
+	(void) table_budget;
+	if (!st) {
+		fprintf(stderr, "Cannot allocate memory for SIMD engine!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	st->k = simd_kernel_select();
+	st->db = db;
+	st->inplen = db->k;
+	st->outlen = db->rows;
+	st->blocks = (st->outlen + st->k->lanes - 1) / st->k->lanes;
+
+	simd_load(st, qr);
+	return st;
+}
+
+static int simd_reload(void *state, struct query *qr)
+{
+	simd_load(state, qr);
+	return 0;
+}
+
+static void simd_compute(void *state)
+{
+	struct simd_state *st = state;
+	const struct simd_kernel *k = st->k;
+	const uint lanes = k->lanes, m = st->m;
+	const uint full = (1U << lanes) - 1;
+	const size_t outlen = st->outlen;
+	uint64_t *p = st->p, *q = st->q, k0 = st->k0;
+	size_t blk, j;
+
+#ifdef HAVEOMP
+#pragma omp parallel for private(j) schedule(OMPSCHED)
+#endif
+	for (blk = 0; blk < st->blocks; blk++) {
+		uint64_t *a = st->acc + blk * m * lanes;
+		size_t i0 = blk * lanes;
+		uint l, s, mask;
+
+		latency_begin();
+		for (l = 0; l < m; l++)
+			for (s = 0; s < lanes; s++)
+				a[l * lanes + s] = st->one[l];
+
+		for (j = 0; j < st->inplen; j++) {
+			mask = 0;
+			for (s = 0; s < lanes && i0 + s < outlen; s++)
+				mask |= (uint)db_bit(st->db, i0 + s, j) << s;
+			if (mask)
+				k->mul(m, a, q + j * m, p, k0, mask);
+		}
+
+		/* out of Montgomery: multiply by plain 1, result is <= p */
+		k->mul(m, a, st->redc, p, k0, full);
+		latency_end();
+	}
+}
+
+static void simd_results(void *state, mpz_t *out)
+{
+	struct simd_state *st = state;
+	const uint lanes = st->k->lanes;
+	size_t i;
+
+	/* back to row layout */
+	for (i = 0; i < st->outlen; i++) {
+		from_radix(out[i], st->k->radix, st->m,
+				st->acc + (i / lanes) * st->m * lanes +
+				i % lanes, lanes);
+		if (mpz_cmp(out[i], st->prime) >= 0)
+			mpz_sub(out[i], out[i], st->prime);
+	}
+}
+
+static void simd_finish(void *state, mpz_t *out)
+{
+	struct simd_state *st = state;
+	size_t i;
+
+	if (out) {
+		for (i = 0; i < st->outlen; i++)
+			mpz_init(out[i]);
+		simd_results(st, out);
+	}
+
+	simd_release(st);
+	free(st);
+}
+
+const struct engine simd_engine = {
+	"simd", simd_prepare, simd_reload, simd_compute, simd_results,
+	simd_finish, NULL, NULL, NULL, NULL
+};
@@ -0,0 +1,31 @@
+#ifndef SIMD_H__
+#define SIMD_H__
+
+struct engine;
+
+/**
+ * Vertically batched Montgomery engine: each lane of a vector register holds
+ * a different output, all lanes go through the same sequence of
+ * multiplications (lanes not selected by their database row keep their old
+ * value). Outputs are stored limb-interleaved while computing and converted
+ * back to mpz_t at the end.
+ *
+ * The kernel is picked at run time using CPUID:
+ * 	- AVX-512 IFMA: 8 lanes, 52-bit limbs (vpmadd52luq/vpmadd52huq)
+ * 	- AVX2: 4 lanes, 26-bit limbs (vpmuludq)
+ * 	- portable C: 4 lanes, 26-bit limbs
+ */
+extern const struct engine simd_engine;
+
+/**
+ * Returns the name of the kernel the SIMD engine will use on this machine.
+ */
+const char *simd_kernel_name(void);
+
+/**
+ * Returns 1 if the CPU has one of the vector kernels, 0 if only the portable
+ * one can be used.
+ */
+int simd_accelerated(void);
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "tune.h"
+
+#define CPUINFO "/proc/cpuinfo"
+
+void tune_cpu(char *cpu, size_t len)
+{
+	char line[256], *model = NULL;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	FILE *f;
+
+	f = fopen(CPUINFO, "r");
+	while (f && fgets(line, sizeof(line), f))
+		if (!strncmp(line, "model name", 10) &&
+				(model = strchr(line, ':'))) {
+			model += strspn(model, ": \t");
+			model[strcspn(model, "\n")] = '\0';
+			break;
+		}
+	if (f)
+		fclose(f);
+
+	snprintf(cpu, len, "%s (%ld cpus)", model ? model : "unknown",
+			n > 0 ? n : 1);
+}
+
+int tune_load(const char *fname, struct tune_profile *p)
+{
+	char line[512], engine[TUNE_NAME_LEN], sched[TUNE_NAME_LEN];
+	struct tune_entry e;
+	FILE *f;
+	int s;
+
+	memset(p, 0, sizeof(*p));
+	f = fopen(fname, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strncmp(line, "cpu ", 4)) {
+			snprintf(p->cpu, sizeof(p->cpu), "%.*s",
+					(int)sizeof(p->cpu) - 1, line + 4);
+			continue;
+		}
+		if (line[0] == '#' || !line[0])
+			continue;
+
+		memset(&e, 0, sizeof(e));
+		if (sscanf(line, "keysize %lu engine %15s threads %d sched %15s "
+					"tile %lu width %u mmps %lf",
+					&e.keysize, engine, &e.threads, sched,
+					&e.tile, &e.width, &e.mmps) != 7 ||
+				(s = pool_sched_parse(sched)) < 0 ||
+				e.threads < 1) {
+			fprintf(stderr, "Invalid tuning profile %s: %s\n",
+					fname, line);
+			fclose(f);
+			tune_free(p);
+			return -1;
+		}
+		snprintf(e.engine, sizeof(e.engine), "%s", engine);
+		e.sched = s;
+		tune_put(p, &e);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+int tune_save(const char *fname, const struct tune_profile *p)
+{
+	const struct tune_entry *e;
+	size_t i;
+	FILE *f;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		perror(fname);
+		return -1;
+	}
+
+	fprintf(f, "# written by --autotune, read by later runs\n");
+	fprintf(f, "cpu %s\n", p->cpu);
+	for (i = 0; i < p->count; i++) {
+		e = &p->entries[i];
+		fprintf(f, "keysize %lu engine %s threads %d sched %s tile %lu "
+				"width %u mmps %.3f\n", e->keysize, e->engine,
+				e->threads, pool_sched_name(e->sched), e->tile,
+				e->width, e->mmps);
+	}
+
+	if (fclose(f)) {
+		perror(fname);
+		return -1;
+	}
+	return 0;
+}
+
+const struct tune_entry *tune_find(const struct tune_profile *p,
+		size_t keysize)
+{
+	size_t i;
+
+	for (i = 0; i < p->count; i++)
+		if (p->entries[i].keysize == keysize)
+			return &p->entries[i];
+	return NULL;
+}
+
+void tune_put(struct tune_profile *p, const struct tune_entry *e)
+{
+	struct tune_entry *old = (struct tune_entry *)tune_find(p, e->keysize);
+
+	if (old) {
+		*old = *e;
+		return;
+	}
+
+	p->entries = realloc(p->entries, (p->count + 1) * sizeof(p->entries[0]));
+	if (!p->entries) {
+		fprintf(stderr, "Cannot allocate memory for tuning profile!\n");
+		exit(EXIT_FAILURE);
+	}
+	p->entries[p->count++] = *e;
+}
+
+void tune_free(struct tune_profile *p)
+{
+	free(p->entries);
+	p->entries = NULL;
+	p->count = 0;
+}
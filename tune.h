@@ -0,0 +1,67 @@
+#ifndef TUNE_H__
+#define TUNE_H__
+
+#include <stddef.h>
+
+#define TUNE_NAME_LEN 16
+#define TUNE_CPU_LEN 128
+
+/**
+ * Fastest configuration of the server found by --autotune for one key size.
+ */
+struct tune_entry {
+	size_t keysize;
+	char engine[TUNE_NAME_LEN];
+	int threads;
+	/* scheduler of the IR passes (an enum pool_sched) */
+	int sched;
+	/* outputs per IR tile, 0 for the engine's choice */
+	size_t tile;
+	/* width of Four-Russians tables, 0 for none */
+	unsigned int width;
+	/* measured with this configuration */
+	double mmps;
+};
+
+/**
+ * Tuning profile of a host: its CPU (see tune_cpu) and one entry per key
+ * size. The file is text, one "key value" pair per setting:
+ *
+ * 	cpu <model> (<n> cpus)
+ * 	keysize 2048 engine ir threads 8 sched pool tile 4 width 0 mmps 1.5
+ */
+struct tune_profile {
+	char cpu[TUNE_CPU_LEN];
+	size_t count;
+	struct tune_entry *entries;
+};
+
+/**
+ * Describes the host: CPU model name and number of online CPUs.
+ */
+void tune_cpu(char *cpu, size_t len);
+
+/**
+ * Reads the profile in fname. Returns -1 if it is missing or invalid.
+ */
+int tune_load(const char *fname, struct tune_profile *p);
+
+/**
+ * Writes p to fname. Returns -1 on errors.
+ */
+int tune_save(const char *fname, const struct tune_profile *p);
+
+/**
+ * Returns the entry of p for keysize, NULL if there is none.
+ */
+const struct tune_entry *tune_find(const struct tune_profile *p,
+		size_t keysize);
+
+/**
+ * Adds e to p, replacing the entry of the same key size.
+ */
+void tune_put(struct tune_profile *p, const struct tune_entry *e);
+
+void tune_free(struct tune_profile *p);
+
+#endif